@@ -0,0 +1,36 @@
+// shared by the post-processing passes, inserted after their #version line by GL::ReadPostShaderSource
+
+layout(binding=0) uniform usampler2D gbuffer;
+
+// camera corners relative to the camera position, as passed to the raytracer
+uniform vec3 cameraTopLeft;
+uniform vec3 cameraTopRight;
+uniform vec3 cameraBottomLeft;
+
+vec3 decodeNormal(uint encoded)
+{
+	vec2 p = unpackSnorm2x16(encoded);
+	vec3 n = vec3(p, 1.0 - abs(p.x) - abs(p.y));
+
+	if (n.z < 0.0)
+	{
+		n.xy = (1.0 - abs(n.yx)) * vec2(n.x >= 0.0 ? 1.0 : -1.0, n.y >= 0.0 ? 1.0 : -1.0);
+	}
+
+	return normalize(n);
+}
+
+// the G-buffer holds the distance along the primary ray and an octahedral normal,
+// positions are rebuilt from the ray through the texel, both are zero for a miss
+void fetchGBuffer(vec2 uv, out vec3 position, out vec3 normal)
+{
+	ivec2 size = textureSize(gbuffer, 0);
+	ivec2 texel = clamp(ivec2(uv * vec2(size)), ivec2(0), size - 1);
+	uvec2 data = texelFetch(gbuffer, texel, 0).xy;
+
+	vec2 rayUV = vec2(texel) / vec2(size);
+	vec3 rayDirection = normalize(cameraTopLeft + (cameraTopRight - cameraTopLeft) * rayUV.x + (cameraBottomLeft - cameraTopLeft) * rayUV.y);
+
+	position = rayDirection * uintBitsToFloat(data.x);
+	normal = data.x != 0u ? decodeNormal(data.y) : vec3(0.0);
+}
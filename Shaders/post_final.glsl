@@ -1,9 +1,14 @@
 #version 420 core
 
-layout(binding=0) uniform sampler2D positions;
-layout(binding=1) uniform sampler2D normals;
 layout(binding=2) uniform sampler2D SSAO;
 
+// traversal cost per pixel, only bound by builds with SPHEREFLAKE_HEATMAP defined
+layout(binding=3) uniform sampler2D heatmap;
+
+// 0 disables the overlay, 1 to 4 select nodes visited, bounding tests, active lanes per node and bounding hits
+uniform int heatmapChannel;
+uniform float heatmapScale;
+
 uniform vec3 cameraPosition;
 uniform vec2 framebufferSize;
 uniform float ssaoFactor;
@@ -12,19 +17,44 @@ const vec3 lightDir = vec3(0.7, 0.7, 0.2);
 
 out vec4 outColor;
 
+// blue through green to red as the normalized cost goes from 0 to 1
+vec3 heatColor(float value)
+{
+	value = clamp(value, 0.0, 1.0);
+	return clamp(vec3(2.0 * value - 0.5, 1.5 - abs(2.0 * value - 1.0) * 2.0, 1.5 - 2.0 * value), 0.0, 1.0);
+}
+
+vec3 applyHeatmap(vec2 uv, vec3 color)
+{
+	if (heatmapChannel == 0)
+	{
+		return color;
+	}
+
+	ivec2 size = textureSize(heatmap, 0);
+	ivec2 texel = clamp(ivec2(uv * vec2(size)), ivec2(0), size - 1);
+	float value = texelFetch(heatmap, texel, 0)[heatmapChannel - 1] * heatmapScale;
+
+	// a little of the shading is kept so the geometry stays recognizable under the overlay
+	return heatColor(value) * (0.7 + 0.3 * dot(color, vec3(1.0 / 3.0)));
+}
+
 void main()
 {
 	vec2 uv = gl_FragCoord.xy / framebufferSize;
 
-	vec3 position = texture(positions, uv).xyz;
+	vec3 position;
+	vec3 normal;
+	fetchGBuffer(uv, position, normal);
+
 	if(length(position) == 0.0)
 	{
-		outColor = vec4(0, 0, 0, 1);
+		outColor = vec4(applyHeatmap(uv, vec3(0.0)), 1.0);
 		return;
 	}
 
 	vec3 ssao = texture(SSAO, uv).xyz;
 	vec3 color = (0.5 + 0.5 * (position + cameraPosition));
 
-	outColor = vec4(color * ssao, 1.0);
+	outColor = vec4(applyHeatmap(uv, color * ssao), 1.0);
 }
\ No newline at end of file
@@ -1,7 +1,5 @@
 #version 420 core
 
-layout(binding=0) uniform sampler2D positions;
-layout(binding=1) uniform sampler2D normals;
 layout(binding=2) uniform sampler2D noiseTexture;
 
 uniform vec3 cameraPosition;
@@ -18,7 +16,10 @@ out vec4 outColor;
 
 float occlude(vec2 uv, vec3 position, vec3 normal)
 {
-	vec3 samplePosition = texture(positions, (gl_FragCoord.xy + uv) / framebufferSize.xy).xyz;
+	vec3 samplePosition;
+	vec3 sampleNormal;
+	fetchGBuffer((gl_FragCoord.xy + uv) / framebufferSize.xy, samplePosition, sampleNormal);
+
 	vec3 diff = samplePosition - position;
 	float dist = length(diff);
 	return max(0.0, dot(normal, diff / dist) - SSAOBias) * (1.0 / (1.0 + dist * dist * SSAOScale)) * SSAOIntensity;
@@ -28,7 +29,9 @@ void main()
 {
 	vec2 uv = gl_FragCoord.xy / framebufferSize;
 
-	vec3 position = texture(positions, uv).xyz;
+	vec3 position;
+	vec3 normal;
+	fetchGBuffer(uv, position, normal);
 
 	if(length(position) == 0.0)
 	{
@@ -36,8 +39,6 @@ void main()
 		return;
 	}
 
-	vec3 normal = texture(normals, uv).xyz;
-
 	float ao = 0.0f;
 	float rad = SSAOSampleRadius / sqrt(abs(position.z));
 
@@ -0,0 +1,1107 @@
+/*
+ * Sphereflake Raytracer v1.0
+ *
+ * Copyright (c) 2014, Alexander Dzhoganov (alexander.dzhoganov@gmail.com)
+ * Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice appear in all copies.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ * ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// headless microbenchmarks of the SIMD kernels and of full sphereflake traversal from a fixed set of cameras, and
+// thread scaling of the worker pool, results are printed as JSON so runs can be compared across commits and machines
+
+#pragma warning (push, 0)
+#pragma warning (disable: 4530) // disable warnings from code not under our control
+
+#include <iostream>
+#include <unordered_map>
+#include <sstream>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <random>
+#include <memory>
+#include <chrono>
+#include <limits>
+#include <cmath>
+
+#define GLM_FORCE_RADIANS
+#include <glm.hpp>
+#include <gtc/matrix_transform.hpp>
+#include <gtc/quaternion.hpp>
+#include <gtc/type_ptr.hpp>
+#include <gtx/quaternion.hpp>
+#include <gtx/simd_mat4.hpp>
+#include <gtx/simd_vec4.hpp>
+#include <gtx/transform.hpp>
+
+using namespace glm;
+
+#pragma warning (pop)
+
+#include "Util.h"
+#include "StringUtil.h"
+#include "CommandLine.h"
+
+#ifdef __ARCH_NO_AVX
+#include <tmmintrin.h>
+#include "SIMD_SSE.h"
+#else
+#include <immintrin.h>
+#include "SIMD_AVX.h"
+#endif
+
+#include "Sobol.h"
+#include "FrameArena.h"
+#include "Topology.h"
+#include "PerfCounters.h"
+#include "Sphereflake.h"
+
+// distinct inputs cycled through by the kernel benchmarks, small enough to stay in L1
+#define BENCH_KERNEL_INPUTS 64
+
+// a hit counts as correct within 1% of the reference depth and about 5 degrees of its normal, the LOD cut-off
+// depends on the other rays of a packet so even a converged image is not bit-identical to the reference
+#define BENCH_DEPTH_TOLERANCE 0.01f
+#define BENCH_NORMAL_TOLERANCE 0.996f
+
+#define BENCH_CONVERGENCE_THRESHOLDS { 0.5, 0.9, 0.99 }
+
+#define BENCH_WIDTH 1280
+#define BENCH_HEIGHT 720
+
+using namespace SphereflakeRaytracer;
+
+// statistics of the per-repetition samples of a benchmark, e.g. nanoseconds per ray
+struct Measurement
+{
+	Measurement() : mean(0.0), variance(0.0), min(0.0) {}
+
+	double mean;
+	double variance;
+	double min;
+
+	static Measurement FromSamples(const std::vector<double>& samples)
+	{
+		Measurement result;
+		if (samples.empty())
+		{
+			return result;
+		}
+
+		result.min = std::numeric_limits<double>::max();
+		for (auto sample : samples)
+		{
+			result.mean += sample;
+			result.min = std::min(result.min, sample);
+		}
+
+		result.mean /= (double) samples.size();
+
+		for (auto sample : samples)
+		{
+			result.variance += (sample - result.mean) * (sample - result.mean);
+		}
+
+		if (samples.size() > 1)
+		{
+			result.variance /= (double) (samples.size() - 1);
+		}
+
+		return result;
+	}
+
+	std::string ToJson() const
+	{
+		std::ostringstream json;
+		json << "{ \"mean\": " << mean << ", \"variance\": " << variance << ", \"stddev\": " << std::sqrt(variance);
+		json << ", \"min\": " << min << " }";
+		return json.str();
+	}
+};
+
+struct KernelResult
+{
+	std::string name;
+	std::string unit;
+	unsigned long long units;
+	Measurement nsPerUnit;
+	PerfCounterValues counters;
+};
+
+struct TraversalResult
+{
+	std::string camera;
+	TraversalStats stats;
+	Measurement nsPerRay;
+	PerfCounterValues counters;
+};
+
+struct ScalingResult
+{
+	size_t workers;
+	double seconds;
+	unsigned long long rays;
+	unsigned long long pixels;
+	Measurement raysPerSecond;
+	std::vector<unsigned long long> workerRays;
+	PerfCounterValues counters;
+};
+
+// quality of a published G-buffer against the fully traced reference of the same view
+struct ConvergenceSample
+{
+	ConvergenceSample() : time(0.0), correct(0.0), hitMismatch(0.0), depthError(0.0), normalError(0.0), sampled(0.0) {}
+
+	// milliseconds since the camera jump, not counting the time the workers were paused for the comparison
+	double time;
+
+	// pixels that agree with the reference: both miss, or both hit within BENCH_DEPTH_TOLERANCE and BENCH_NORMAL_TOLERANCE
+	double correct;
+
+	// pixels where one of the two hits and the other misses
+	double hitMismatch;
+
+	// mean relative depth error and mean normal error in degrees over the pixels where both hit
+	double depthError;
+	double normalError;
+
+	// pixels the workers have counted as traced for the new view, what the convergence check goes by
+	double sampled;
+};
+
+struct ConvergenceResult
+{
+	// mean of the repetitions at every sampling interval, repetitions that converged earlier keep their last sample
+	std::vector<ConvergenceSample> timeline;
+
+	// milliseconds until the correct fraction first reached every threshold in BENCH_CONVERGENCE_THRESHOLDS, and until
+	// every pixel had been traced, only over the repetitions that got there
+	std::vector<Measurement> timeToCorrect;
+	std::vector<size_t> reachedCorrect;
+	Measurement timeToConverged;
+};
+
+// fixed camera looking at target with z up, the corners match the viewer's 60 degree camera
+struct CanonicalCamera
+{
+	const char* name;
+	vec3 position;
+	vec3 target;
+};
+
+// the root sphere has radius 1 and sits at the origin
+static const CanonicalCamera canonicalCameras[] =
+{
+	// whole fractal in view, most rays miss or stop at the first levels
+	{ "far", vec3(0.0f, -12.0f, 4.0f), vec3(0.0f, 0.0f, 0.0f) },
+	// the viewer's default camera
+	{ "medium", vec3(-5.4098f, -7.2139f, 1.19006f), vec3(0.0f, 0.0f, 0.0f) },
+	// just off the root sphere looking along its surface, rays skim many children before hitting or escaping
+	{ "grazing", vec3(0.0f, -1.5f, 0.0f), vec3(0.745f, -0.667f, 0.0f) },
+	// a third of a radius above the first equatorial child, traversal runs to the deepest levels
+	{ "close-up", vec3(1.638f, -0.254f, 0.305f), vec3(1.3333f, 0.0f, 0.0f) },
+};
+
+inline void LoadPacket(SIMD::VecType& v, const float* values)
+{
+#ifdef __ARCH_NO_AVX
+	v = _mm_loadu_ps(values);
+#else
+	v = _mm256_loadu_ps(values);
+#endif
+}
+
+inline SIMD::VecType Broadcast(float value)
+{
+#ifdef __ARCH_NO_AVX
+	return _mm_set1_ps(value);
+#else
+	return _mm256_broadcast_ss(&value);
+#endif
+}
+
+inline SIMD::VecType Add(const SIMD::VecType& a, const SIMD::VecType& b)
+{
+#ifdef __ARCH_NO_AVX
+	return _mm_add_ps(a, b);
+#else
+	return _mm256_add_ps(a, b);
+#endif
+}
+
+inline SIMD::VecType And(const SIMD::VecType& a, const SIMD::VecType& b)
+{
+#ifdef __ARCH_NO_AVX
+	return _mm_and_ps(a, b);
+#else
+	return _mm256_and_ps(a, b);
+#endif
+}
+
+// keeps the optimizer from discarding kernel results
+inline float Consume(const SIMD::VecType& v)
+{
+	float lanes[SIMD::PacketSize];
+#ifdef __ARCH_NO_AVX
+	_mm_storeu_ps(lanes, v);
+#else
+	_mm256_storeu_ps(lanes, v);
+#endif
+
+	float sum = 0.0f;
+	for (auto i = 0u; i < SIMD::PacketSize; i++)
+	{
+		sum += lanes[i];
+	}
+
+	return sum;
+}
+
+volatile float benchSink;
+
+// counters of the benchmark thread with --perf-counters
+std::unique_ptr<PerfCounters> benchCounters;
+
+PerfCounterValues ReadBenchCounters()
+{
+	return benchCounters != nullptr ? benchCounters->Read() : PerfCounterValues();
+}
+
+void RandomPacket(std::mt19937& rng, SIMD::Vec3Packet& packet, float scale, bool normalize)
+{
+	std::uniform_real_distribution<float> distribution(-1.0f, 1.0f);
+
+	float x[SIMD::PacketSize];
+	float y[SIMD::PacketSize];
+	float z[SIMD::PacketSize];
+
+	for (auto i = 0u; i < SIMD::PacketSize; i++)
+	{
+		vec3 v(distribution(rng), distribution(rng), distribution(rng));
+		if (normalize)
+		{
+			v = glm::normalize(v + vec3(0.0f, 0.0f, 1e-3f));
+		}
+
+		v *= scale;
+		x[i] = v.x;
+		y[i] = v.y;
+		z[i] = v.z;
+	}
+
+	LoadPacket(packet.x, x);
+	LoadPacket(packet.y, y);
+	LoadPacket(packet.z, z);
+}
+
+// runs kernel(iterations) once per repetition and converts the timings to nanoseconds per unit
+template <typename Kernel>
+KernelResult RunKernel(const std::string& name, const std::string& unit, unsigned long long unitsPerIteration,
+	unsigned long long iterations, size_t repetitions, Kernel kernel)
+{
+	kernel(iterations / 10);
+
+	std::vector<double> samples;
+	PerfCounterValues counters;
+	for (auto r = 0u; r < repetitions; r++)
+	{
+		auto countersBefore = ReadBenchCounters();
+		auto start = std::chrono::high_resolution_clock::now();
+		kernel(iterations);
+		auto seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		counters += ReadBenchCounters() - countersBefore;
+		samples.push_back(seconds * 1e9 / (double) (iterations * unitsPerIteration));
+	}
+
+	KernelResult result;
+	result.name = name;
+	result.unit = unit;
+	result.units = iterations * unitsPerIteration;
+	result.counters = counters;
+	result.nsPerUnit = Measurement::FromSamples(samples);
+	return result;
+}
+
+std::vector<KernelResult> RunKernelBenchmarks(unsigned long long iterations, size_t repetitions)
+{
+	std::mt19937 rng(1234);
+	std::vector<KernelResult> results;
+
+	SIMD::Vec3Packet directions[BENCH_KERNEL_INPUTS];
+	SIMD::Vec3Packet origins[BENCH_KERNEL_INPUTS];
+	SIMD::Matrix4 matrices[BENCH_KERNEL_INPUTS];
+
+	std::uniform_real_distribution<float> angle(-180.0f, 180.0f);
+	for (auto i = 0u; i < BENCH_KERNEL_INPUTS; i++)
+	{
+		RandomPacket(rng, directions[i], 1.0f, true);
+		RandomPacket(rng, origins[i], 3.0f, false);
+
+		// rotations keep the product of the chain bounded
+		matrices[i].Set(CreateRotationMatrix(vec3(angle(rng), angle(rng), angle(rng))));
+	}
+
+	auto radiusSq = Broadcast(1.0f);
+
+	results.push_back(RunKernel("RaySphereIntersection", "ray", SIMD::PacketSize, iterations, repetitions,
+		[&](unsigned long long count)
+	{
+		auto sum = Broadcast(0.0f);
+		for (auto i = 0ull; i < count; i++)
+		{
+			auto t = Broadcast(0.0f);
+			auto mask = SIMD::RaySphereIntersection(directions[i % BENCH_KERNEL_INPUTS], origins[(i * 7) % BENCH_KERNEL_INPUTS], radiusSq, t);
+			sum = Add(sum, And(mask, t));
+		}
+
+		benchSink = Consume(sum);
+	}));
+
+	results.push_back(RunKernel("Matrix4Multiply", "matrix", 1, iterations, repetitions,
+		[&](unsigned long long count)
+	{
+		auto product = matrices[0];
+		for (auto i = 0ull; i < count; i++)
+		{
+			product = product * matrices[i % BENCH_KERNEL_INPUTS];
+		}
+
+		benchSink = product.m[0][0] + product.m[3][3];
+	}));
+
+	results.push_back(RunKernel("Normalize", "ray", SIMD::PacketSize, iterations, repetitions,
+		[&](unsigned long long count)
+	{
+		auto sum = Broadcast(0.0f);
+		for (auto i = 0ull; i < count; i++)
+		{
+			auto v = origins[i % BENCH_KERNEL_INPUTS];
+			SIMD::Normalize(v);
+			sum = Add(sum, v.x);
+		}
+
+		benchSink = Consume(sum);
+	}));
+
+	results.push_back(RunKernel("SobolSample", "sample", 1, iterations, repetitions,
+		[&](unsigned long long count)
+	{
+		float sum = 0.0f;
+		for (auto i = 0ull; i < count; i++)
+		{
+			sum += Sobol::Sample(i, (unsigned) (i & 1), 0x9e3779b9u);
+		}
+
+		benchSink = sum;
+	}));
+
+	return results;
+}
+
+const CanonicalCamera* FindCamera(const std::string& name)
+{
+	for (auto& camera : canonicalCameras)
+	{
+		if (name == camera.name)
+		{
+			return &camera;
+		}
+	}
+
+	return nullptr;
+}
+
+void SetLookAt(Sphereflake& sphereflake, const CanonicalCamera& camera, size_t width, size_t height)
+{
+	auto aspect = (float) width / (float) height;
+
+	// same scaling as Camera::GetScaling
+	auto d = tanf(glm::radians(30.0f)) / vec3(-aspect, 1.0f, 0.0f).length();
+
+	auto forward = normalize(camera.target - camera.position);
+	auto right = normalize(cross(forward, vec3(0.0f, 0.0f, 1.0f)));
+	auto up = cross(right, forward);
+
+	auto center = camera.position + forward;
+	sphereflake.SetView(camera.position,
+		center - right * aspect * d + up * d,
+		center + right * aspect * d + up * d,
+		center - right * aspect * d - up * d);
+}
+
+std::vector<TraversalResult> RunTraversalBenchmarks(size_t width, size_t height, const PacketShape& shape,
+	unsigned long long packetCount, size_t repetitions)
+{
+	std::vector<TraversalResult> results;
+
+	Sphereflake sphereflake(width, height);
+
+	for (auto& camera : canonicalCameras)
+	{
+		SetLookAt(sphereflake, camera, width, height);
+
+		// warm up caches and clocks before measuring
+		sphereflake.TracePackets(shape, packetCount / 10);
+
+		TraversalResult result;
+		result.camera = camera.name;
+
+		std::vector<double> samples;
+		for (auto r = 0u; r < repetitions; r++)
+		{
+			auto countersBefore = ReadBenchCounters();
+			auto start = std::chrono::high_resolution_clock::now();
+			auto stats = sphereflake.TracePackets(shape, packetCount);
+			auto seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+			result.counters += ReadBenchCounters() - countersBefore;
+
+			samples.push_back(seconds * 1e9 / (double) stats.rays);
+
+			result.stats += stats;
+		}
+
+		result.nsPerRay = Measurement::FromSamples(samples);
+		results.push_back(result);
+	}
+
+	return results;
+}
+
+// retraces the same view to convergence with 1, 2, 4 ... maxWorkers workers of one pool, a republished view is
+// converged once every pixel has been traced, rays traced past that are duplicates of pixels another worker got first
+std::vector<ScalingResult> RunScalingBenchmark(size_t width, size_t height, const PacketShape& shape, const CanonicalCamera& camera,
+	ThreadPlacement placement, size_t maxWorkers, size_t repetitions)
+{
+	std::vector<size_t> workerCounts;
+	for (size_t workers = 1; workers < maxWorkers; workers *= 2)
+	{
+		workerCounts.push_back(workers);
+	}
+
+	workerCounts.push_back(maxWorkers);
+
+	Sphereflake sphereflake(width, height);
+	sphereflake.SetPacketShape(shape);
+	SetLookAt(sphereflake, camera, width, height);
+
+	// the workers first-touch their G-buffer shares and park until the first measurement
+	placement.workerCount = maxWorkers;
+	sphereflake.SetThreadPlacement(placement);
+	sphereflake.SetPerfCounters(benchCounters != nullptr);
+	sphereflake.Pause();
+	sphereflake.Initialize();
+
+	auto pixels = (unsigned long long) (width * height);
+
+	std::vector<ScalingResult> results;
+	for (auto workers : workerCounts)
+	{
+		sphereflake.SetWorkerCount(workers);
+
+		ScalingResult result;
+		result.workers = workers;
+		result.seconds = 0.0;
+		result.rays = 0;
+		result.pixels = 0;
+		result.workerRays.resize(workers);
+
+		std::vector<double> samples;
+
+		// the first run warms up caches and clocks and lets new workers ramp up
+		for (auto r = 0u; r <= repetitions; r++)
+		{
+			auto countersBefore = sphereflake.GetStats().counters;
+
+			std::vector<unsigned long long> raysBefore(workers);
+			unsigned long long totalBefore = 0;
+			for (auto i = 0u; i < workers; i++)
+			{
+				raysBefore[i] = sphereflake.GetWorkerRays(i);
+				totalBefore += raysBefore[i];
+			}
+
+			auto start = std::chrono::high_resolution_clock::now();
+
+			if (sphereflake.IsPaused())
+			{
+				sphereflake.Resume();
+			}
+			else
+			{
+				// republishing the view starts a new epoch that has to be traced from scratch
+				sphereflake.SetPacketShape(shape);
+			}
+
+			// workers that have not woken up yet still count as parked, so idle alone does not mean converged
+			unsigned long long rays = 0;
+			for (;;)
+			{
+				unsigned long long total = 0;
+				for (auto i = 0u; i < workers; i++)
+				{
+					total += sphereflake.GetWorkerRays(i);
+				}
+
+				rays = total - totalBefore;
+				if (rays >= pixels && sphereflake.IsIdle())
+				{
+					break;
+				}
+
+				std::this_thread::sleep_for(std::chrono::microseconds(100));
+			}
+
+			auto seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+			if (r == 0)
+			{
+				continue;
+			}
+
+			samples.push_back((double) rays / seconds);
+			result.counters += sphereflake.GetStats().counters - countersBefore;
+			result.seconds += seconds;
+			result.rays += rays;
+			result.pixels += pixels;
+
+			for (auto i = 0u; i < workers; i++)
+			{
+				result.workerRays[i] += sphereflake.GetWorkerRays(i) - raysBefore[i];
+			}
+		}
+
+		result.raysPerSecond = Measurement::FromSamples(samples);
+		results.push_back(result);
+	}
+
+	return results;
+}
+
+// IPC and events per unit of work, nothing without counters
+void WriteCountersJson(std::ostringstream& json, const PerfCounterValues& counters, unsigned long long units, const std::string& unit)
+{
+	if (counters.available == 0 || units == 0)
+	{
+		return;
+	}
+
+	auto perUnit = [units](unsigned long long count) { return (double) count / (double) units; };
+
+	json << ", \"counters\": { \"ipc\": " << counters.GetIpc();
+	json << ", \"cycles_per_" << unit << "\": " << perUnit(counters.cycles);
+	json << ", \"instructions_per_" << unit << "\": " << perUnit(counters.instructions);
+
+	if (counters.available & PERF_COUNTER_L1D_MISSES)
+	{
+		json << ", \"l1d_misses_per_" << unit << "\": " << perUnit(counters.l1dMisses);
+	}
+
+	if (counters.available & PERF_COUNTER_LLC_MISSES)
+	{
+		json << ", \"llc_misses_per_" << unit << "\": " << perUnit(counters.llcMisses);
+	}
+
+	if (counters.available & PERF_COUNTER_BRANCH_MISSES)
+	{
+		json << ", \"branch_misses_per_" << unit << "\": " << perUnit(counters.branchMisses);
+	}
+
+	if (counters.available & PERF_COUNTER_LICENCE)
+	{
+		// share of the cycles at every licence level
+		auto licenceCycles = counters.licenceCycles[0] + counters.licenceCycles[1] + counters.licenceCycles[2];
+		json << ", \"licence_levels\": [";
+		for (auto level = 0u; level < PERF_LICENCE_LEVELS; level++)
+		{
+			json << (level > 0 ? ", " : "") << (licenceCycles > 0 ? (double) counters.licenceCycles[level] / (double) licenceCycles : 0.0);
+		}
+		json << "]";
+	}
+
+	json << " }";
+}
+
+// every pixel traced at least once and written back, the next publish merges all of it into the front buffer
+bool IsConverged(const Sphereflake& sphereflake, size_t width, size_t height)
+{
+	return sphereflake.GetSampledPixelCount() >= width * height;
+}
+
+void WaitForConvergence(const Sphereflake& sphereflake, size_t width, size_t height)
+{
+	while (!IsConverged(sphereflake, width, height))
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+}
+
+ConvergenceSample CompareGBuffer(const GBuffer& gbuffer, const std::vector<GBufferTexel>& reference)
+{
+	ConvergenceSample sample;
+
+	size_t correct = 0;
+	size_t mismatches = 0;
+	size_t hits = 0;
+	double depthError = 0.0;
+	double normalError = 0.0;
+
+	for (size_t i = 0; i < reference.size(); i++)
+	{
+		auto& texel = gbuffer.texels[i];
+		auto& expected = reference[i];
+
+		bool hit = texel.depth > 0.0f;
+		if (hit != (expected.depth > 0.0f))
+		{
+			mismatches++;
+			continue;
+		}
+
+		if (!hit)
+		{
+			correct++;
+			continue;
+		}
+
+		auto relativeError = fabsf(texel.depth - expected.depth) / expected.depth;
+		auto cosine = clamp(dot(texel.DecodeNormal(), expected.DecodeNormal()), -1.0f, 1.0f);
+
+		if (relativeError <= BENCH_DEPTH_TOLERANCE && cosine >= BENCH_NORMAL_TOLERANCE)
+		{
+			correct++;
+		}
+
+		hits++;
+		depthError += relativeError;
+		normalError += glm::degrees(acosf(cosine));
+	}
+
+	sample.correct = (double) correct / (double) reference.size();
+	sample.hitMismatch = (double) mismatches / (double) reference.size();
+	sample.depthError = hits > 0 ? depthError / (double) hits : 0.0;
+	sample.normalError = hits > 0 ? normalError / (double) hits : 0.0;
+	return sample;
+}
+
+// jumps from one camera to another and compares the frameless image to a fully traced reference of the new view
+// every interval, as a viewer publishing a frame every interval would show it, the workers are paused while the
+// comparison runs and the pauses are taken out of the timeline
+ConvergenceResult RunConvergenceBenchmark(size_t width, size_t height, const PacketShape& shape, const CanonicalCamera& from,
+	const CanonicalCamera& to, ThreadPlacement placement, bool progressive, double intervalMs, double maxTimeMs, size_t repetitions)
+{
+	std::vector<GBufferTexel> reference;
+	{
+		Sphereflake sphereflake(width, height);
+		sphereflake.SetPacketShape(shape);
+		sphereflake.SetThreadPlacement(placement);
+		SetLookAt(sphereflake, to, width, height);
+		sphereflake.Initialize();
+
+		WaitForConvergence(sphereflake, width, height);
+		auto& gbuffer = sphereflake.PublishGBuffer();
+		reference.assign(gbuffer.texels, gbuffer.texels + width * height);
+	}
+
+	Sphereflake sphereflake(width, height);
+	sphereflake.SetPacketShape(shape);
+	sphereflake.SetThreadPlacement(placement);
+	sphereflake.SetProgressiveRefinement(progressive);
+	SetLookAt(sphereflake, from, width, height);
+	sphereflake.Initialize();
+
+	const double thresholds[] = BENCH_CONVERGENCE_THRESHOLDS;
+	auto thresholdCount = sizeof(thresholds) / sizeof(thresholds[0]);
+
+	std::vector<std::vector<ConvergenceSample>> runs;
+	std::vector<std::vector<double>> timeToCorrect(thresholdCount);
+	std::vector<double> timeToConverged;
+
+	for (auto r = 0u; r < repetitions; r++)
+	{
+		// start every jump from a converged image of the first camera
+		SetLookAt(sphereflake, from, width, height);
+		WaitForConvergence(sphereflake, width, height);
+		sphereflake.PublishGBuffer();
+
+		std::vector<ConvergenceSample> run;
+		std::vector<bool> reached(thresholdCount, false);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		SetLookAt(sphereflake, to, width, height);
+
+		double paused = 0.0;
+		for (auto k = 1u;; k++)
+		{
+			auto target = start + std::chrono::duration_cast<std::chrono::high_resolution_clock::duration>(std::chrono::duration<double, std::milli>(k * intervalMs + paused));
+			std::this_thread::sleep_until(target);
+
+			bool converged = IsConverged(sphereflake, width, height);
+			auto sampled = (double) sphereflake.GetSampledPixelCount() / (double) (width * height);
+			auto& gbuffer = sphereflake.PublishGBuffer();
+
+			auto now = std::chrono::high_resolution_clock::now();
+			auto time = std::chrono::duration<double, std::milli>(now - start).count() - paused;
+
+			sphereflake.Pause();
+			auto sample = CompareGBuffer(gbuffer, reference);
+			sphereflake.Resume();
+
+			paused += std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - now).count();
+
+			sample.time = time;
+			sample.sampled = sampled;
+			run.push_back(sample);
+
+			for (auto i = 0u; i < thresholdCount; i++)
+			{
+				if (!reached[i] && sample.correct >= thresholds[i])
+				{
+					reached[i] = true;
+					timeToCorrect[i].push_back(time);
+				}
+			}
+
+			if (converged)
+			{
+				timeToConverged.push_back(time);
+				break;
+			}
+
+			if (time >= maxTimeMs)
+			{
+				break;
+			}
+		}
+
+		runs.push_back(run);
+	}
+
+	ConvergenceResult result;
+
+	size_t longest = 0;
+	for (auto& run : runs)
+	{
+		longest = std::max(longest, run.size());
+	}
+
+	for (size_t k = 0; k < longest; k++)
+	{
+		ConvergenceSample mean;
+		for (auto& run : runs)
+		{
+			auto& sample = run[std::min(k, run.size() - 1)];
+			mean.correct += sample.correct / (double) runs.size();
+			mean.hitMismatch += sample.hitMismatch / (double) runs.size();
+			mean.depthError += sample.depthError / (double) runs.size();
+			mean.normalError += sample.normalError / (double) runs.size();
+			mean.sampled += sample.sampled / (double) runs.size();
+		}
+
+		// the nominal sampling time, the actual ones only differ by the wake-up latency
+		mean.time = (double) (k + 1) * intervalMs;
+		result.timeline.push_back(mean);
+	}
+
+	for (auto i = 0u; i < thresholdCount; i++)
+	{
+		result.timeToCorrect.push_back(Measurement::FromSamples(timeToCorrect[i]));
+		result.reachedCorrect.push_back(timeToCorrect[i].size());
+	}
+
+	result.timeToConverged = Measurement::FromSamples(timeToConverged);
+	return result;
+}
+
+void WriteKernelJson(std::ostringstream& json, const std::vector<KernelResult>& kernels, size_t repetitions)
+{
+	json << "  \"kernels\": [" << std::endl;
+	for (auto i = 0u; i < kernels.size(); i++)
+	{
+		auto& kernel = kernels[i];
+		json << "    { \"name\": \"" << kernel.name << "\", \"unit\": \"" << kernel.unit << "\"";
+		json << ", \"units\": " << kernel.units;
+		json << ", \"ns_per_unit\": " << kernel.nsPerUnit.ToJson();
+		json << ", \"units_per_second_per_core\": " << 1e9 / kernel.nsPerUnit.mean;
+		WriteCountersJson(json, kernel.counters, kernel.units * repetitions, "unit");
+		json << " }";
+		json << (i + 1 < kernels.size() ? "," : "") << std::endl;
+	}
+	json << "  ]," << std::endl;
+}
+
+void WriteTraversalJson(std::ostringstream& json, const std::vector<TraversalResult>& traversals, size_t width, size_t height,
+	const PacketShape& shape, unsigned long long packetCount)
+{
+	json << "  \"traversal\": {" << std::endl;
+	json << "    \"width\": " << width << ", \"height\": " << height << ", \"packet_shape\": \"" << shape.ToString() << "\"";
+	json << ", \"packets\": " << packetCount << "," << std::endl;
+	json << "    \"cameras\": [" << std::endl;
+	for (auto i = 0u; i < traversals.size(); i++)
+	{
+		auto& traversal = traversals[i];
+		json << "      { \"name\": \"" << traversal.camera << "\", \"rays\": " << traversal.stats.rays;
+		json << ", \"ns_per_ray\": " << traversal.nsPerRay.ToJson();
+		json << ", \"rays_per_second_per_core\": " << 1e9 / traversal.nsPerRay.mean;
+		json << ", \"nodes_per_packet\": " << (double) traversal.stats.nodesVisited / (double) traversal.stats.packets;
+		json << ", \"lane_utilisation\": " << (double) traversal.stats.activeLanes / (double) traversal.stats.laneSlots;
+		json << ", \"sphere_tests_per_ray\": " << (double) traversal.stats.sphereTests / (double) traversal.stats.rays;
+		json << ", \"hit_ratio\": " << (double) traversal.stats.hits / (double) traversal.stats.rays;
+		json << ", \"lod_terminations_per_ray\": " << (double) traversal.stats.lodTerminations / (double) traversal.stats.rays;
+		json << ", \"max_depth\": " << traversal.stats.GetMaxDepth();
+		WriteCountersJson(json, traversal.counters, traversal.stats.rays, "ray");
+		json << " }";
+		json << (i + 1 < traversals.size() ? "," : "") << std::endl;
+	}
+	json << "    ]" << std::endl;
+	json << "  }" << std::endl;
+}
+
+void WriteScalingJson(std::ostringstream& json, const std::vector<ScalingResult>& results)
+{
+	json << "  \"scaling\": [" << std::endl;
+	for (auto i = 0u; i < results.size(); i++)
+	{
+		auto& result = results[i];
+
+		// per-thread throughput over the same wall time as the pool, imbalance is the busiest thread over the mean
+		double minRate = std::numeric_limits<double>::max();
+		double maxRate = 0.0;
+		double meanRate = 0.0;
+		for (auto workerRays : result.workerRays)
+		{
+			auto rate = (double) workerRays / result.seconds;
+			minRate = std::min(minRate, rate);
+			maxRate = std::max(maxRate, rate);
+			meanRate += rate;
+		}
+
+		meanRate /= (double) result.workerRays.size();
+
+		auto raysPerSecond = (double) result.rays / result.seconds;
+		auto speedup = raysPerSecond / ((double) results[0].rays / results[0].seconds);
+
+		json << "    { \"workers\": " << result.workers;
+		json << ", \"rays_per_second\": " << raysPerSecond;
+		json << ", \"rays_per_second_samples\": " << result.raysPerSecond.ToJson();
+		json << ", \"speedup\": " << speedup;
+		json << ", \"parallel_efficiency\": " << speedup / (double) result.workers;
+		json << ", \"duplicate_ratio\": " << 1.0 - (double) result.pixels / (double) result.rays;
+		json << ", \"per_thread_rays_per_second\": { \"min\": " << minRate << ", \"max\": " << maxRate << ", \"mean\": " << meanRate;
+		json << ", \"imbalance\": " << maxRate / meanRate << " }";
+		WriteCountersJson(json, result.counters, result.rays, "ray");
+		json << " }";
+		json << (i + 1 < results.size() ? "," : "") << std::endl;
+	}
+	json << "  ]" << std::endl;
+}
+
+void WriteConvergenceJson(std::ostringstream& json, const ConvergenceResult& result)
+{
+	const double thresholds[] = BENCH_CONVERGENCE_THRESHOLDS;
+
+	json << "  \"time_to_correct_ms\": {" << std::endl;
+	for (auto i = 0u; i < result.timeToCorrect.size(); i++)
+	{
+		json << "    \"" << thresholds[i] << "\": { \"reached\": " << result.reachedCorrect[i] << ", \"ms\": " << result.timeToCorrect[i].ToJson() << " }";
+		json << (i + 1 < result.timeToCorrect.size() ? "," : "") << std::endl;
+	}
+	json << "  }," << std::endl;
+
+	json << "  \"time_to_converged_ms\": " << result.timeToConverged.ToJson() << "," << std::endl;
+
+	json << "  \"timeline\": [" << std::endl;
+	for (auto i = 0u; i < result.timeline.size(); i++)
+	{
+		auto& sample = result.timeline[i];
+		json << "    { \"time_ms\": " << sample.time;
+		json << ", \"correct\": " << sample.correct;
+		json << ", \"hit_mismatch\": " << sample.hitMismatch;
+		json << ", \"depth_error\": " << sample.depthError;
+		json << ", \"normal_error_degrees\": " << sample.normalError;
+		json << ", \"sampled\": " << sample.sampled << " }";
+		json << (i + 1 < result.timeline.size() ? "," : "") << std::endl;
+	}
+	json << "  ]" << std::endl;
+}
+
+int main(int argc, char* argv[])
+{
+	CommandLine::Instance().ParseCommandLine(argc, argv, false);
+
+	size_t width = BENCH_WIDTH;
+	size_t height = BENCH_HEIGHT;
+	if (COMMANDLINE_HAS_KEY("width") && COMMANDLINE_HAS_KEY("height"))
+	{
+		width = COMMANDLINE_GET_INT_VALUE("width");
+		height = COMMANDLINE_GET_INT_VALUE("height");
+	}
+
+	size_t repetitions = 10;
+	if (COMMANDLINE_HAS_KEY("repetitions"))
+	{
+		repetitions = std::max(1, COMMANDLINE_GET_INT_VALUE("repetitions"));
+	}
+
+	unsigned long long packetCount = 50000;
+	if (COMMANDLINE_HAS_KEY("packets"))
+	{
+		packetCount = std::max(1, COMMANDLINE_GET_INT_VALUE("packets"));
+	}
+
+	unsigned long long iterations = 1000000;
+	if (COMMANDLINE_HAS_KEY("iterations"))
+	{
+		iterations = std::max(1, COMMANDLINE_GET_INT_VALUE("iterations"));
+	}
+
+	PacketShape shape;
+	if (COMMANDLINE_HAS_KEY("packet-shape") && !PacketShape::Parse(CommandLine::Instance().GetValue("packet-shape"), shape))
+	{
+		std::cout << "Invalid packet shape, expected WxH of at most " << MAX_PACKET_PIXELS << " pixels" << std::endl;
+		return 1;
+	}
+
+	auto topology = CpuTopology::Detect();
+
+	std::ostringstream json;
+	json << "{" << std::endl;
+#ifdef __ARCH_NO_AVX
+	json << "  \"simd\": \"sse\"," << std::endl;
+#else
+	json << "  \"simd\": \"avx\"," << std::endl;
+#endif
+	json << "  \"packet_size\": " << SIMD::PacketSize << "," << std::endl;
+	json << "  \"repetitions\": " << repetitions << "," << std::endl;
+
+	// opened on this thread, which runs the kernel and traversal benchmarks, the scaling run has its workers open their own
+	if (COMMANDLINE_HAS_KEY("perf-counters"))
+	{
+		benchCounters.reset(new PerfCounters());
+		json << "  \"perf_counters\": \"" << (benchCounters->IsAvailable() ? benchCounters->Read().Describe() : "unavailable, " + benchCounters->GetError()) << "\"," << std::endl;
+	}
+
+	if (COMMANDLINE_HAS_KEY("convergence"))
+	{
+		auto from = FindCamera(COMMANDLINE_HAS_KEY("from") ? CommandLine::Instance().GetValue("from") : "far");
+		auto to = FindCamera(COMMANDLINE_HAS_KEY("to") ? CommandLine::Instance().GetValue("to") : "medium");
+		if (from == nullptr || to == nullptr)
+		{
+			std::cout << "Invalid camera, expected far, medium, grazing or close-up" << std::endl;
+			return 1;
+		}
+
+		ThreadPlacement placement;
+		if (COMMANDLINE_HAS_KEY("affinity") && !ThreadPlacement::Parse(CommandLine::Instance().GetValue("affinity"), placement.policy))
+		{
+			std::cout << "Invalid affinity policy, expected none, compact or cores" << std::endl;
+			return 1;
+		}
+
+		placement.reserveMainCore = COMMANDLINE_HAS_KEY("reserve-main-core");
+
+		if (COMMANDLINE_HAS_KEY("workers"))
+		{
+			placement.workerCount = (size_t) std::max(1, COMMANDLINE_GET_INT_VALUE("workers"));
+		}
+
+		double interval = 16.0;
+		if (COMMANDLINE_HAS_KEY("interval"))
+		{
+			interval = std::max(1.0f, COMMANDLINE_GET_FLOAT_VALUE("interval"));
+		}
+
+		double maxTime = 10000.0;
+		if (COMMANDLINE_HAS_KEY("max-time"))
+		{
+			maxTime = COMMANDLINE_GET_FLOAT_VALUE("max-time");
+		}
+
+		bool progressive = COMMANDLINE_HAS_KEY("progressive");
+
+		auto result = RunConvergenceBenchmark(width, height, shape, *from, *to, placement, progressive, interval, maxTime, repetitions);
+
+		json << "  \"from\": \"" << from->name << "\", \"to\": \"" << to->name << "\", \"width\": " << width << ", \"height\": " << height;
+		json << ", \"packet_shape\": \"" << shape.ToString() << "\", \"progressive\": " << (progressive ? "true" : "false");
+		json << ", \"workers\": " << (placement.workerCount > 0 ? placement.workerCount : topology.GetAvailableWorkerCount());
+		json << ", \"interval_ms\": " << interval << "," << std::endl;
+		WriteConvergenceJson(json, result);
+	}
+	else if (COMMANDLINE_HAS_KEY("scaling"))
+	{
+		auto camera = FindCamera(COMMANDLINE_HAS_KEY("camera") ? CommandLine::Instance().GetValue("camera") : "medium");
+		if (camera == nullptr)
+		{
+			std::cout << "Invalid camera, expected far, medium, grazing or close-up" << std::endl;
+			return 1;
+		}
+
+		ThreadPlacement placement;
+		if (COMMANDLINE_HAS_KEY("affinity") && !ThreadPlacement::Parse(CommandLine::Instance().GetValue("affinity"), placement.policy))
+		{
+			std::cout << "Invalid affinity policy, expected none, compact or cores" << std::endl;
+			return 1;
+		}
+
+		placement.reserveMainCore = COMMANDLINE_HAS_KEY("reserve-main-core");
+
+		size_t maxWorkers = topology.GetAvailableWorkerCount();
+		if (COMMANDLINE_HAS_KEY("max-workers"))
+		{
+			maxWorkers = std::max(1, COMMANDLINE_GET_INT_VALUE("max-workers"));
+		}
+
+		auto results = RunScalingBenchmark(width, height, shape, *camera, placement, maxWorkers, repetitions);
+
+		json << "  \"camera\": \"" << camera->name << "\", \"width\": " << width << ", \"height\": " << height;
+		json << ", \"packet_shape\": \"" << shape.ToString() << "\"";
+		json << ", \"affinity\": \"" << (COMMANDLINE_HAS_KEY("affinity") ? CommandLine::Instance().GetValue("affinity") : "none") << "\"";
+		json << ", \"cpu_quota\": " << CpuTopology::GetCpuQuota() << "," << std::endl;
+		WriteScalingJson(json, results);
+	}
+	else
+	{
+		// everything runs on the calling thread, pinning it keeps the timings of one core free of migrations
+		int cpu = -1;
+		if (!topology.GetCpus().empty() && CpuTopology::SetCurrentThreadAffinity({ topology.GetCpus()[0].id }))
+		{
+			cpu = (int) topology.GetCpus()[0].id;
+		}
+
+		auto kernels = RunKernelBenchmarks(iterations, repetitions);
+		auto traversals = RunTraversalBenchmarks(width, height, shape, packetCount, repetitions);
+
+		json << "  \"cpu\": " << cpu << "," << std::endl;
+		WriteKernelJson(json, kernels, repetitions);
+		WriteTraversalJson(json, traversals, width, height, shape, packetCount);
+	}
+
+	json << "}" << std::endl;
+
+	if (COMMANDLINE_HAS_KEY("output"))
+	{
+		std::ofstream file(CommandLine::Instance().GetValue("output"));
+		if (!file)
+		{
+			std::cout << "Couldn't open output file: " << CommandLine::Instance().GetValue("output") << std::endl;
+			return 1;
+		}
+
+		file << json.str();
+	}
+	else
+	{
+		std::cout << json.str();
+	}
+
+	return 0;
+}
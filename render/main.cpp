@@ -0,0 +1,468 @@
+/*
+ * Sphereflake Raytracer v1.0
+ *
+ * Copyright (c) 2014, Alexander Dzhoganov (alexander.dzhoganov@gmail.com)
+ * Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice appear in all copies.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ * ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// headless offline renderer, traces full frames from one or more cameras with the worker pool and writes them as
+// image files, no window, GL context or GPU is needed so it runs on bare render nodes
+
+#pragma warning (push, 0)
+#pragma warning (disable: 4530) // disable warnings from code not under our control
+
+#include <iostream>
+#include <unordered_map>
+#include <sstream>
+#include <string>
+#include <fstream>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <random>
+#include <memory>
+#include <chrono>
+#include <limits>
+#include <stdexcept>
+#include <cmath>
+
+#define GLM_FORCE_RADIANS
+#include <glm.hpp>
+#include <gtc/matrix_transform.hpp>
+#include <gtc/quaternion.hpp>
+#include <gtc/type_ptr.hpp>
+#include <gtx/quaternion.hpp>
+#include <gtx/simd_mat4.hpp>
+#include <gtx/simd_vec4.hpp>
+#include <gtx/transform.hpp>
+
+using namespace glm;
+
+#pragma warning (pop)
+
+#include "Util.h"
+#include "StringUtil.h"
+#include "CommandLine.h"
+
+#ifdef __ARCH_NO_AVX
+#include <tmmintrin.h>
+#include "SIMD_SSE.h"
+#else
+#include <immintrin.h>
+#include "SIMD_AVX.h"
+#endif
+
+#include "camera.h"
+#include "Sobol.h"
+#include "FrameArena.h"
+#include "Topology.h"
+#include "PerfCounters.h"
+#include "Sphereflake.h"
+
+#define RENDER_WIDTH 1280
+#define RENDER_HEIGHT 720
+
+// share of the shading that does not depend on the angle to the light, keeps surfaces facing away from it readable
+#define RENDER_AMBIENT 0.25f
+
+using namespace SphereflakeRaytracer;
+
+struct RenderCamera
+{
+	vec3 position;
+	float pitch;
+	float yaw;
+};
+
+// x,y,z,pitch,yaw as taken by the viewer's --camera
+bool ParseCamera(const std::string& text, RenderCamera& camera)
+{
+	auto values = split(text, ',');
+	if (values.size() != 5)
+	{
+		return false;
+	}
+
+	try
+	{
+		camera.position = vec3(stof(values[0]), stof(values[1]), stof(values[2]));
+		camera.pitch = stof(values[3]);
+		camera.yaw = stof(values[4]);
+	}
+	catch (const std::exception&)
+	{
+		return false;
+	}
+
+	return true;
+}
+
+// --cameras=FILE has one camera per line, empty lines and lines starting with # are skipped, otherwise --camera or
+// the viewer's initial camera
+bool LoadCameras(std::vector<RenderCamera>& cameras)
+{
+	if (!COMMANDLINE_HAS_KEY("cameras"))
+	{
+		RenderCamera camera;
+		camera.position = vec3(-5.4098f, -7.2139f, 1.19006f);
+		camera.pitch = -1.371f;
+		camera.yaw = 0.921999f;
+
+		if (COMMANDLINE_HAS_KEY("camera") && !ParseCamera(CommandLine::Instance().GetValue("camera"), camera))
+		{
+			std::cout << "Invalid camera, expected x,y,z,pitch,yaw" << std::endl;
+			return false;
+		}
+
+		cameras.push_back(camera);
+		return true;
+	}
+
+	auto& filename = CommandLine::Instance().GetValue("cameras");
+	std::ifstream file(filename);
+	if (!file)
+	{
+		std::cout << "Couldn't open camera file: " << filename << std::endl;
+		return false;
+	}
+
+	std::string line;
+	for (auto number = 1u; std::getline(file, line); number++)
+	{
+		if (!line.empty() && line.back() == '\r')
+		{
+			line.pop_back();
+		}
+
+		if (line.empty() || line[0] == '#')
+		{
+			continue;
+		}
+
+		RenderCamera camera;
+		if (!ParseCamera(line, camera))
+		{
+			std::cout << filename << ":" << number << ": invalid camera, expected x,y,z,pitch,yaw" << std::endl;
+			return false;
+		}
+
+		cameras.push_back(camera);
+	}
+
+	if (cameras.empty())
+	{
+		std::cout << "No cameras in " << filename << std::endl;
+		return false;
+	}
+
+	return true;
+}
+
+// the viewer's 60 degree camera with the corners the viewer passes to SetView
+Camera CreateCamera(const RenderCamera& renderCamera, size_t width, size_t height)
+{
+	Camera camera(width, height);
+	camera.SetPosition(renderCamera.position);
+	camera.SetPitch(renderCamera.pitch);
+	camera.SetYaw(renderCamera.yaw);
+	camera.SetRoll(0.0f);
+	return camera;
+}
+
+// direction of the primary ray through a texel as the shaders rebuild it, relative to the camera position
+inline vec3 GetRayDirection(const Camera& camera, size_t x, size_t y, size_t width, size_t height)
+{
+	auto topLeft = camera.GetTopLeft() - camera.GetPosition();
+	auto topRight = camera.GetTopRight() - camera.GetPosition();
+	auto bottomLeft = camera.GetBottomLeft() - camera.GetPosition();
+
+	auto u = (float) x / (float) width;
+	auto v = (float) y / (float) height;
+	return normalize(topLeft + (topRight - topLeft) * u + (bottomLeft - topLeft) * v);
+}
+
+// binary PPM, the viewer's colouring by world position lit from the camera in place of the SSAO pass, misses are black
+bool WriteShadedImage(const std::string& filename, const GBuffer& gbuffer, const Camera& camera, size_t width, size_t height)
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file)
+	{
+		return false;
+	}
+
+	file << "P6\n" << width << " " << height << "\n255\n";
+
+	std::vector<unsigned char> row(width * 3);
+	for (auto y = 0u; y < height; y++)
+	{
+		for (auto x = 0u; x < width; x++)
+		{
+			auto& texel = gbuffer.texels[x + y * width];
+			vec3 color(0.0f);
+
+			if (texel.depth != 0.0f)
+			{
+				auto direction = GetRayDirection(camera, x, y, width, height);
+				auto position = camera.GetPosition() + direction * texel.depth;
+				auto light = RENDER_AMBIENT + (1.0f - RENDER_AMBIENT) * std::max(0.0f, -dot(texel.DecodeNormal(), direction));
+				color = clamp((0.5f + 0.5f * position) * light, 0.0f, 1.0f);
+			}
+
+			for (auto c = 0u; c < 3; c++)
+			{
+				row[x * 3 + c] = (unsigned char) (color[c] * 255.0f + 0.5f);
+			}
+		}
+
+		file.write((const char*) row.data(), row.size());
+	}
+
+	return file.good();
+}
+
+// greyscale PFM of the distance along the primary ray, 0 for a miss
+bool WriteDepthImage(const std::string& filename, const GBuffer& gbuffer, size_t width, size_t height)
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file)
+	{
+		return false;
+	}
+
+	// a negative scale marks little-endian data, rows are stored bottom to top
+	file << "Pf\n" << width << " " << height << "\n-1.0\n";
+
+	std::vector<float> row(width);
+	for (auto y = height; y-- > 0;)
+	{
+		for (auto x = 0u; x < width; x++)
+		{
+			row[x] = gbuffer.texels[x + y * width].depth;
+		}
+
+		file.write((const char*) row.data(), row.size() * sizeof(float));
+	}
+
+	return file.good();
+}
+
+// colour PFM of the world space normals, 0 for a miss
+bool WriteNormalImage(const std::string& filename, const GBuffer& gbuffer, size_t width, size_t height)
+{
+	std::ofstream file(filename, std::ios::binary);
+	if (!file)
+	{
+		return false;
+	}
+
+	file << "PF\n" << width << " " << height << "\n-1.0\n";
+
+	std::vector<float> row(width * 3);
+	for (auto y = height; y-- > 0;)
+	{
+		for (auto x = 0u; x < width; x++)
+		{
+			auto& texel = gbuffer.texels[x + y * width];
+			auto normal = texel.depth != 0.0f ? texel.DecodeNormal() : vec3(0.0f);
+
+			for (auto c = 0u; c < 3; c++)
+			{
+				row[x * 3 + c] = normal[c];
+			}
+		}
+
+		file.write((const char*) row.data(), row.size() * sizeof(float));
+	}
+
+	return file.good();
+}
+
+void PrintUsage()
+{
+	std::cout << "usage: sphereflake-render [options]" << std::endl;
+	std::cout << "  --width=X --height=Y     image size (default " << RENDER_WIDTH << "x" << RENDER_HEIGHT << ")" << std::endl;
+	std::cout << "  --camera=X,Y,Z,PITCH,YAW camera as for the viewer (default the viewer's initial camera)" << std::endl;
+	std::cout << "  --cameras=FILE           one X,Y,Z,PITCH,YAW camera per line, every camera goes to numbered files" << std::endl;
+	std::cout << "  --output=FILE            shaded image as binary PPM (default sphereflake.ppm, unless only other outputs are given)" << std::endl;
+	std::cout << "  --depth-output=FILE      distance along the primary ray as a greyscale PFM" << std::endl;
+	std::cout << "  --normal-output=FILE     world space normals as a colour PFM" << std::endl;
+	std::cout << "  --workers=N              number of worker threads" << std::endl;
+	std::cout << "  --affinity=POLICY        worker placement, none, compact or cores" << std::endl;
+	std::cout << "  --packet-shape=WxH       pixel footprint of a ray packet" << std::endl;
+}
+
+// every argument has to be one of the options above, a typo must not silently render the default frame
+bool CheckArguments(int argc, char* argv[])
+{
+	const char* options[] =
+	{
+		"width", "height", "camera", "cameras", "output", "depth-output", "normal-output", "workers", "affinity", "packet-shape"
+	};
+
+	auto valid = true;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string argument(argv[i]);
+		auto separator = argument.find('=');
+
+		// every option takes a value, a bare --output would otherwise name the file "true"
+		auto name = argument.compare(0, 2, "--") == 0 && separator != std::string::npos ? argument.substr(2, separator - 2) : std::string();
+
+		auto known = false;
+		for (auto option : options)
+		{
+			known = known || name == option;
+		}
+
+		if (!known && argument != "--help")
+		{
+			std::cout << "Unknown argument: " << argument << std::endl;
+			valid = false;
+		}
+	}
+
+	return valid;
+}
+
+int main(int argc, char* argv[])
+{
+	auto help = false;
+	for (int i = 1; i < argc; i++)
+	{
+		help = help || std::string(argv[i]) == "--help";
+	}
+
+	if (help)
+	{
+		PrintUsage();
+		return 0;
+	}
+
+	if (!CheckArguments(argc, argv))
+	{
+		PrintUsage();
+		return 1;
+	}
+
+	CommandLine::Instance().ParseCommandLine(argc, argv, false);
+
+	if (COMMANDLINE_HAS_KEY("width") != COMMANDLINE_HAS_KEY("height"))
+	{
+		std::cout << "--width and --height have to be given together" << std::endl;
+		PrintUsage();
+		return 1;
+	}
+
+	size_t width = RENDER_WIDTH;
+	size_t height = RENDER_HEIGHT;
+	if (COMMANDLINE_HAS_KEY("width"))
+	{
+		width = (size_t) std::max(1, COMMANDLINE_GET_INT_VALUE("width"));
+		height = (size_t) std::max(1, COMMANDLINE_GET_INT_VALUE("height"));
+	}
+
+	std::vector<RenderCamera> cameras;
+	if (!LoadCameras(cameras))
+	{
+		return 1;
+	}
+
+	PacketShape shape;
+	if (COMMANDLINE_HAS_KEY("packet-shape") && !PacketShape::Parse(CommandLine::Instance().GetValue("packet-shape"), shape))
+	{
+		std::cout << "Invalid packet shape, expected WxH of at most " << MAX_PACKET_PIXELS << " pixels" << std::endl;
+		return 1;
+	}
+
+	ThreadPlacement placement;
+	if (COMMANDLINE_HAS_KEY("affinity") && !ThreadPlacement::Parse(CommandLine::Instance().GetValue("affinity"), placement.policy))
+	{
+		std::cout << "Invalid affinity policy, expected none, compact or cores" << std::endl;
+		return 1;
+	}
+
+	if (COMMANDLINE_HAS_KEY("workers"))
+	{
+		placement.workerCount = (size_t) std::max(1, COMMANDLINE_GET_INT_VALUE("workers"));
+	}
+
+	// the shaded image unless only the G-buffer images were asked for
+	std::string output;
+	if (COMMANDLINE_HAS_KEY("output"))
+	{
+		output = CommandLine::Instance().GetValue("output");
+	}
+	else if (!COMMANDLINE_HAS_KEY("depth-output") && !COMMANDLINE_HAS_KEY("normal-output"))
+	{
+		output = "sphereflake.ppm";
+	}
+
+	Sphereflake sphereflake(width, height);
+	sphereflake.SetPacketShape(shape);
+	sphereflake.SetThreadPlacement(placement);
+
+	// the workers first-touch their G-buffer shares and park, frames are only traced through RenderFrame
+	auto first = CreateCamera(cameras[0], width, height);
+	sphereflake.Pause();
+	sphereflake.SetView(first.GetPosition(), first.GetTopLeft(), first.GetTopRight(), first.GetBottomLeft());
+	sphereflake.Initialize();
+
+	auto failed = false;
+	for (size_t i = 0; i < cameras.size(); i++)
+	{
+		auto camera = CreateCamera(cameras[i], width, height);
+
+		auto raysBefore = sphereflake.GetStats().traversal.rays;
+		auto start = std::chrono::high_resolution_clock::now();
+
+		// paused across the view change so the workers never sample the new view outside the frame
+		sphereflake.Pause();
+		sphereflake.SetView(camera.GetPosition(), camera.GetTopLeft(), camera.GetTopRight(), camera.GetBottomLeft());
+		auto frame = sphereflake.RenderFrame();
+		sphereflake.Resume();
+		frame.get();
+
+		auto& gbuffer = sphereflake.PublishGBuffer();
+		auto seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+		auto rays = sphereflake.GetStats().traversal.rays - raysBefore;
+
+		std::cout << "frame " << i << ": " << width << "x" << height << " in " << seconds * 1000.0 << " ms, ";
+		std::cout << rays << " rays, " << (size_t) (rays / seconds / 1000) << "k rays per second" << std::endl;
+
+		// numbered when there is more than one camera, image.ppm -> image-0.ppm, image-1.ppm ...
+		auto filename = [&](const std::string& name)
+		{
+			return cameras.size() > 1 ? GetNumberedFilename(name, i) : name;
+		};
+
+		if (!output.empty() && !WriteShadedImage(filename(output), gbuffer, camera, width, height))
+		{
+			std::cout << "Couldn't write image: " << filename(output) << std::endl;
+			failed = true;
+		}
+
+		if (COMMANDLINE_HAS_KEY("depth-output") && !WriteDepthImage(filename(CommandLine::Instance().GetValue("depth-output")), gbuffer, width, height))
+		{
+			std::cout << "Couldn't write depth image: " << filename(CommandLine::Instance().GetValue("depth-output")) << std::endl;
+			failed = true;
+		}
+
+		if (COMMANDLINE_HAS_KEY("normal-output") && !WriteNormalImage(filename(CommandLine::Instance().GetValue("normal-output")), gbuffer, width, height))
+		{
+			std::cout << "Couldn't write normal image: " << filename(CommandLine::Instance().GetValue("normal-output")) << std::endl;
+			failed = true;
+		}
+	}
+
+	return failed ? 1 : 0;
+}
@@ -21,7 +21,8 @@ namespace SphereflakeRaytracer
 			return instance;
 		}
 
-		bool ParseCommandLine(int argc, char** argv)
+		// echo prints the parsed pairs, tools that write results to stdout turn it off
+		bool ParseCommandLine(int argc, char** argv, bool echo = true)
 		{
 			std::vector<std::string> keyValuePairs;
 			for (int i = 1; i < argc; i++)
@@ -46,6 +47,11 @@ namespace SphereflakeRaytracer
 
 			for (auto& pair : m_CommandLine)
 			{
+				if (!echo)
+				{
+					break;
+				}
+
 				std::cout << pair.first << " = " << pair.second << std::endl;
 			}
 
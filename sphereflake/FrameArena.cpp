@@ -0,0 +1,241 @@
+#pragma warning (push, 0)
+#pragma warning (disable: 4530) // disable warnings from code not under our control
+
+#include <string>
+#include <vector>
+#include <new>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#pragma warning (pop)
+
+#include "FrameArena.h"
+
+namespace SphereflakeRaytracer
+{
+
+	FrameArena::FrameArena(size_t capacity) :
+		m_Base(nullptr),
+		m_Capacity(RoundToHugePages(capacity)),
+		m_Used(0),
+		m_Mapping(nullptr),
+		m_MappingSize(0),
+		m_HugePageMode(HugePageMode::None)
+	{
+
+#ifdef _WIN32
+
+		// large pages need SeLockMemoryPrivilege and are committed on allocation, which defeats first-touch placement,
+		// regular pages are still only backed on first access
+		m_Mapping = VirtualAlloc(nullptr, m_Capacity, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+		if (m_Mapping == nullptr)
+		{
+			throw std::bad_alloc();
+		}
+
+		m_MappingSize = m_Capacity;
+		m_Base = (char*) m_Mapping;
+
+#else
+
+		// the hugetlb pool is usually empty unless the machine was set up for it, mmap fails up front in that case
+		auto mapping = mmap(nullptr, m_Capacity, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (mapping != MAP_FAILED)
+		{
+			m_Mapping = mapping;
+			m_MappingSize = m_Capacity;
+			m_Base = (char*) mapping;
+			m_HugePageMode = HugePageMode::Explicit;
+			return;
+		}
+
+		// transparent huge pages are only used for aligned 2 MB ranges, over-reserve and align by hand
+		m_MappingSize = m_Capacity + FRAME_ARENA_HUGE_PAGE_SIZE;
+		mapping = mmap(nullptr, m_MappingSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (mapping == MAP_FAILED)
+		{
+			throw std::bad_alloc();
+		}
+
+		m_Mapping = mapping;
+		m_Base = (char*) (((size_t) mapping + FRAME_ARENA_HUGE_PAGE_SIZE - 1) & ~(size_t) (FRAME_ARENA_HUGE_PAGE_SIZE - 1));
+
+		if (madvise(m_Base, m_Capacity, MADV_HUGEPAGE) == 0)
+		{
+			m_HugePageMode = HugePageMode::Transparent;
+		}
+
+#endif
+
+	}
+
+	FrameArena::~FrameArena()
+	{
+
+#ifdef _WIN32
+
+		VirtualFree(m_Mapping, 0, MEM_RELEASE);
+
+#else
+
+		munmap(m_Mapping, m_MappingSize);
+
+#endif
+
+	}
+
+	void* FrameArena::Allocate(size_t size)
+	{
+		size = RoundToHugePages(size);
+		if (size > m_Capacity - m_Used)
+		{
+			throw std::bad_alloc();
+		}
+
+		auto block = m_Base + m_Used;
+		m_Used += size;
+		return block;
+	}
+
+	MemoryPlacement FrameArena::GetPlacement() const
+	{
+		MemoryPlacement placement;
+		placement.capacity = m_Capacity;
+
+		auto pageCount = m_Used / FRAME_ARENA_PAGE_SIZE;
+
+#ifdef _WIN32
+
+		std::vector<PSAPI_WORKING_SET_EX_INFORMATION> pages(pageCount);
+		for (auto i = 0u; i < pageCount; i++)
+		{
+			pages[i].VirtualAddress = m_Base + i * FRAME_ARENA_PAGE_SIZE;
+		}
+
+		if (pageCount == 0 || !QueryWorkingSetEx(GetCurrentProcess(), pages.data(), (DWORD) (pageCount * sizeof(PSAPI_WORKING_SET_EX_INFORMATION))))
+		{
+			return placement;
+		}
+
+		for (auto&& page : pages)
+		{
+			if (!page.VirtualAttributes.Valid)
+			{
+				continue;
+			}
+
+			auto node = (size_t) page.VirtualAttributes.Node;
+			if (node >= placement.nodeBytes.size())
+			{
+				placement.nodeBytes.resize(node + 1);
+			}
+
+			placement.nodeBytes[node] += FRAME_ARENA_PAGE_SIZE;
+			placement.residentBytes += FRAME_ARENA_PAGE_SIZE;
+
+			if (page.VirtualAttributes.LargePage)
+			{
+				placement.hugePageBytes += FRAME_ARENA_PAGE_SIZE;
+			}
+		}
+
+#else
+
+		// move_pages without target nodes only reports the node of each page, or -ENOENT if it is not resident
+		const size_t batchSize = 1024;
+		std::vector<void*> pages(batchSize);
+		std::vector<int> status(batchSize);
+
+		for (size_t first = 0; first < pageCount; first += batchSize)
+		{
+			auto count = std::min(batchSize, pageCount - first);
+			for (auto i = 0u; i < count; i++)
+			{
+				pages[i] = m_Base + (first + i) * FRAME_ARENA_PAGE_SIZE;
+			}
+
+			if (syscall(SYS_move_pages, 0, (unsigned long) count, pages.data(), nullptr, status.data(), 0) != 0)
+			{
+				return placement;
+			}
+
+			for (auto i = 0u; i < count; i++)
+			{
+				if (status[i] < 0)
+				{
+					continue;
+				}
+
+				auto node = (size_t) status[i];
+				if (node >= placement.nodeBytes.size())
+				{
+					placement.nodeBytes.resize(node + 1);
+				}
+
+				placement.nodeBytes[node] += FRAME_ARENA_PAGE_SIZE;
+				placement.residentBytes += FRAME_ARENA_PAGE_SIZE;
+			}
+		}
+
+		if (m_HugePageMode == HugePageMode::Explicit)
+		{
+			placement.hugePageBytes = placement.residentBytes;
+			return placement;
+		}
+
+		// transparent huge pages are only visible in the smaps entry of the mapping
+		std::ifstream smaps("/proc/self/smaps");
+		std::string line;
+		bool inMapping = false;
+
+		while (std::getline(smaps, line))
+		{
+			size_t start, end;
+			char dash;
+
+			std::istringstream header(line);
+			if (header >> std::hex >> start >> dash >> end && dash == '-')
+			{
+				inMapping = start <= (size_t) m_Base && (size_t) m_Base < end;
+				continue;
+			}
+
+			if (inMapping && line.compare(0, 14, "AnonHugePages:") == 0)
+			{
+				placement.hugePageBytes = (size_t) std::stoull(line.substr(14)) * 1024;
+				break;
+			}
+		}
+
+#endif
+
+		return placement;
+	}
+
+	std::string MemoryPlacement::ToString() const
+	{
+		std::ostringstream result;
+		result << residentBytes / 1024 << "k of " << capacity / 1024 << "k resident, " << hugePageBytes / 1024 << "k in huge pages";
+
+		for (auto i = 0u; i < nodeBytes.size(); i++)
+		{
+			result << ", node " << i << ": " << nodeBytes[i] / 1024 << "k";
+		}
+
+		return result.str();
+	}
+
+}
@@ -0,0 +1,83 @@
+#ifndef __SPHEREFLAKERAYTRACER_FRAMEARENA_H
+#define __SPHEREFLAKERAYTRACER_FRAMEARENA_H
+
+#define FRAME_ARENA_PAGE_SIZE 4096
+#define FRAME_ARENA_HUGE_PAGE_SIZE (2 * 1024 * 1024)
+
+namespace SphereflakeRaytracer
+{
+
+	enum class HugePageMode
+	{
+		None,
+		// transparent huge pages requested with madvise, the kernel backs what it can
+		Transparent,
+		// MAP_HUGETLB pages from the reserved pool
+		Explicit
+	};
+
+	// where the pages of an arena live, pages that have never been written are not resident anywhere
+	struct MemoryPlacement
+	{
+		MemoryPlacement() : residentBytes(0), hugePageBytes(0), capacity(0) {}
+
+		// resident bytes indexed by NUMA node
+		std::vector<size_t> nodeBytes;
+		size_t residentBytes;
+		size_t hugePageBytes;
+		size_t capacity;
+
+		std::string ToString() const;
+	};
+
+	// reserves the address space of the frame-sized buffers up front and hands out blocks aligned to huge pages,
+	// nothing is committed until it is written so the thread that touches a page first decides the node it lives on
+	class FrameArena
+	{
+
+		public:
+		// throws std::bad_alloc if the address space cannot be reserved
+		explicit FrameArena(size_t capacity);
+
+		~FrameArena();
+
+		// bump allocation, blocks never share a huge page
+		void* Allocate(size_t size);
+
+		HugePageMode GetHugePageMode() const
+		{
+			return m_HugePageMode;
+		}
+
+		size_t GetCapacity() const
+		{
+			return m_Capacity;
+		}
+
+		// queries the node of every page allocated so far, an empty node list if the platform cannot tell
+		MemoryPlacement GetPlacement() const;
+
+		static size_t RoundToHugePages(size_t size)
+		{
+			return (size + FRAME_ARENA_HUGE_PAGE_SIZE - 1) & ~(size_t) (FRAME_ARENA_HUGE_PAGE_SIZE - 1);
+		}
+
+		private:
+		FrameArena(const FrameArena&);
+		FrameArena& operator=(const FrameArena&);
+
+		char* m_Base;
+		size_t m_Capacity;
+		size_t m_Used;
+
+		// start and length of the mapping, which is larger than the capacity when it had to be aligned by hand
+		void* m_Mapping;
+		size_t m_MappingSize;
+
+		HugePageMode m_HugePageMode;
+
+	};
+
+}
+
+#endif
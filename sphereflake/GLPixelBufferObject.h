@@ -11,13 +11,24 @@ namespace SphereflakeRaytracer
 		{
 
 			public:
-			PixelBufferObject()
+			PixelBufferObject() : m_Mapped(nullptr), m_Fence(0)
 			{
 				glGenBuffers(1, &m_Handle);
 			}
 
 			~PixelBufferObject()
 			{
+				if (m_Fence != 0)
+				{
+					glDeleteSync(m_Fence);
+				}
+
+				if (m_Mapped != nullptr)
+				{
+					glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_Handle);
+					glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+				}
+
 				glDeleteBuffers(1, &m_Handle);
 			}
 
@@ -28,6 +39,52 @@ namespace SphereflakeRaytracer
 				glBufferData(GL_PIXEL_UNPACK_BUFFER, data.size() * sizeof(T), data.data(), GL_STREAM_DRAW);
 			}
 
+			// allocates immutable storage that stays mapped for the lifetime of the buffer, writes through the
+			// returned pointer are visible to commands issued afterwards, requires GL 4.4 or ARB_buffer_storage
+			void* MapPersistent(size_t size)
+			{
+				GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, m_Handle);
+				glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, nullptr, flags);
+				m_Mapped = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+
+				return m_Mapped;
+			}
+
+			void* GetMappedPointer()
+			{
+				return m_Mapped;
+			}
+
+			// marks the point after which the commands reading from the buffer so far have completed
+			void Fence()
+			{
+				if (m_Fence != 0)
+				{
+					glDeleteSync(m_Fence);
+				}
+
+				m_Fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			}
+
+			// blocks until the last fence has been reached, after which the mapped memory may be rewritten
+			void WaitFence()
+			{
+				if (m_Fence == 0)
+				{
+					return;
+				}
+
+				while (glClientWaitSync(m_Fence, GL_SYNC_FLUSH_COMMANDS_BIT, 1000000) == GL_TIMEOUT_EXPIRED)
+				{
+				}
+
+				glDeleteSync(m_Fence);
+				m_Fence = 0;
+			}
+
 			GLuint GetHandle()
 			{
 				return m_Handle;
@@ -36,6 +93,9 @@ namespace SphereflakeRaytracer
 			private:
 			GLuint m_Handle;
 
+			void* m_Mapped;
+			GLsync m_Fence;
+
 		};
 
 	}
@@ -4,6 +4,7 @@
 #include <string>
 #include <vector>
 #include <iostream>
+#include <fstream>
 
 #define GL_GLEXT_PROTOTYPES
 #include "glcorearb.h"
@@ -24,6 +25,7 @@ using namespace glm;
 
 #pragma warning (pop)
 
+#include "Filesystem.h"
 #include "GLProgram.h"
 
 namespace SphereflakeRaytracer
@@ -116,6 +118,33 @@ namespace SphereflakeRaytracer
 			return glGetUniformLocation(m_Handle, name.c_str());
 		}
 
+		bool ReadPostShaderSource(const std::string& path, std::string& source)
+		{
+			std::string shared;
+			if (!Filesystem::ReadAllText("Shaders/gbuffer.glsl", shared))
+			{
+				std::cout << "Couldn't open shader file: " << "Shaders/gbuffer.glsl" << std::endl;
+				return false;
+			}
+
+			if (!Filesystem::ReadAllText(path, source))
+			{
+				std::cout << "Couldn't open shader file: " << path << std::endl;
+				return false;
+			}
+
+			// #version has to come first, #line makes the line after it line 2 again
+			auto versionEnd = source.find('\n');
+			if (versionEnd == std::string::npos || source.compare(0, 8, "#version") != 0)
+			{
+				std::cout << "Shader file does not start with #version: " << path << std::endl;
+				return false;
+			}
+
+			source.insert(versionEnd + 1, shared + "\n#line 2\n");
+			return true;
+		}
+
 	}
 
 }
\ No newline at end of file
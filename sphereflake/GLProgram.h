@@ -77,6 +77,10 @@ namespace SphereflakeRaytracer
 
 		};
 
+		// reads a post-processing fragment shader with Shaders/gbuffer.glsl inserted after its #version line
+		// prints which file could not be opened and returns false if either is missing
+		bool ReadPostShaderSource(const std::string& path, std::string& source);
+
 	}
 
 }
@@ -11,6 +11,7 @@ namespace SphereflakeRaytracer
 		{
 			RGBA_UNSIGNED_BYTE = 0,
 			RGBA_FLOAT = 1,
+			RG_UNSIGNED_INT = 2,
 		};
 
 		enum class Texture2DFilter
@@ -35,6 +36,11 @@ namespace SphereflakeRaytracer
 				glBindTexture(GL_TEXTURE_2D, m_Handle);
 				SetFilter(filter);
 				SetWrapMode(wrapMode);
+
+				// immutable storage, uploads only ever replace texels
+				GLenum internalFormat, dataFormat, dataType;
+				GetFormat(internalFormat, dataFormat, dataType);
+				glTexStorage2D(GL_TEXTURE_2D, 1, internalFormat, (GLsizei)m_Width, (GLsizei)m_Height);
 			}
 
 			void Bind(size_t index)
@@ -49,9 +55,49 @@ namespace SphereflakeRaytracer
 				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo->GetHandle());
 				glBindTexture(GL_TEXTURE_2D, m_Handle);
 
-				GLenum internalFormat = GL_RGBA;
-				GLenum format = GL_RGBA;
-				GLenum dataFormat = GL_UNSIGNED_BYTE;
+				GLenum internalFormat, format, dataFormat;
+				GetFormat(internalFormat, format, dataFormat);
+
+				glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, (GLsizei)m_Width, (GLsizei)m_Height, format, dataFormat, 0);
+			}
+
+			// uploads a rectangle from client memory, rowLength is the pitch of the source in pixels
+			template <typename T>
+			void UploadRegion(const T* data, size_t x, size_t y, size_t width, size_t height, size_t rowLength)
+			{
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+				glBindTexture(GL_TEXTURE_2D, m_Handle);
+
+				GLenum internalFormat, format, dataFormat;
+				GetFormat(internalFormat, format, dataFormat);
+
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint)rowLength);
+				glTexSubImage2D(GL_TEXTURE_2D, 0, (GLint)x, (GLint)y, (GLsizei)width, (GLsizei)height, format, dataFormat, data);
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+			}
+
+			// uploads a rectangle from a pixel buffer object, offset is in bytes from the start of the buffer
+			template <typename T>
+			void UploadRegion(const T& pbo, size_t offset, size_t x, size_t y, size_t width, size_t height, size_t rowLength)
+			{
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, pbo->GetHandle());
+				glBindTexture(GL_TEXTURE_2D, m_Handle);
+
+				GLenum internalFormat, format, dataFormat;
+				GetFormat(internalFormat, format, dataFormat);
+
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint)rowLength);
+				glTexSubImage2D(GL_TEXTURE_2D, 0, (GLint)x, (GLint)y, (GLsizei)width, (GLsizei)height, format, dataFormat, (const void*)offset);
+				glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+				glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+			}
+
+			private:
+			void GetFormat(GLenum& internalFormat, GLenum& format, GLenum& dataFormat)
+			{
+				internalFormat = GL_RGBA8;
+				format = GL_RGBA;
+				dataFormat = GL_UNSIGNED_BYTE;
 
 				switch (m_Format)
 				{
@@ -61,16 +107,18 @@ namespace SphereflakeRaytracer
 					dataFormat = GL_FLOAT;
 					break;
 				case Texture2DFormat::RGBA_UNSIGNED_BYTE:
-					internalFormat = GL_RGBA;
+					internalFormat = GL_RGBA8;
 					format = GL_RGBA;
 					dataFormat = GL_UNSIGNED_BYTE;
 					break;
+				case Texture2DFormat::RG_UNSIGNED_INT:
+					internalFormat = GL_RG32UI;
+					format = GL_RG_INTEGER;
+					dataFormat = GL_UNSIGNED_INT;
+					break;
 				}
-
-				glTexImage2D(GL_TEXTURE_2D, 0, internalFormat, (GLsizei)m_Width, (GLsizei)m_Height, 0, format, dataFormat, 0);
 			}
 
-			private:
 			void SetFilter(Texture2DFilter filter)
 			{
 				switch (filter)
@@ -0,0 +1,199 @@
+#ifndef __SPHEREFLAKERAYTRACER_GLTIMESTAMPQUERIES_H
+#define __SPHEREFLAKERAYTRACER_GLTIMESTAMPQUERIES_H
+
+// frames of queries in flight, results are read back this many frames after they were issued
+#define TIMESTAMP_QUERY_FRAMES 4
+
+// frames between two measurements of the offset between the GPU clock and the trace clock
+#define TIMESTAMP_QUERY_CALIBRATION_FRAMES 256
+
+namespace SphereflakeRaytracer
+{
+
+	namespace GL
+	{
+
+		// GPU durations of named phases of a frame, measured with GL_TIMESTAMP queries and recorded on the "GPU" track
+		// of the trace, the queries are only read once they are available so the CPU never waits for the GPU
+		class TimestampQueries
+		{
+
+			public:
+			struct Result
+			{
+				const char* name;
+				double seconds;
+			};
+
+			TimestampQueries() :
+				m_Frame(0),
+				m_ClockOffset(0),
+				m_DroppedFrames(0)
+			{
+				m_Frames.resize(TIMESTAMP_QUERY_FRAMES);
+				Calibrate();
+			}
+
+			~TimestampQueries()
+			{
+				for (auto& frame : m_Frames)
+				{
+					for (auto& zone : frame.zones)
+					{
+						glDeleteQueries(2, zone.queries);
+					}
+				}
+			}
+
+			// records the results of the frame that used this slot before and starts collecting a new one
+			void BeginFrame()
+			{
+				m_Frame++;
+				if (m_Frame % TIMESTAMP_QUERY_CALIBRATION_FRAMES == 0)
+				{
+					Calibrate();
+				}
+
+				auto& frame = m_Frames[m_Frame % TIMESTAMP_QUERY_FRAMES];
+				Collect(frame);
+
+				frame.count = 0;
+				m_Open.clear();
+			}
+
+			// zones may nest, every Begin is closed by the next End that is not already taken
+			void Begin(const char* name)
+			{
+				auto& frame = m_Frames[m_Frame % TIMESTAMP_QUERY_FRAMES];
+				if (frame.count == frame.zones.size())
+				{
+					Zone zone;
+					glGenQueries(2, zone.queries);
+					frame.zones.push_back(zone);
+				}
+
+				auto& zone = frame.zones[frame.count];
+				zone.name = name;
+				glQueryCounter(zone.queries[0], GL_TIMESTAMP);
+
+				m_Open.push_back(frame.count++);
+			}
+
+			void End()
+			{
+				auto& frame = m_Frames[m_Frame % TIMESTAMP_QUERY_FRAMES];
+				glQueryCounter(frame.zones[m_Open.back()].queries[1], GL_TIMESTAMP);
+				m_Open.pop_back();
+			}
+
+			// zones of the frame the last BeginFrame collected, empty if that frame was dropped
+			const std::vector<Result>& GetCollectedZones() const
+			{
+				return m_Collected;
+			}
+
+			// frames whose queries were still pending after TIMESTAMP_QUERY_FRAMES frames, they are left out of the trace
+			size_t GetDroppedFrames() const
+			{
+				return m_DroppedFrames;
+			}
+
+			private:
+			struct Zone
+			{
+				const char* name;
+				GLuint queries[2];
+			};
+
+			struct Frame
+			{
+				Frame() : count(0) {}
+
+				std::vector<Zone> zones;
+				size_t count;
+			};
+
+			void Calibrate()
+			{
+				// the GL timestamp is taken when the GPU has reached all commands issued so far, good enough to line the
+				// tracks up to within the latency of the call
+				GLint64 gpuTime = 0;
+				glGetInteger64v(GL_TIMESTAMP, &gpuTime);
+				m_ClockOffset = Trace::Now() - (long long) gpuTime;
+			}
+
+			void Collect(Frame& frame)
+			{
+				m_Collected.clear();
+
+				for (size_t i = 0; i < frame.count; i++)
+				{
+					GLuint available = 0;
+					glGetQueryObjectuiv(frame.zones[i].queries[1], GL_QUERY_RESULT_AVAILABLE, &available);
+					if (!available)
+					{
+						m_DroppedFrames++;
+						return;
+					}
+				}
+
+				for (size_t i = 0; i < frame.count; i++)
+				{
+					GLuint64 start = 0;
+					GLuint64 end = 0;
+					glGetQueryObjectui64v(frame.zones[i].queries[0], GL_QUERY_RESULT, &start);
+					glGetQueryObjectui64v(frame.zones[i].queries[1], GL_QUERY_RESULT, &end);
+
+					Trace::RecordOnTrack("GPU", frame.zones[i].name, (long long) start + m_ClockOffset, (long long) end + m_ClockOffset);
+
+					Result result;
+					result.name = frame.zones[i].name;
+					result.seconds = (double) (end - start) / 1e9;
+					m_Collected.push_back(result);
+				}
+			}
+
+			std::vector<Frame> m_Frames;
+			std::vector<size_t> m_Open;
+			std::vector<Result> m_Collected;
+			size_t m_Frame;
+
+			long long m_ClockOffset;
+			size_t m_DroppedFrames;
+
+		};
+
+		// brackets the GL commands of the enclosing scope, does nothing without queries
+		class TimestampZone
+		{
+
+			public:
+			TimestampZone(TimestampQueries* queries, const char* name) : m_Queries(queries)
+			{
+				if (m_Queries != nullptr)
+				{
+					m_Queries->Begin(name);
+				}
+			}
+
+			~TimestampZone()
+			{
+				if (m_Queries != nullptr)
+				{
+					m_Queries->End();
+				}
+			}
+
+			private:
+			TimestampZone(const TimestampZone&);
+			TimestampZone& operator=(const TimestampZone&);
+
+			TimestampQueries* m_Queries;
+
+		};
+
+	}
+
+}
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef __SPHEREFLAKERAYTRACER_LATENCYCONTROLLER_H
+#define __SPHEREFLAKERAYTRACER_LATENCYCONTROLLER_H
+
+// frames to wait after a change before the smoothed frame time is trusted again
+#define LATENCY_CONTROLLER_SETTLE_FRAMES 60
+
+namespace SphereflakeRaytracer
+{
+
+	// steers the worker count so the render thread's frame time stays around a target, one worker at a time
+	// with vsync the target has to be a little above the refresh interval
+	class LatencyController
+	{
+
+		public:
+		LatencyController(double targetFrameTime, size_t minWorkers, size_t maxWorkers) :
+			m_TargetFrameTime(targetFrameTime),
+			m_MinWorkers(minWorkers),
+			m_MaxWorkers(maxWorkers),
+			m_AverageFrameTime(0.0),
+			m_SettleFrames(LATENCY_CONTROLLER_SETTLE_FRAMES)
+		{}
+
+		// feeds the duration of the last frame in seconds, returns the worker count to use from now on
+		size_t Update(double frameTime, size_t workers)
+		{
+			m_AverageFrameTime = m_AverageFrameTime == 0.0 ? frameTime : m_AverageFrameTime + (frameTime - m_AverageFrameTime) * 0.1;
+
+			if (m_SettleFrames > 0)
+			{
+				m_SettleFrames--;
+				return workers;
+			}
+
+			// missing the target backs off, anything below it probes for one more worker
+			if (m_AverageFrameTime > m_TargetFrameTime * 1.1 && workers > m_MinWorkers)
+			{
+				m_SettleFrames = LATENCY_CONTROLLER_SETTLE_FRAMES;
+				return workers - 1;
+			}
+
+			if (m_AverageFrameTime < m_TargetFrameTime && workers < m_MaxWorkers)
+			{
+				m_SettleFrames = LATENCY_CONTROLLER_SETTLE_FRAMES;
+				return workers + 1;
+			}
+
+			return workers;
+		}
+
+		double GetAverageFrameTime() const
+		{
+			return m_AverageFrameTime;
+		}
+
+		private:
+		double m_TargetFrameTime;
+		size_t m_MinWorkers;
+		size_t m_MaxWorkers;
+
+		double m_AverageFrameTime;
+		size_t m_SettleFrames;
+
+	};
+
+}
+
+#endif
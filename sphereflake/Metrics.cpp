@@ -0,0 +1,343 @@
+#pragma warning (push, 0)
+#pragma warning (disable: 4530) // disable warnings from code not under our control
+
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <thread>
+#include <fstream>
+#include <cstdio>
+#include <cstring>
+#include <cerrno>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <unistd.h>
+#endif
+
+#pragma warning (pop)
+
+#include "Metrics.h"
+
+// how often the serving thread checks whether it should stop
+#define METRICS_POLL_INTERVAL_MS 200
+
+// longest a client may stall a single receive or send before it is dropped
+#define METRICS_CLIENT_TIMEOUT_MS 1000
+
+// a scrape request fits easily, anything longer is cut off after the request line has been read
+#define METRICS_REQUEST_SIZE 4096
+
+#ifdef _WIN32
+#define METRICS_SEND_FLAGS 0
+#else
+// a scraper that hangs up early must not raise SIGPIPE in the viewer
+#define METRICS_SEND_FLAGS MSG_NOSIGNAL
+#endif
+
+namespace SphereflakeRaytracer
+{
+
+	// integers up to 2^53 are printed exactly, fractions without trailing noise
+	static std::string FormatMetricValue(double value)
+	{
+		char buffer[32];
+		snprintf(buffer, sizeof(buffer), "%.15g", value);
+		return buffer;
+	}
+
+	void MetricsPage::AddFamily(const char* name, const char* help, const char* type)
+	{
+		m_Text += std::string("# HELP ") + name + " " + help + "\n";
+		m_Text += std::string("# TYPE ") + name + " " + type + "\n";
+	}
+
+	void MetricsPage::AddSample(const std::string& name, const std::string& labels, double value)
+	{
+		m_Text += name + (labels.empty() ? "" : "{" + labels + "}") + " " + FormatMetricValue(value) + "\n";
+	}
+
+	void MetricsPage::AddGauge(const char* name, const char* help, double value)
+	{
+		AddFamily(name, help, "gauge");
+		AddSample(name, "", value);
+	}
+
+	void MetricsPage::AddCounter(const char* name, const char* help, double value)
+	{
+		AddFamily(name, help, "counter");
+		AddSample(name, "", value);
+	}
+
+	void MetricsPage::AddCounters(const char* name, const char* help, const char* label, const std::vector<double>& values)
+	{
+		AddFamily(name, help, "counter");
+		for (size_t i = 0; i < values.size(); i++)
+		{
+			AddSample(name, std::string(label) + "=\"" + std::to_string(i) + "\"", values[i]);
+		}
+	}
+
+	void MetricsPage::AddHistogram(const char* name, const char* help, const MetricsHistogram& histogram)
+	{
+		AddFamily(name, help, "histogram");
+
+		// the exposition format wants the buckets cumulative
+		auto& bounds = histogram.GetBounds();
+		auto& counts = histogram.GetCounts();
+		unsigned long long cumulative = 0;
+
+		for (size_t i = 0; i < counts.size(); i++)
+		{
+			cumulative += counts[i];
+			auto bound = i < bounds.size() ? FormatMetricValue(bounds[i]) : std::string("+Inf");
+			AddSample(std::string(name) + "_bucket", "le=\"" + bound + "\"", (double) cumulative);
+		}
+
+		AddSample(std::string(name) + "_sum", "", histogram.GetSum());
+		AddSample(std::string(name) + "_count", "", (double) histogram.GetCount());
+	}
+
+#ifdef _WIN32
+
+	static void CloseSocket(size_t socket)
+	{
+		closesocket((SOCKET) socket);
+	}
+
+	static std::string GetSocketError()
+	{
+		return "Winsock error " + std::to_string(WSAGetLastError());
+	}
+
+#else
+
+	static void CloseSocket(size_t socket)
+	{
+		close((int) socket);
+	}
+
+	static std::string GetSocketError()
+	{
+		return strerror(errno);
+	}
+
+#endif
+
+	MetricsExporter::MetricsExporter() :
+		m_Socket(METRICS_NO_SOCKET),
+		m_Stop(false)
+	{}
+
+	MetricsExporter::~MetricsExporter()
+	{
+		m_Stop = true;
+
+		if (m_Thread.joinable())
+		{
+			m_Thread.join();
+		}
+
+		if (m_Socket != METRICS_NO_SOCKET)
+		{
+			CloseSocket(m_Socket);
+
+#ifdef _WIN32
+			WSACleanup();
+#endif
+		}
+	}
+
+	bool MetricsExporter::Listen(unsigned short port)
+	{
+
+#ifdef _WIN32
+
+		WSADATA data;
+		if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+		{
+			m_Error = "WSAStartup failed";
+			return false;
+		}
+
+#endif
+
+		auto listener = (size_t) socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (listener == METRICS_NO_SOCKET)
+		{
+			m_Error = "socket failed: " + GetSocketError();
+
+#ifdef _WIN32
+			WSACleanup();
+#endif
+
+			return false;
+		}
+
+		// a restarted viewer gets its port back while connections of the old one are in TIME_WAIT
+		int reuse = 1;
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*) &reuse, sizeof(reuse));
+
+		// loopback only, the metrics are for an agent on the same machine and not for the network
+		sockaddr_in address;
+		memset(&address, 0, sizeof(address));
+		address.sin_family = AF_INET;
+		address.sin_port = htons(port);
+		address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+		if (bind(listener, (const sockaddr*) &address, sizeof(address)) != 0 || listen(listener, 4) != 0)
+		{
+			m_Error = "couldn't listen on 127.0.0.1:" + std::to_string(port) + ": " + GetSocketError();
+			CloseSocket(listener);
+
+#ifdef _WIN32
+			WSACleanup();
+#endif
+
+			return false;
+		}
+
+		m_Socket = listener;
+		m_Thread = std::thread(&MetricsExporter::Serve, this);
+		return true;
+	}
+
+	bool MetricsExporter::Publish(const std::string& text)
+	{
+		if (m_Socket != METRICS_NO_SOCKET)
+		{
+			std::lock_guard<std::mutex> lock(m_TextMutex);
+			m_Text = text;
+		}
+
+		if (m_Filename.empty())
+		{
+			return true;
+		}
+
+		auto temporary = m_Filename + ".tmp";
+		{
+			std::ofstream file(temporary, std::ios::binary);
+			if (!(file << text))
+			{
+				m_Error = "couldn't write " + temporary;
+				return false;
+			}
+		}
+
+#ifdef _WIN32
+		// rename does not replace an existing file on Windows
+		remove(m_Filename.c_str());
+#endif
+
+		if (rename(temporary.c_str(), m_Filename.c_str()) != 0)
+		{
+			m_Error = "couldn't replace " + m_Filename;
+			return false;
+		}
+
+		return true;
+	}
+
+	void MetricsExporter::Serve()
+	{
+		while (!m_Stop)
+		{
+			fd_set sockets;
+			FD_ZERO(&sockets);
+			FD_SET(m_Socket, &sockets);
+
+			timeval timeout;
+			timeout.tv_sec = 0;
+			timeout.tv_usec = METRICS_POLL_INTERVAL_MS * 1000;
+
+			if (select((int) m_Socket + 1, &sockets, nullptr, nullptr, &timeout) <= 0)
+			{
+				continue;
+			}
+
+			auto client = (size_t) accept(m_Socket, nullptr, nullptr);
+			if (client == METRICS_NO_SOCKET)
+			{
+				continue;
+			}
+
+			Respond(client);
+			CloseSocket(client);
+		}
+	}
+
+	void MetricsExporter::Respond(size_t client)
+	{
+		// a client that sends nothing or stops reading must neither keep the next scrape waiting for long nor
+		// block the destructor joining this thread
+
+#ifdef _WIN32
+		DWORD timeout = METRICS_CLIENT_TIMEOUT_MS;
+#else
+		timeval timeout;
+		timeout.tv_sec = METRICS_CLIENT_TIMEOUT_MS / 1000;
+		timeout.tv_usec = (METRICS_CLIENT_TIMEOUT_MS % 1000) * 1000;
+#endif
+
+		setsockopt(client, SOL_SOCKET, SO_RCVTIMEO, (const char*) &timeout, sizeof(timeout));
+		setsockopt(client, SOL_SOCKET, SO_SNDTIMEO, (const char*) &timeout, sizeof(timeout));
+
+		// only the request line matters, headers and body are not looked at
+		std::string request;
+		char buffer[512];
+		while (request.find("\r\n") == std::string::npos && request.size() < METRICS_REQUEST_SIZE && !m_Stop)
+		{
+			auto received = recv(client, buffer, sizeof(buffer), 0);
+			if (received <= 0)
+			{
+				return;
+			}
+
+			request.append(buffer, (size_t) received);
+		}
+
+		auto path = request.substr(0, request.find("\r\n"));
+		path = path.substr(0, path.find(' ', path.find(' ') + 1));
+
+		std::string response;
+		if (path == "GET /metrics" || path.compare(0, 13, "GET /metrics?") == 0 || path == "GET /")
+		{
+			std::string text;
+			{
+				std::lock_guard<std::mutex> lock(m_TextMutex);
+				text = m_Text;
+			}
+
+			response = "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8\r\n";
+			response += "Content-Length: " + std::to_string(text.size()) + "\r\nConnection: close\r\n\r\n" + text;
+		}
+		else
+		{
+			response = "HTTP/1.0 404 Not Found\r\nContent-Type: text/plain\r\nContent-Length: 10\r\nConnection: close\r\n\r\nnot found\n";
+		}
+
+		size_t sent = 0;
+		while (sent < response.size() && !m_Stop)
+		{
+			auto result = send(client, response.data() + sent, (int) (response.size() - sent), METRICS_SEND_FLAGS);
+			if (result <= 0)
+			{
+				return;
+			}
+
+			sent += (size_t) result;
+		}
+	}
+
+}
@@ -0,0 +1,146 @@
+#ifndef __SPHEREFLAKERAYTRACER_METRICS_H
+#define __SPHEREFLAKERAYTRACER_METRICS_H
+
+// no socket, (size_t) -1 is also INVALID_SOCKET on Windows
+#define METRICS_NO_SOCKET ((size_t) -1)
+
+namespace SphereflakeRaytracer
+{
+
+	// cumulative distribution of observations, bounds are the inclusive upper bounds of the buckets in ascending order
+	// and a +Inf bucket catches everything above the last one
+	class MetricsHistogram
+	{
+
+		public:
+		explicit MetricsHistogram(const std::vector<double>& bounds) :
+			m_Bounds(bounds),
+			m_Counts(bounds.size() + 1, 0),
+			m_Sum(0.0),
+			m_Count(0)
+		{}
+
+		void Observe(double value)
+		{
+			auto bucket = 0u;
+			while (bucket < m_Bounds.size() && value > m_Bounds[bucket])
+			{
+				bucket++;
+			}
+
+			m_Counts[bucket]++;
+			m_Sum += value;
+			m_Count++;
+		}
+
+		const std::vector<double>& GetBounds() const
+		{
+			return m_Bounds;
+		}
+
+		// observations in every bucket, not accumulated, the last one is the +Inf bucket
+		const std::vector<unsigned long long>& GetCounts() const
+		{
+			return m_Counts;
+		}
+
+		double GetSum() const
+		{
+			return m_Sum;
+		}
+
+		unsigned long long GetCount() const
+		{
+			return m_Count;
+		}
+
+		private:
+		std::vector<double> m_Bounds;
+		std::vector<unsigned long long> m_Counts;
+		double m_Sum;
+		unsigned long long m_Count;
+
+	};
+
+	// a scrape page in the Prometheus text exposition format (version 0.0.4), every Add writes one metric family
+	// with its HELP and TYPE lines, names are expected to be valid metric names
+	class MetricsPage
+	{
+
+		public:
+		void AddGauge(const char* name, const char* help, double value);
+
+		// counters only grow, rates are left to the monitoring system
+		void AddCounter(const char* name, const char* help, double value);
+
+		// one counter per value labelled with its index, e.g. the rays of every worker
+		void AddCounters(const char* name, const char* help, const char* label, const std::vector<double>& values);
+
+		void AddHistogram(const char* name, const char* help, const MetricsHistogram& histogram);
+
+		const std::string& GetText() const
+		{
+			return m_Text;
+		}
+
+		private:
+		void AddFamily(const char* name, const char* help, const char* type);
+
+		void AddSample(const std::string& name, const std::string& labels, double value);
+
+		std::string m_Text;
+
+	};
+
+	// serves the latest page through a file (e.g. for the node_exporter textfile collector) and/or loopback HTTP
+	// the endpoint runs on a thread of its own and never waits for the publishing thread
+	class MetricsExporter
+	{
+
+		public:
+		MetricsExporter();
+
+		~MetricsExporter();
+
+		// the page goes to a temporary file next to it that is renamed over the old one, so readers never see half a page
+		void SetFile(const std::string& filename)
+		{
+			m_Filename = filename;
+		}
+
+		// answers GET /metrics on 127.0.0.1:port, false with GetError set if the port cannot be bound
+		bool Listen(unsigned short port);
+
+		// why Listen or the last file write failed
+		const std::string& GetError() const
+		{
+			return m_Error;
+		}
+
+		// replaces the page, to be called from one thread, false if the file could not be written
+		bool Publish(const std::string& text);
+
+		private:
+		MetricsExporter(const MetricsExporter&);
+		MetricsExporter& operator=(const MetricsExporter&);
+
+		void Serve();
+
+		void Respond(size_t client);
+
+		std::string m_Filename;
+		std::string m_Error;
+
+		// latest page as served over HTTP
+		std::string m_Text;
+		std::mutex m_TextMutex;
+
+		size_t m_Socket;
+		std::atomic<bool> m_Stop;
+		std::thread m_Thread;
+
+	};
+
+}
+
+#endif
@@ -0,0 +1,252 @@
+#pragma warning (push, 0)
+#pragma warning (disable: 4530) // disable warnings from code not under our control
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <cerrno>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#endif
+#endif
+
+#pragma warning (pop)
+
+#include "PerfCounters.h"
+
+// licence counter entries carry their level above the PERF_COUNTER_ bits
+#define PERF_LICENCE_LEVEL_SHIFT 8
+
+// CORE_POWER.LVL0_TURBO_LICENSE, LVL1 and LVL2, event 0x28 with one umask per level
+#define PERF_LICENCE_EVENT(umask) (0x28 | ((umask) << 8))
+
+namespace SphereflakeRaytracer
+{
+
+	std::string PerfCounterValues::Describe() const
+	{
+		const char* names[] = { "cycles", "instructions", "L1D misses", "LLC misses", "branch misses", "AVX licence" };
+
+		std::string result;
+		for (auto i = 0u; i < sizeof(names) / sizeof(names[0]); i++)
+		{
+			if (available & (1u << i))
+			{
+				result += (result.empty() ? "" : ", ") + std::string(names[i]);
+			}
+		}
+
+		return result.empty() ? "none" : result;
+	}
+
+#ifdef __linux__
+
+	// the licence events are model-specific, other CPUs would count something unrelated under the same encoding
+	static bool HasLicenceEvents()
+	{
+#if defined(__x86_64__) || defined(__i386__)
+
+		unsigned eax, ebx, ecx, edx;
+		if (!__get_cpuid(0, &eax, &ebx, &ecx, &edx))
+		{
+			return false;
+		}
+
+		// "GenuineIntel"
+		if (ebx != 0x756e6547 || edx != 0x49656e69 || ecx != 0x6c65746e)
+		{
+			return false;
+		}
+
+		__get_cpuid(1, &eax, &ebx, &ecx, &edx);
+		auto family = (eax >> 8) & 0xf;
+		auto model = ((eax >> 4) & 0xf) | (((eax >> 16) & 0xf) << 4);
+
+		// Skylake-SP and Cascade Lake, Ice Lake-SP
+		return family == 6 && (model == 0x55 || model == 0x6a || model == 0x6c);
+
+#else
+
+		return false;
+
+#endif
+	}
+
+	PerfCounters::PerfCounters() :
+		m_Available(0)
+	{
+		for (auto& group : m_Groups)
+		{
+			group.leader = -1;
+		}
+
+		// without the leader the group cannot be scheduled, the misses are optional
+		if (!Open(m_Groups[0], PERF_COUNTER_CYCLES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES))
+		{
+			m_Error = std::string("perf_event_open failed: ") + strerror(errno);
+			if (errno == EACCES || errno == EPERM)
+			{
+				m_Error += ", check /proc/sys/kernel/perf_event_paranoid";
+			}
+			else if (errno == ENOENT || errno == EOPNOTSUPP)
+			{
+				m_Error += ", the CPU exposes no hardware counters (virtual machine?)";
+			}
+
+			return;
+		}
+
+		Open(m_Groups[0], PERF_COUNTER_INSTRUCTIONS, PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS);
+		Open(m_Groups[0], PERF_COUNTER_L1D_MISSES, PERF_TYPE_HW_CACHE,
+			PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16));
+		Open(m_Groups[0], PERF_COUNTER_LLC_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES);
+		Open(m_Groups[0], PERF_COUNTER_BRANCH_MISSES, PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES);
+
+		if (HasLicenceEvents())
+		{
+			const unsigned long long umasks[PERF_LICENCE_LEVELS] = { 0x07, 0x18, 0x20 };
+			for (auto level = 0u; level < PERF_LICENCE_LEVELS; level++)
+			{
+				Open(m_Groups[1], PERF_COUNTER_LICENCE | (level << PERF_LICENCE_LEVEL_SHIFT), PERF_TYPE_RAW, PERF_LICENCE_EVENT(umasks[level]));
+			}
+
+			// the levels only make sense together
+			if (m_Groups[1].fds.size() != PERF_LICENCE_LEVELS)
+			{
+				for (auto fd : m_Groups[1].fds)
+				{
+					close(fd);
+				}
+
+				m_Groups[1].fds.clear();
+				m_Groups[1].counters.clear();
+				m_Groups[1].leader = -1;
+			}
+		}
+
+		for (auto& group : m_Groups)
+		{
+			for (auto counter : group.counters)
+			{
+				m_Available |= counter & ((1u << PERF_LICENCE_LEVEL_SHIFT) - 1);
+			}
+		}
+	}
+
+	PerfCounters::~PerfCounters()
+	{
+		for (auto& group : m_Groups)
+		{
+			for (auto fd : group.fds)
+			{
+				close(fd);
+			}
+		}
+	}
+
+	bool PerfCounters::Open(Group& group, unsigned counter, unsigned type, unsigned long long config)
+	{
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.size = sizeof(attr);
+		attr.type = type;
+		attr.config = config;
+		attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+		// user-mode only, which perf_event_paranoid 2 still allows for one's own threads
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+
+		// the calling thread on whatever CPU it runs
+		auto fd = (int) syscall(__NR_perf_event_open, &attr, 0, -1, group.leader, 0);
+		if (fd < 0)
+		{
+			return false;
+		}
+
+		if (group.leader < 0)
+		{
+			group.leader = fd;
+		}
+
+		group.fds.push_back(fd);
+		group.counters.push_back(counter);
+		return true;
+	}
+
+	void PerfCounters::ReadGroup(const Group& group, PerfCounterValues& values) const
+	{
+		if (group.leader < 0)
+		{
+			return;
+		}
+
+		// number of counters, time enabled, time running, then one value per counter
+		std::vector<unsigned long long> buffer(3 + group.fds.size());
+		auto size = buffer.size() * sizeof(unsigned long long);
+		if (read(group.leader, buffer.data(), size) != (ssize_t) size || buffer[0] != group.fds.size())
+		{
+			return;
+		}
+
+		auto enabled = buffer[1];
+		auto running = buffer[2];
+		if (running == 0)
+		{
+			return;
+		}
+
+		for (size_t i = 0; i < group.counters.size(); i++)
+		{
+			auto value = (unsigned long long) ((double) buffer[3 + i] * (double) enabled / (double) running);
+			auto counter = group.counters[i];
+
+			switch (counter & ((1u << PERF_LICENCE_LEVEL_SHIFT) - 1))
+			{
+				case PERF_COUNTER_CYCLES: values.cycles = value; break;
+				case PERF_COUNTER_INSTRUCTIONS: values.instructions = value; break;
+				case PERF_COUNTER_L1D_MISSES: values.l1dMisses = value; break;
+				case PERF_COUNTER_LLC_MISSES: values.llcMisses = value; break;
+				case PERF_COUNTER_BRANCH_MISSES: values.branchMisses = value; break;
+				case PERF_COUNTER_LICENCE: values.licenceCycles[counter >> PERF_LICENCE_LEVEL_SHIFT] = value; break;
+			}
+		}
+	}
+
+	PerfCounterValues PerfCounters::Read() const
+	{
+		PerfCounterValues values;
+		values.available = m_Available;
+
+		for (auto& group : m_Groups)
+		{
+			ReadGroup(group, values);
+		}
+
+		return values;
+	}
+
+#else
+
+	PerfCounters::PerfCounters() :
+		m_Available(0),
+		m_Error("hardware counters are only read through perf_event_open on Linux")
+	{}
+
+	PerfCounters::~PerfCounters()
+	{}
+
+	PerfCounterValues PerfCounters::Read() const
+	{
+		return PerfCounterValues();
+	}
+
+#endif
+
+}
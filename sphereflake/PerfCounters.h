@@ -0,0 +1,139 @@
+#ifndef __SPHEREFLAKERAYTRACER_PERFCOUNTERS_H
+#define __SPHEREFLAKERAYTRACER_PERFCOUNTERS_H
+
+// bits of PerfCounterValues::available
+#define PERF_COUNTER_CYCLES (1u << 0)
+#define PERF_COUNTER_INSTRUCTIONS (1u << 1)
+#define PERF_COUNTER_L1D_MISSES (1u << 2)
+#define PERF_COUNTER_LLC_MISSES (1u << 3)
+#define PERF_COUNTER_BRANCH_MISSES (1u << 4)
+#define PERF_COUNTER_LICENCE (1u << 5)
+
+// AVX frequency licence levels, 0 is the full turbo frequency, 1 and 2 are the reduced ones heavy AVX2 and AVX-512 code runs at
+#define PERF_LICENCE_LEVELS 3
+
+namespace SphereflakeRaytracer
+{
+
+	// hardware event counts of user-mode code, counters that could not be opened stay at zero
+	struct PerfCounterValues
+	{
+		PerfCounterValues() : cycles(0), instructions(0), l1dMisses(0), llcMisses(0), branchMisses(0), available(0)
+		{
+			for (auto& level : licenceCycles)
+			{
+				level = 0;
+			}
+		}
+
+		unsigned long long cycles;
+		unsigned long long instructions;
+
+		// L1 data cache read misses and last level cache misses
+		unsigned long long l1dMisses;
+		unsigned long long llcMisses;
+
+		unsigned long long branchMisses;
+
+		// cycles spent at every licence level, only on Intel CPUs that have the CORE_POWER events (Skylake-SP, Cascade Lake,
+		// Ice Lake-SP)
+		unsigned long long licenceCycles[PERF_LICENCE_LEVELS];
+
+		// PERF_COUNTER_ bits of the counters that were open
+		unsigned available;
+
+		double GetIpc() const
+		{
+			return cycles > 0 ? (double) instructions / (double) cycles : 0.0;
+		}
+
+		// counters listed in available, e.g. "cycles, instructions, branch misses"
+		std::string Describe() const;
+
+		PerfCounterValues& operator+=(const PerfCounterValues& other)
+		{
+			cycles += other.cycles;
+			instructions += other.instructions;
+			l1dMisses += other.l1dMisses;
+			llcMisses += other.llcMisses;
+			branchMisses += other.branchMisses;
+
+			for (auto level = 0u; level < PERF_LICENCE_LEVELS; level++)
+			{
+				licenceCycles[level] += other.licenceCycles[level];
+			}
+
+			available |= other.available;
+			return *this;
+		}
+
+		// counts since an earlier reading of the same counters
+		PerfCounterValues operator-(const PerfCounterValues& earlier) const
+		{
+			PerfCounterValues result;
+			result.cycles = cycles - earlier.cycles;
+			result.instructions = instructions - earlier.instructions;
+			result.l1dMisses = l1dMisses - earlier.l1dMisses;
+			result.llcMisses = llcMisses - earlier.llcMisses;
+			result.branchMisses = branchMisses - earlier.branchMisses;
+
+			for (auto level = 0u; level < PERF_LICENCE_LEVELS; level++)
+			{
+				result.licenceCycles[level] = licenceCycles[level] - earlier.licenceCycles[level];
+			}
+
+			result.available = available;
+			return result;
+		}
+	};
+
+	// hardware counters of the constructing thread, perf_event_open on Linux and unavailable elsewhere
+	// counts are extrapolated when the PMU multiplexes the event groups
+	class PerfCounters
+	{
+
+		public:
+		PerfCounters();
+
+		~PerfCounters();
+
+		bool IsAvailable() const
+		{
+			return m_Available != 0;
+		}
+
+		// why no counter could be opened, e.g. perf_event_paranoid or no PMU inside a virtual machine
+		const std::string& GetError() const
+		{
+			return m_Error;
+		}
+
+		// current counts, may be called from any thread while the owning thread runs
+		PerfCounterValues Read() const;
+
+		private:
+		PerfCounters(const PerfCounters&);
+		PerfCounters& operator=(const PerfCounters&);
+
+		struct Group
+		{
+			int leader;
+			std::vector<int> fds;
+
+			// PERF_COUNTER_ bit, or PERF_COUNTER_LICENCE plus the level, of every descriptor in read order
+			std::vector<unsigned> counters;
+		};
+
+		bool Open(Group& group, unsigned counter, unsigned type, unsigned long long config);
+
+		void ReadGroup(const Group& group, PerfCounterValues& values) const;
+
+		Group m_Groups[2];
+		unsigned m_Available;
+		std::string m_Error;
+
+	};
+
+}
+
+#endif
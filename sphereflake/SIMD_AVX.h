@@ -12,6 +12,8 @@ namespace SphereflakeRaytracer
 		//using VecType = __m256;
 		typedef __m256 VecType;
 
+		const size_t PacketSize = 8;
+
 		namespace Constants
 		{
 
@@ -23,9 +25,21 @@ namespace SphereflakeRaytracer
 			const __m256 two = _mm256_set1_ps(2.0f);
 			const __m256 three = _mm256_set1_ps(3.0f);
 			const __m256 seventy = _mm256_set1_ps(70.f);
+			const __m256 laneIndices = _mm256_set_ps(7.0f, 6.0f, 5.0f, 4.0f, 3.0f, 2.0f, 1.0f, 0.0f);
 
 		}
 
+		inline size_t CountLanes(int mask)
+		{
+			size_t count = 0;
+			for (; mask != 0; mask &= mask - 1)
+			{
+				count++;
+			}
+
+			return count;
+		}
+
 		struct Matrix4
 		{
 
@@ -233,6 +247,51 @@ namespace SphereflakeRaytracer
 			return result;
 		}
 
+		// octahedral encoding of unit normals as two 16-bit snorm values, x in the low and y in the high
+		// 16 bits as expected by unpackSnorm2x16, zero vectors encode to 0
+		inline __m256 EncodeOctahedral(const Vec3Packet& n)
+		{
+			auto signMask = _mm256_set1_ps(-0.0f);
+
+			auto sum = _mm256_add_ps(_mm256_add_ps(_mm256_andnot_ps(signMask, n.x), _mm256_andnot_ps(signMask, n.y)), _mm256_andnot_ps(signMask, n.z));
+			auto nonZero = _mm256_cmp_ps(sum, Constants::zero, _CMP_GT_OQ);
+
+			auto px = _mm256_div_ps(n.x, sum);
+			auto py = _mm256_div_ps(n.y, sum);
+
+			// fold the lower hemisphere over the diagonals
+			auto signX = _mm256_or_ps(Constants::one, _mm256_and_ps(_mm256_cmp_ps(px, Constants::zero, _CMP_LT_OQ), signMask));
+			auto signY = _mm256_or_ps(Constants::one, _mm256_and_ps(_mm256_cmp_ps(py, Constants::zero, _CMP_LT_OQ), signMask));
+			auto foldedX = _mm256_mul_ps(_mm256_sub_ps(Constants::one, _mm256_andnot_ps(signMask, py)), signX);
+			auto foldedY = _mm256_mul_ps(_mm256_sub_ps(Constants::one, _mm256_andnot_ps(signMask, px)), signY);
+
+			auto lower = _mm256_cmp_ps(n.z, Constants::zero, _CMP_LT_OQ);
+			px = _mm256_blendv_ps(px, foldedX, lower);
+			py = _mm256_blendv_ps(py, foldedY, lower);
+
+			auto scale = _mm256_set1_ps(32767.0f);
+			auto x = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(px, Constants::minusOne), Constants::one), scale));
+			auto y = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_min_ps(_mm256_max_ps(py, Constants::minusOne), Constants::one), scale));
+
+			// AVX has no 256-bit integer operations, pack each half separately
+			auto lowMask = _mm_set1_epi32(0xffff);
+			auto codeLow = _mm_or_si128(_mm_and_si128(_mm256_castsi256_si128(x), lowMask), _mm_slli_epi32(_mm256_castsi256_si128(y), 16));
+			auto codeHigh = _mm_or_si128(_mm_and_si128(_mm256_extractf128_si256(x, 1), lowMask), _mm_slli_epi32(_mm256_extractf128_si256(y, 1), 16));
+
+			auto code = _mm256_insertf128_si256(_mm256_castsi128_si256(codeLow), codeHigh, 1);
+			return _mm256_and_ps(_mm256_castsi256_ps(code), nonZero);
+		}
+
+		// transposes two registers into (a, b) pairs in lane order
+		inline void StoreInterleaved(const __m256& a, const __m256& b, float* out)
+		{
+			auto low = _mm256_unpacklo_ps(a, b);
+			auto high = _mm256_unpackhi_ps(a, b);
+
+			_mm256_storeu_ps(out, _mm256_permute2f128_ps(low, high, 0x20));
+			_mm256_storeu_ps(out + 8, _mm256_permute2f128_ps(low, high, 0x31));
+		}
+
 		inline __m256 RaySphereIntersection
 		(
 			const Vec3Packet& rayDirection,
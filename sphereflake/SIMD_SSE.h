@@ -8,6 +8,8 @@ namespace SphereflakeRaytracer
 	{
 		typedef __m128 VecType;
 
+		const size_t PacketSize = 4;
+
 		namespace Constants
 		{
 
@@ -19,7 +21,19 @@ namespace SphereflakeRaytracer
 			const __m128 two = _mm_set1_ps(2.0f);
 			const __m128 three = _mm_set1_ps(3.0f);
 			const __m128 sixty = _mm_set1_ps(60.0f);
+			const __m128 laneIndices = _mm_set_ps(3.0f, 2.0f, 1.0f, 0.0f);
+
+		}
+
+		inline size_t CountLanes(int mask)
+		{
+			size_t count = 0;
+			for (; mask != 0; mask &= mask - 1)
+			{
+				count++;
+			}
 
+			return count;
 		}
 
 		struct Matrix4
@@ -249,6 +263,43 @@ namespace SphereflakeRaytracer
 			return result;
 		}
 
+		// octahedral encoding of unit normals as two 16-bit snorm values, x in the low and y in the high
+		// 16 bits as expected by unpackSnorm2x16, zero vectors encode to 0
+		inline __m128 EncodeOctahedral(const Vec3Packet& n)
+		{
+			auto signMask = _mm_set1_ps(-0.0f);
+
+			auto sum = _mm_add_ps(_mm_add_ps(_mm_andnot_ps(signMask, n.x), _mm_andnot_ps(signMask, n.y)), _mm_andnot_ps(signMask, n.z));
+			auto nonZero = _mm_cmpgt_ps(sum, Constants::zero);
+
+			auto px = _mm_div_ps(n.x, sum);
+			auto py = _mm_div_ps(n.y, sum);
+
+			// fold the lower hemisphere over the diagonals
+			auto signX = _mm_or_ps(Constants::one, _mm_and_ps(_mm_cmplt_ps(px, Constants::zero), signMask));
+			auto signY = _mm_or_ps(Constants::one, _mm_and_ps(_mm_cmplt_ps(py, Constants::zero), signMask));
+			auto foldedX = _mm_mul_ps(_mm_sub_ps(Constants::one, _mm_andnot_ps(signMask, py)), signX);
+			auto foldedY = _mm_mul_ps(_mm_sub_ps(Constants::one, _mm_andnot_ps(signMask, px)), signY);
+
+			auto lower = _mm_cmplt_ps(n.z, Constants::zero);
+			px = _mm_or_ps(_mm_and_ps(lower, foldedX), _mm_andnot_ps(lower, px));
+			py = _mm_or_ps(_mm_and_ps(lower, foldedY), _mm_andnot_ps(lower, py));
+
+			auto scale = _mm_set1_ps(32767.0f);
+			auto x = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(px, Constants::minusOne), Constants::one), scale));
+			auto y = _mm_cvtps_epi32(_mm_mul_ps(_mm_min_ps(_mm_max_ps(py, Constants::minusOne), Constants::one), scale));
+
+			auto code = _mm_or_si128(_mm_and_si128(x, _mm_set1_epi32(0xffff)), _mm_slli_epi32(y, 16));
+			return _mm_and_ps(_mm_castsi128_ps(code), nonZero);
+		}
+
+		// transposes two registers into (a, b) pairs in lane order
+		inline void StoreInterleaved(const __m128& a, const __m128& b, float* out)
+		{
+			_mm_storeu_ps(out, _mm_unpacklo_ps(a, b));
+			_mm_storeu_ps(out + 4, _mm_unpackhi_ps(a, b));
+		}
+
 		inline __m128 RaySphereIntersection
 		(
 			const Vec3Packet& rayDirection,
@@ -2,8 +2,10 @@
 #pragma warning (disable: 4530) // disable warnings from code not under our control
 
 #include <iostream>
+#include <string>
 #include <vector>
 #include <memory>
+#include <atomic>
 #include <random>
 #include <fstream>
 
@@ -32,6 +34,8 @@ using namespace glm;
 #include "GLPixelBufferObject.h"
 #include "GLTexture2D.h"
 #include "GLFramebufferObject.h"
+#include "Trace.h"
+#include "GLTimestampQueries.h"
 
 #ifdef __ARCH_NO_AVX
 #include <tmmintrin.h>
@@ -67,9 +71,8 @@ namespace SphereflakeRaytracer
 		}
 
 		std::string ssaoFragmentSource;
-		if(!Filesystem::ReadAllText("Shaders/post_ssao.glsl", ssaoFragmentSource))
+		if(!GL::ReadPostShaderSource("Shaders/post_ssao.glsl", ssaoFragmentSource))
 		{
-			std::cout << "Couldn't open shader file: " << "Shaders/post_ssao.glsl" << std::endl;
 			exit(1);
 		}
 
@@ -85,9 +88,8 @@ namespace SphereflakeRaytracer
 		}
 
 		std::string blurFragmentSource;
-		if(!Filesystem::ReadAllText("Shaders/post_ssao_blur.glsl", blurFragmentSource))
+		if(!GL::ReadPostShaderSource("Shaders/post_ssao_blur.glsl", blurFragmentSource))
 		{
-			std::cout << "Couldn't open shader file: " << "Shaders/post_ssao_blur.glsl" << std::endl;
 			exit(1);
 		}
 
@@ -105,6 +107,9 @@ namespace SphereflakeRaytracer
 
 	void SSAO::Render()
 	{
+		TRACE_ZONE("SSAO");
+		GL::TimestampZone gpuZone(m_TimestampQueries.get(), "SSAO");
+
 		BindNoiseTexture();
 		m_SSAOTarget->SetActiveDraw();
 		m_SSAOProgram->Use();
@@ -114,8 +119,14 @@ namespace SphereflakeRaytracer
 		m_SSAOProgram->SetUniform("SSAOIntensity", m_SSAOIntensity);
 		m_SSAOProgram->SetUniform("SSAOScale", m_SSAOScale);
 		m_SSAOProgram->SetUniform("SSAOBias", m_SSAOBias);
+		m_SSAOProgram->SetUniform("cameraTopLeft", m_CameraTopLeft);
+		m_SSAOProgram->SetUniform("cameraTopRight", m_CameraTopRight);
+		m_SSAOProgram->SetUniform("cameraBottomLeft", m_CameraBottomLeft);
 
-		DRAW_FULLSCREEN_QUAD();
+		{
+			GL::TimestampZone passZone(m_TimestampQueries.get(), "SSAO occlusion");
+			DRAW_FULLSCREEN_QUAD();
+		}
 
 		m_BlurHorizontalTarget->SetActiveDraw();
 
@@ -127,8 +138,14 @@ namespace SphereflakeRaytracer
 		m_BlurProgram->SetUniform("depthThreshold", m_DepthThreshold);
 		m_BlurProgram->SetUniform("framebufferSize", vec2(m_BlurHorizontalTarget->GetWidth(), m_BlurHorizontalTarget->GetHeight()));
 		m_BlurProgram->SetUniform("blurDirection", vec2(1.0, 0.0));
+		m_BlurProgram->SetUniform("cameraTopLeft", m_CameraTopLeft);
+		m_BlurProgram->SetUniform("cameraTopRight", m_CameraTopRight);
+		m_BlurProgram->SetUniform("cameraBottomLeft", m_CameraBottomLeft);
 
-		DRAW_FULLSCREEN_QUAD();
+		{
+			GL::TimestampZone passZone(m_TimestampQueries.get(), "SSAO blur horizontal");
+			DRAW_FULLSCREEN_QUAD();
+		}
 
 		m_BlurVerticalTarget->SetActiveDraw();
 		glBindTexture(GL_TEXTURE_2D, m_BlurHorizontalTarget->GetTexture());
@@ -138,7 +155,10 @@ namespace SphereflakeRaytracer
 		m_BlurProgram->SetUniform("depthThreshold", m_DepthThreshold);
 		m_BlurProgram->SetUniform("blurDirection", vec2(0.0, 1.0));
 
-		DRAW_FULLSCREEN_QUAD();
+		{
+			GL::TimestampZone passZone(m_TimestampQueries.get(), "SSAO blur vertical");
+			DRAW_FULLSCREEN_QUAD();
+		}
 	}
 
 	void SSAO::GenerateNoiseTexture()
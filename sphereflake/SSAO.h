@@ -17,6 +17,20 @@ namespace SphereflakeRaytracer
 			m_SSAOSampleRadius = 8.0f * m;
 		}
 
+		// camera corners relative to the camera position, used to reconstruct positions from the G-buffer depth
+		void SetCameraCorners(const vec3& topLeft, const vec3& topRight, const vec3& bottomLeft)
+		{
+			m_CameraTopLeft = topLeft;
+			m_CameraTopRight = topRight;
+			m_CameraBottomLeft = bottomLeft;
+		}
+
+		// GPU times of the passes are recorded with the queries if there are any
+		void SetTimestampQueries(const std::shared_ptr<GL::TimestampQueries>& queries)
+		{
+			m_TimestampQueries = queries;
+		}
+
 		void Render();
 
 		GLuint GetSSAOTexture()
@@ -36,6 +50,8 @@ namespace SphereflakeRaytracer
 		std::shared_ptr<GL::Program> m_SSAOProgram;
 		std::shared_ptr<GL::Program> m_BlurProgram;
 
+		std::shared_ptr<GL::TimestampQueries> m_TimestampQueries;
+
 		std::vector<vec3> m_Kernel;
 		GLuint m_NoiseTexture;
 
@@ -46,6 +62,10 @@ namespace SphereflakeRaytracer
 		float m_NormalThreshold;
 		float m_DepthThreshold;
 
+		vec3 m_CameraTopLeft;
+		vec3 m_CameraTopRight;
+		vec3 m_CameraBottomLeft;
+
 	};
 
 }
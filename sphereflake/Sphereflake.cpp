@@ -1,11 +1,22 @@
 #pragma warning (push, 0)
 #pragma warning (disable: 4530) // disable warnings from code not under our control
 
+#include <string>
+#include <vector>
 #include <thread>
 #include <random>
 #include <memory>
+#include <atomic>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <stdexcept>
+#include <algorithm>
 #include <iostream>
+#include <fstream>
 #include <mmintrin.h>
+#include <emmintrin.h>
 
 #define GLM_FORCE_RADIANS
 #include <glm.hpp>
@@ -19,12 +30,13 @@
 
 using namespace glm;
 
-#define GLFW_DLL
-#include <GLFW/glfw3.h>
-
 #pragma warning (pop)
 
 #include "Sobol.h"
+#include "FrameArena.h"
+#include "Topology.h"
+#include "Trace.h"
+#include "PerfCounters.h"
 
 #ifdef __ARCH_NO_AVX
 #include "SIMD_SSE.h"
@@ -35,28 +47,108 @@ using namespace glm;
 #include "Sphereflake.h"
 #include "Util.h"
 
-extern GLFWwindow* window;
+// the progressive pass traces cells of 4x4, 2x2 and 1x1 pixels, one cell per packet pixel
+#define PROGRESSIVE_LEVELS 3
+#define PROGRESSIVE_BASE_CELL_SIZE 4
+
+#define GBUFFER_WRITER_IDLE 1u
+
+// snorm value -32768 is never produced by the normal encoding, texels holding it have not been written
+#define GBUFFER_EMPTY_NORMAL 0x80008000u
+
+// merge ticket value while no publish is in progress
+#define GBUFFER_NO_MERGE (std::numeric_limits<size_t>::max() / 2)
+
+// frame ticket value while the tiles of a full frame are not open to the workers
+#define FRAME_TILES_CLOSED (std::numeric_limits<size_t>::max() / 2)
+
+// packets traced back to back are recorded as one trace zone, a packet alone is too short to be worth an event
+#define TRACE_BATCH_PACKETS 256
+
+static_assert(GBUFFER_TILE_SIZE == 32, "Morton offsets inside a G-buffer tile are computed for 5 bits per axis");
 
 namespace SphereflakeRaytracer
 {
 
+	static size_t GetTiledTexelCount(size_t width, size_t height)
+	{
+		auto tilesX = (width + GBUFFER_TILE_SIZE - 1) / GBUFFER_TILE_SIZE;
+		auto tilesY = (height + GBUFFER_TILE_SIZE - 1) / GBUFFER_TILE_SIZE;
+		return tilesX * tilesY * GBUFFER_TILE_SIZE * GBUFFER_TILE_SIZE;
+	}
+
+	static size_t GetGBufferArenaSize(size_t width, size_t height)
+	{
+		return FrameArena::RoundToHugePages(width * height * sizeof(GBufferTexel)) +
+			2 * FrameArena::RoundToHugePages(GetTiledTexelCount(width, height) * sizeof(GBufferTexel)) +
+			FrameArena::RoundToHugePages(width * height * sizeof(std::atomic<unsigned>));
+	}
+
 	Sphereflake::Sphereflake(size_t width, size_t height) :
 		m_Width(width),
 		m_Height(height),
+		m_FrameArena(GetGBufferArenaSize(width, height)),
+		m_GBufferTouched(false),
+		m_TouchedParts(0),
+		m_TilesX((width + GBUFFER_TILE_SIZE - 1) / GBUFFER_TILE_SIZE),
+		m_TilesY((height + GBUFFER_TILE_SIZE - 1) / GBUFFER_TILE_SIZE),
+		m_GBufferGeneration(0),
+		m_PerfCountersEnabled(false),
+		m_MergeSource(nullptr),
+		m_MergeStaging(nullptr),
+		m_MergeTileCount(0),
+		m_MergeTicket(GBUFFER_NO_MERGE),
+		m_MergedTiles(0),
+		m_MergeHelpers(0),
+		m_WorkerCapacity(0),
+		m_WorkerTarget(0),
+		m_Paused(false),
 		m_Deinitialize(false),
-		m_MaxDepthReached(0),
-		m_RaysPerSecond(0),
-		m_ClosestSphereDistance(std::numeric_limits<float>::max())
+		m_HasView(false),
+		m_ProgressiveRefinement(false),
+		m_ProgressiveThreshold(16.0f),
+		m_ProgressiveTicket(0),
+		m_FrameEpoch(0),
+		m_FrameTicket(FRAME_TILES_CLOSED),
+		m_FrameTilesDone(0),
+		m_FramePending(false),
+		m_ViewEpoch(1),
+		m_PixelEpochs(nullptr),
+		m_SampledPixels(1ULL << 32),
+		m_ParkedWorkers(0)
 	{
-		m_GBuffer.positions.resize(width * height);
-		m_GBuffer.normals.resize(width * height);
+		// nothing is written here, the pages are committed by the first touch in TouchGBuffer
+		m_GBuffer.texels = (GBufferTexel*) m_FrameArena.Allocate(width * height * sizeof(GBufferTexel));
+		m_PixelEpochs = (std::atomic<unsigned>*) m_FrameArena.Allocate(width * height * sizeof(std::atomic<unsigned>));
+		m_MergeTiles.resize(m_TilesX * m_TilesY);
+		m_UpdatedTiles.reserve(m_TilesX * m_TilesY);
+
+#ifdef SPHEREFLAKE_HEATMAP
+		m_Heatmap.resize(width * height);
+#endif
+
+		for (auto&& buffer : m_WriteBuffers)
+		{
+			// arena blocks start on a huge page, so tiles also start on the cache lines that streaming stores fill
+			buffer.tiles = (GBufferTexel*) m_FrameArena.Allocate(GetTiledTexelCount(width, height) * sizeof(GBufferTexel));
+			buffer.dirtyTiles = std::vector<std::atomic<bool>>(m_TilesX * m_TilesY);
+		}
+
+		m_Views[0].sequence = 0;
+		m_Views[1].view.epoch = 1;
+		m_Views[1].sequence = 1;
 
 		ComputeChildTransformations();
 	}
 
 	Sphereflake::~Sphereflake()
 	{
-		m_Deinitialize = true;
+		{
+			std::lock_guard<std::mutex> lock(m_ParkMutex);
+			m_Deinitialize = true;
+		}
+
+		m_ParkCondition.notify_all();
 
 		for (auto&& i : m_Threads)
 		{
@@ -66,151 +158,1466 @@ namespace SphereflakeRaytracer
 
 	void Sphereflake::Initialize()
 	{
-		auto threadCount = std::thread::hardware_concurrency();
-		for (auto i = 0u; i < threadCount; i++)
+		m_Topology = CpuTopology::Detect();
+		m_WorkerAffinity = WorkerAffinity::Plan(m_Topology, m_ThreadPlacement);
+		auto threadCount = m_WorkerAffinity.workers.size();
+
+		if (!m_WorkerAffinity.mainThread.empty())
+		{
+			CpuTopology::SetCurrentThreadAffinity(m_WorkerAffinity.mainThread);
+		}
+
+		m_WorkerCapacity = std::max(threadCount, std::max(m_Topology.GetCpus().size(), (size_t) std::thread::hardware_concurrency()));
+		m_WorkerTarget = threadCount;
+
+		m_GBufferWriters.reset(new GBufferWriter[m_WorkerCapacity]);
+		m_WorkerStats.reset(new WorkerStats[m_WorkerCapacity]);
+		m_WorkerPerfCounters.reset(new WorkerPerfCounters[m_WorkerCapacity]);
+		for (size_t i = 0; i < m_WorkerCapacity; i++)
+		{
+			m_GBufferWriters[i].generation = GBUFFER_WRITER_IDLE;
+			m_GBufferWriters[i].viewEpoch = 0;
+			m_WorkerStats[i].Store(TraversalStats());
+			m_WorkerStats[i].closestEpoch = 0;
+			m_WorkerStats[i].closestDistance = std::numeric_limits<float>::max();
+		}
+
+		// every worker commits its share of the G-buffers on the node it runs on, and nobody writes a packet
+		// before all shares are done or an owner could still overwrite it with the empty marker
+		auto touchParts = m_GBufferTouched ? 0 : threadCount;
+		m_TouchedParts = 0;
+
+		for (size_t i = 0; i < threadCount; i++)
+		{
+			StartWorker(i, touchParts);
+		}
+
+		while (m_TouchedParts.load() < touchParts)
+		{
+			std::this_thread::yield();
+		}
+
+		m_GBufferTouched = true;
+	}
+
+	void Sphereflake::StartWorker(size_t workerIndex, size_t touchParts)
+	{
+		auto cpus = m_WorkerAffinity.workers[workerIndex];
+
+		m_Threads.push_back(std::make_shared<std::thread>([this, workerIndex, cpus, touchParts]
+		{
+			Trace::SetThreadName("worker " + std::to_string(workerIndex));
+
+			if (!cpus.empty())
+			{
+				CpuTopology::SetCurrentThreadAffinity(cpus);
+			}
+
+			if (m_PerfCountersEnabled)
+			{
+				OpenWorkerPerfCounters(workerIndex);
+			}
+
+			if (touchParts > 0)
+			{
+				TRACE_ZONE("Touch G-buffer");
+				TouchGBuffer(workerIndex, touchParts);
+				m_TouchedParts++;
+
+				while (m_TouchedParts.load() < touchParts)
+				{
+					std::this_thread::yield();
+				}
+			}
+
+			DoImagePart(workerIndex);
+
+			if (m_PerfCountersEnabled)
+			{
+				CloseWorkerPerfCounters(workerIndex);
+			}
+		}));
+	}
+
+	void Sphereflake::OpenWorkerPerfCounters(size_t workerIndex)
+	{
+		std::unique_ptr<PerfCounters> counters(new PerfCounters());
+
+		std::lock_guard<std::mutex> lock(m_PerfCountersMutex);
+		if (!counters->IsAvailable() && m_PerfCounterError.empty())
+		{
+			m_PerfCounterError = counters->GetError();
+		}
+
+		m_WorkerPerfCounters[workerIndex].counters = std::move(counters);
+	}
+
+	void Sphereflake::CloseWorkerPerfCounters(size_t workerIndex)
+	{
+		std::lock_guard<std::mutex> lock(m_PerfCountersMutex);
+
+		auto& slot = m_WorkerPerfCounters[workerIndex];
+		slot.retired += slot.counters->Read();
+		slot.counters = nullptr;
+	}
+
+	std::string Sphereflake::GetPerfCounterError() const
+	{
+		std::lock_guard<std::mutex> lock(m_PerfCountersMutex);
+		return m_PerfCounterError;
+	}
+
+	void Sphereflake::SetWorkerCount(size_t count)
+	{
+		count = std::min(std::max(count, (size_t) 1), m_WorkerCapacity);
+
+		auto current = m_Threads.size();
+		if (count > current)
+		{
+			// plans are prefixes of each other, so the running workers keep their CPUs
+			auto placement = m_ThreadPlacement;
+			placement.workerCount = count;
+			m_WorkerAffinity.workers = WorkerAffinity::Plan(m_Topology, placement).workers;
+
+			m_WorkerTarget = count;
+
+			for (auto i = current; i < count; i++)
+			{
+				StartWorker(i, 0);
+			}
+		}
+		else if (count < current)
+		{
+			{
+				std::lock_guard<std::mutex> lock(m_ParkMutex);
+				m_WorkerTarget = count;
+			}
+
+			m_ParkCondition.notify_all();
+
+			for (auto i = count; i < current; i++)
+			{
+				m_Threads[i]->join();
+			}
+
+			m_Threads.resize(count);
+			m_WorkerAffinity.workers.resize(count);
+		}
+	}
+
+	void Sphereflake::Pause()
+	{
+		std::lock_guard<std::mutex> lock(m_ParkMutex);
+		m_Paused = true;
+	}
+
+	void Sphereflake::Resume()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_ParkMutex);
+			m_Paused = false;
+		}
+
+		m_ParkCondition.notify_all();
+	}
+
+	void Sphereflake::TouchGBuffer(size_t part, size_t parts)
+	{
+		GBufferTexel emptyTexel;
+		emptyTexel.depth = 0.0f;
+		emptyTexel.normal = GBUFFER_EMPTY_NORMAL;
+
+		GBufferTexel missTexel;
+		missTexel.depth = 0.0f;
+		missTexel.normal = 0;
+
+		// a contiguous run of tiles in the back buffers and a band of rows in the front buffer and the pixel epochs,
+		// pages straddling two parts end up with whichever worker gets there first
+		auto tileCount = m_TilesX * m_TilesY;
+		auto tileTexels = GBUFFER_TILE_SIZE * GBUFFER_TILE_SIZE;
+		auto firstTile = tileCount * part / parts;
+		auto lastTile = tileCount * (part + 1) / parts;
+
+		for (auto&& buffer : m_WriteBuffers)
+		{
+			std::fill(buffer.tiles + firstTile * tileTexels, buffer.tiles + lastTile * tileTexels, emptyTexel);
+		}
+
+		auto firstRow = m_Height * part / parts;
+		auto lastRow = m_Height * (part + 1) / parts;
+		std::fill(m_GBuffer.texels + firstRow * m_Width, m_GBuffer.texels + lastRow * m_Width, missTexel);
+
+		for (auto i = firstRow * m_Width; i < lastRow * m_Width; i++)
 		{
-			m_Threads.push_back(std::make_shared<std::thread>(std::bind(&Sphereflake::DoImagePart, this)));
+			m_PixelEpochs[i].store(0, std::memory_order_relaxed);
 		}
 	}
 
 	void Sphereflake::SetView(const vec3& origin, const vec3& topLeft, const vec3& topRight, const vec3& bottomLeft)
 	{
-		m_RayOriginVec3 = origin;
-		m_RayOrigin.Set(origin);
-		m_TopLeft.Set(topLeft); 
-		m_TopRight.Set(topRight);
-		m_BottomLeft.Set(bottomLeft);
-		m_RootTransform.Set(translate(-m_RayOriginVec3) * CreateRotationMatrix(vec3(90, 0, 0)));
+		bool changed = !m_HasView || origin != m_LastOrigin || topLeft != m_LastTopLeft || topRight != m_LastTopRight || bottomLeft != m_LastBottomLeft;
+		if (!changed)
+		{
+			return;
+		}
+
+		bool restartProgressive = m_HasView && ComputeViewDelta(origin, topLeft, topRight, bottomLeft) > m_ProgressiveThreshold;
+
+		m_HasView = true;
+		m_LastOrigin = origin;
+		m_LastTopLeft = topLeft;
+		m_LastTopRight = topRight;
+		m_LastBottomLeft = bottomLeft;
+
+		PublishView(restartProgressive);
 	}
 
-	void Sphereflake::DoImagePart()
+	void Sphereflake::SetFoveation(const Foveation& foveation)
 	{
-		std::mt19937 mt;
-		mt.seed((unsigned long) time(NULL));
-		std::uniform_int_distribution<unsigned int> rnd(0);
+		m_Foveation = foveation;
+		m_Foveation.peripheryDensity = clamp(foveation.peripheryDensity, 0.01f, 1.0f);
+		m_Foveation.peripheryRadius = max(foveation.peripheryRadius, foveation.foveaRadius);
 
-#ifdef __ARCH_NO_AVX
+		if (m_HasView)
+		{
+			PublishView(false);
+		}
+	}
 
-		auto width = _mm_set1_ps((float) m_Width);
-		auto height = _mm_set1_ps((float) m_Height);
+	void Sphereflake::SetGazePoint(const vec2& gaze)
+	{
+		if (gaze == m_Foveation.gaze)
+		{
+			return;
+		}
 
-#else
+		auto foveation = m_Foveation;
+		foveation.gaze = gaze;
+		SetFoveation(foveation);
+	}
 
-		auto width = _mm256_set1_ps((float) m_Width);
-		auto height = _mm256_set1_ps((float) m_Height);
+	void Sphereflake::SetPacketShape(const PacketShape& shape)
+	{
+		m_PacketShape = shape;
 
-#endif
+		// progressive tickets are laid out for a single shape
+		if (m_HasView)
+		{
+			PublishView(true);
+		}
+	}
 
-		SIMD::Vec3Packet position;
-		SIMD::Vec3Packet normal;
+	void Sphereflake::PublishView(bool restartProgressive)
+	{
+		// fill the slot that is not currently published
+		auto epoch = m_ViewEpoch.load(std::memory_order_relaxed) + 1;
+		auto& slot = m_Views[epoch & 1];
 
-		float floatMax = std::numeric_limits<float>::max();
-		unsigned long long sobolCounter = 0;
+		slot.sequence.store(0, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
 
-		float spinUp = 1.0f;
+		slot.view.origin = m_LastOrigin;
+		slot.view.topLeft = m_LastTopLeft;
+		slot.view.topRight = m_LastTopRight;
+		slot.view.bottomLeft = m_LastBottomLeft;
+		slot.view.rootTransform.Set(translate(-m_LastOrigin) * CreateRotationMatrix(vec3(90, 0, 0)));
+		slot.view.foveation = m_Foveation;
+		slot.view.shape = m_PacketShape;
+		slot.view.epoch = epoch;
 
-		for (;;)
+		slot.sequence.store(epoch, std::memory_order_release);
+
+		if (restartProgressive)
 		{
+			m_ProgressiveTicket = 0;
+		}
 
-#ifdef __ARCH_NO_AVX
+		// any other view change abandons a frame that is still being traced, which breaks its promise, and closes a
+		// finished one, workers parked on a drained frame would otherwise never wake up for the new view
+		{
+			std::lock_guard<std::mutex> lock(m_FrameMutex);
+			if (m_FrameEpoch.load(std::memory_order_relaxed) != epoch)
+			{
+				if (m_FramePending)
+				{
+					m_FramePromise = std::promise<void>();
+					m_FramePending = false;
+				}
+
+				m_FrameEpoch.store(0, std::memory_order_relaxed);
+			}
+		}
 
-			auto x0 = floorf(Sobol::Sample(sobolCounter, 0, rnd(mt)) * (m_Width - 1));
-			auto y0 = floorf(Sobol::Sample(sobolCounter, 1, rnd(mt)) * (m_Height - 1));
-			sobolCounter++;
+		{
+			std::lock_guard<std::mutex> lock(m_ParkMutex);
+			m_SampledPixels = (unsigned long long) epoch << 32;
+			m_ViewEpoch.store(epoch, std::memory_order_release);
+		}
 
-			float xa[4] = { x0, x0 + 1, x0, x0 + 1 };
-			float ya[4] = { y0, y0, y0 + 1, y0 + 1 };
+		m_ParkCondition.notify_all();
+	}
 
-			auto x = _mm_set_ps(xa[3], xa[2], xa[1], xa[0]);
-			auto y = _mm_set_ps(ya[3], ya[2], ya[1], ya[0]);
+	std::future<void> Sphereflake::RenderFrame()
+	{
+		std::future<void> future;
 
-			auto uvx = _mm_div_ps(x, width);
-			auto uvy = _mm_div_ps(y, height);
+		// the frame gets the epoch of the view published below
+		auto epoch = m_ViewEpoch.load(std::memory_order_relaxed) + 1;
+		{
+			std::lock_guard<std::mutex> lock(m_FrameMutex);
+			m_FramePromise = std::promise<void>();
+			future = m_FramePromise.get_future();
 
-			union
+			if (!m_HasView)
 			{
-				__m128 minT;
-				float minTArray[4];
-			};
+				m_FramePromise.set_exception(std::make_exception_ptr(std::logic_error("RenderFrame needs a view, SetView was not called")));
+				return future;
+			}
 
-			minT = _mm_set1_ps(floatMax);
+			m_FramePending = true;
+			m_FrameTicket.store(FRAME_TILES_CLOSED, std::memory_order_relaxed);
+			m_FrameEpoch.store(epoch, std::memory_order_relaxed);
+		}
 
-#else
-			auto x0 = 1 + floorf(Sobol::Sample(sobolCounter, 0, rnd(mt)) * (m_Width - 2));
-			auto y0 = 1 + floorf(Sobol::Sample(sobolCounter, 1, rnd(mt)) * (m_Height - 2));
-			sobolCounter++;
+		PublishView(false);
+
+		// a packet of an older view that is still being traced could be written over the frame, so the tiles only
+		// open once every worker has acknowledged the new view or parked
+		{
+			TRACE_ZONE("Wait for workers");
+
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+
+			for (size_t i = 0; i < m_WorkerCapacity; i++)
+			{
+				for (;;)
+				{
+					auto workerEpoch = m_GBufferWriters[i].viewEpoch.load();
+					if (workerEpoch == 0 || workerEpoch == epoch)
+					{
+						break;
+					}
+
+					std::this_thread::yield();
+				}
+			}
+		}
 
-			float xa[8] = { x0, x0 + 1, x0 + 1, x0, x0, x0 + 1, x0 - 1, x0 - 1 };
-			float ya[8] = { y0, y0 + 1, y0, y0 + 1, y0 - 1, y0 - 1, y0, y0 - 1 };
+		// the workers of the older views have also completed their last frame tiles by now
+		m_FrameTilesDone.store(0, std::memory_order_relaxed);
 
-			auto x = _mm256_set_ps(xa[7], xa[6], xa[5], xa[4], xa[3], xa[2], xa[1], xa[0]);
-			auto y = _mm256_set_ps(ya[7], ya[6], ya[5], ya[4], ya[3], ya[2], ya[1], ya[0]);
+		{
+			std::lock_guard<std::mutex> lock(m_ParkMutex);
+			m_FrameTicket.store(0, std::memory_order_release);
+		}
+
+		m_ParkCondition.notify_all();
+		return future;
+	}
 
-			auto uvx = _mm256_div_ps(x, width);
-			auto uvy = _mm256_div_ps(y, height);
+	void Sphereflake::AcquireView(View& view) const
+	{
+		for (;;)
+		{
+			auto epoch = m_ViewEpoch.load(std::memory_order_acquire);
+			auto& slot = m_Views[epoch & 1];
 
-			union
+			if (slot.sequence.load(std::memory_order_acquire) != epoch)
 			{
-				__m256 minT;
-				float minTArray[8];
-			};
+				continue;
+			}
 
-			minT = _mm256_broadcast_ss(&floatMax);
+			view = slot.view;
 
-#endif
+			std::atomic_thread_fence(std::memory_order_acquire);
+			if (slot.sequence.load(std::memory_order_relaxed) == epoch)
+			{
+				return;
+			}
+		}
+	}
 
-			auto directionHorizontalPart = m_TopLeft + (m_TopRight - m_TopLeft) * uvx;
-			auto directionVerticalPart = (m_BottomLeft - m_TopLeft) * uvy;
+	float Sphereflake::ComputeViewDelta(const vec3& origin, const vec3& topLeft, const vec3& topRight, const vec3& bottomLeft) const
+	{
+		// the corners lie on a plane at unit distance so this is roughly the angle covered by one pixel
+		auto pixelAngle = length(topRight - topLeft) / (float) m_Width;
 
-			auto targetDirection = directionHorizontalPart + directionVerticalPart;
-			auto rayDirection = targetDirection - m_RayOrigin;
-			Normalize(rayDirection);
+		auto rotation = length(normalize(topLeft - origin) - normalize(m_LastTopLeft - m_LastOrigin));
+		rotation = max(rotation, length(normalize(topRight - origin) - normalize(m_LastTopRight - m_LastOrigin)));
+		rotation = max(rotation, length(normalize(bottomLeft - origin) - normalize(m_LastBottomLeft - m_LastOrigin)));
 
-			position.Set(vec3(0.0f));
-			normal.Set(vec3(0.0f));
+		// parallax of the closest visible geometry
+		auto translation = length(origin - m_LastOrigin) / max(GetClosestSphereDistance(), 0.0001f);
 
-			auto transform = m_RootTransform;
-			IntersectSphereflake(rayDirection, transform, minT, position, normal, 3.0f, 0);
+		return (rotation + translation) / pixelAngle;
+	}
 
-#ifdef __ARCH_NO_AVX
+	void Sphereflake::DoImagePart(size_t workerIndex)
+	{
+		FramelessSampler sampler;
+		FrameCursor frameCursor;
+		TraversalStats stats;
+		Packet packet;
+		View view;
 
-			size_t loopCount = 4;
+		// only this worker writes its slot, so it keeps the totals and stores them instead of adding to shared counters,
+		// a slot reused after its previous worker retired carries on from that worker's totals
+		auto& workerStats = m_WorkerStats[workerIndex];
+		workerStats.AddTo(stats);
 
-#else
+		unsigned closestEpoch = workerStats.closestEpoch.load(std::memory_order_relaxed);
+		float closestDistance = workerStats.closestDistance.load(std::memory_order_relaxed);
 
-			size_t loopCount = 8;
+		// without a core of its own the GL thread competes with the workers, ramp them up gradually so it is not starved
+		float spinUp = m_WorkerAffinity.mainThread.empty() ? 1.0f : 0.0f;
 
-#endif
-			m_RaysPerSecond += loopCount;
+		long long batchStart = 0;
+		long long batchPackets = 0;
+
+		auto& writer = m_GBufferWriters[workerIndex];
+		unsigned announcedEpoch = 0;
+
+		auto endBatch = [&batchStart, &batchPackets]
+		{
+			if (batchPackets > 0)
+			{
+				Trace::Record("Trace packets", batchStart, Trace::Now(), "packets", batchPackets);
+				batchPackets = 0;
+			}
+		};
+
+		for (;;)
+		{
+			AcquireView(view);
+
+			// a claimed tile of a full frame is finished before retiring or pausing, no other worker can take it over
+			// and the frame would never complete
+			auto epoch = view.epoch;
+			bool frameTileLeft = frameCursor.epoch == epoch && frameCursor.next < frameCursor.count &&
+				m_FrameEpoch.load(std::memory_order_relaxed) == epoch;
+
+			if (IsRetired(workerIndex) && !frameTileLeft)
+			{
+				endBatch();
+				writer.viewEpoch.store(0);
+				return;
+			}
+
+			if (!frameTileLeft && (m_Paused.load(std::memory_order_relaxed) || IsConverged(epoch) || IsFrameDrained(epoch)))
+			{
+				endBatch();
+
+				writer.viewEpoch.store(0);
+				announcedEpoch = 0;
+
+				TRACE_ZONE("Park");
+				Park(workerIndex, epoch);
+				continue;
+			}
+
+			// announce the view before tracing it and check it again, a full frame published in between either sees
+			// the announcement and waits for this packet or we see its epoch and move on to it
+			if (announcedEpoch != epoch)
+			{
+				writer.viewEpoch.store(epoch);
+				announcedEpoch = epoch;
+
+				if (m_ViewEpoch.load() != epoch)
+				{
+					continue;
+				}
+			}
 
-			for (auto q = 0u; q < loopCount; q++)
+			bool coverFootprint = true;
+			bool framePacket = false;
+
+			if (m_FrameEpoch.load(std::memory_order_relaxed) == epoch)
 			{
-				auto idx = (size_t) xa[q] + (size_t) ya[q] * m_Width;
-				if (idx > m_GBuffer.positions.size())
+				// a frame's view is only traced on its grid, a worker without a tile parks until the frame is done
+				if (!GetFramePacket(view, frameCursor, packet))
 				{
 					continue;
 				}
 
-				m_GBuffer.positions[idx] = vec4(position.Extract(q), 1.0f);
-				m_GBuffer.normals[idx] = vec4(normal.Extract(q), 1.0f);
+				framePacket = true;
+			}
+			else if (GetProgressivePacket(view, packet))
+			{
+				// coarse cells are only placeholders until their pixels are traced by a later level, the full resolution
+				// level traces real samples and counts toward convergence like any other
+				coverFootprint = packet.footprint == 1;
+			}
+			else if (!GetFramelessPacket(view, sampler, packet))
+			{
+				continue;
+			}
+
+			if (Trace::IsEnabled() && batchPackets++ == 0)
+			{
+				batchStart = Trace::Now();
+			}
+
+			TracePacket(view, packet, stats);
+
+			workerStats.Store(stats);
+
+			// the closest hit is tracked per view so a static view keeps its distance after the workers park
+			if (epoch != closestEpoch || packet.closestT < closestDistance)
+			{
+				closestDistance = epoch != closestEpoch ? packet.closestT : min(closestDistance, packet.closestT);
+				closestEpoch = epoch;
+				workerStats.closestDistance.store(closestDistance, std::memory_order_relaxed);
+				workerStats.closestEpoch.store(closestEpoch, std::memory_order_relaxed);
+			}
+
+			if (m_MergeTicket.load(std::memory_order_relaxed) < m_MergeTileCount.load(std::memory_order_relaxed))
+			{
+				// a publish is waiting for its merge, help out before tracing on
+				endBatch();
+
+				TRACE_ZONE("Merge tiles");
+				MergeTiles();
+			}
+
+			size_t sampled = 0;
+
+			if (framePacket && frameCursor.staged)
+			{
+				// nothing else writes the tile's pixels, so it only goes to the back buffer once all of them are traced
+				EncodePacket(packet);
+				StagePacket(frameCursor, packet);
 
-				if (minTArray[q] < m_ClosestSphereDistance)
+				if (frameCursor.next == frameCursor.count)
 				{
-					m_ClosestSphereDistance = minTArray[q];
+					auto& target = BeginGBufferWrite(workerIndex);
+					sampled = StreamFrameTile(target, frameCursor, epoch);
+					EndGBufferWrite(workerIndex);
 				}
 			}
+			else
+			{
+				auto& target = BeginGBufferWrite(workerIndex);
+				sampled = WritePacket(target, packet, coverFootprint, epoch);
+				EndGBufferWrite(workerIndex);
+			}
+
+			if (sampled > 0)
+			{
+				AddSampledPixels(epoch, sampled);
+			}
 
-			if(spinUp > 0.0f) // gradually spin-up the threads so we don't upset the GL thread
+			if (framePacket && frameCursor.next == frameCursor.count)
+			{
+				CompleteFrameTile(epoch);
+			}
+
+			if (batchPackets == TRACE_BATCH_PACKETS)
+			{
+				endBatch();
+			}
+
+			if(spinUp > 0.0f)
 			{
 				std::this_thread::sleep_for(std::chrono::microseconds((int)spinUp * 1000));
 				spinUp -= spinUp / 1000.0f;
 			}
-			
-			if (m_Deinitialize)
+		}
+	}
+
+	TraversalStats Sphereflake::TracePackets(const PacketShape& shape, unsigned long long packetCount)
+	{
+		FramelessSampler sampler;
+		TraversalStats stats;
+		Packet packet;
+		View view;
+
+		AcquireView(view);
+		view.shape = shape;
+
+		if (!m_GBufferTouched)
+		{
+			TouchGBuffer(0, 1);
+			m_GBufferTouched = true;
+		}
+
+		while (stats.packets < packetCount)
+		{
+			if (!GetFramelessPacket(view, sampler, packet))
 			{
-				return;
+				continue;
 			}
+
+			// benchmark packets are not counted towards convergence of the interactive view and must not
+			// race with PublishGBuffer
+			TracePacket(view, packet, stats);
+			WritePacket(m_WriteBuffers[(m_GBufferGeneration >> 1) & 1], packet, false, view.epoch);
 		}
+
+		return stats;
+	}
+
+	Sphereflake::Stats Sphereflake::GetStats() const
+	{
+		Stats stats;
+		stats.closestSphereDistance = GetClosestSphereDistance();
+
+		for (size_t i = 0; m_WorkerStats && i < m_WorkerCapacity; i++)
+		{
+			m_WorkerStats[i].AddTo(stats.traversal);
+		}
+
+		if (m_PerfCountersEnabled && m_WorkerPerfCounters)
+		{
+			// a read of another thread's counters is a system call each, cheap enough for a snapshot
+			std::lock_guard<std::mutex> lock(m_PerfCountersMutex);
+
+			for (size_t i = 0; i < m_WorkerCapacity; i++)
+			{
+				auto& slot = m_WorkerPerfCounters[i];
+				stats.counters += slot.retired;
+
+				if (slot.counters != nullptr)
+				{
+					stats.counters += slot.counters->Read();
+				}
+			}
+		}
+
+		return stats;
+	}
+
+	float Sphereflake::GetClosestSphereDistance() const
+	{
+		// workers that have not reached the latest view yet, or parked before it, hold distances of older views
+		unsigned latestEpoch = 0;
+		float closest = std::numeric_limits<float>::max();
+
+		for (size_t i = 0; m_WorkerStats && i < m_WorkerCapacity; i++)
+		{
+			auto epoch = m_WorkerStats[i].closestEpoch.load(std::memory_order_relaxed);
+			auto distance = m_WorkerStats[i].closestDistance.load(std::memory_order_relaxed);
+
+			if (epoch == 0)
+			{
+				continue;
+			}
+
+			if (latestEpoch == 0 || (int) (epoch - latestEpoch) > 0)
+			{
+				latestEpoch = epoch;
+				closest = distance;
+			}
+			else if (epoch == latestEpoch)
+			{
+				closest = min(closest, distance);
+			}
+		}
+
+		return closest;
+	}
+
+	void Sphereflake::WorkerCounters::Store(const TraversalStats& stats)
+	{
+		packets.store(stats.packets, std::memory_order_relaxed);
+		rays.store(stats.rays, std::memory_order_relaxed);
+		nodesVisited.store(stats.nodesVisited, std::memory_order_relaxed);
+		activeLanes.store(stats.activeLanes, std::memory_order_relaxed);
+		laneSlots.store(stats.laneSlots, std::memory_order_relaxed);
+		sphereTests.store(stats.sphereTests, std::memory_order_relaxed);
+		hits.store(stats.hits, std::memory_order_relaxed);
+		lodTerminations.store(stats.lodTerminations, std::memory_order_relaxed);
+
+		for (auto depth = 0u; depth < STATS_DEPTH_BINS; depth++)
+		{
+			depthHistogram[depth].store(stats.depthHistogram[depth], std::memory_order_relaxed);
+		}
+	}
+
+	void Sphereflake::WorkerCounters::AddTo(TraversalStats& stats) const
+	{
+		stats.packets += packets.load(std::memory_order_relaxed);
+		stats.rays += rays.load(std::memory_order_relaxed);
+		stats.nodesVisited += nodesVisited.load(std::memory_order_relaxed);
+		stats.activeLanes += activeLanes.load(std::memory_order_relaxed);
+		stats.laneSlots += laneSlots.load(std::memory_order_relaxed);
+		stats.sphereTests += sphereTests.load(std::memory_order_relaxed);
+		stats.hits += hits.load(std::memory_order_relaxed);
+		stats.lodTerminations += lodTerminations.load(std::memory_order_relaxed);
+
+		for (auto depth = 0u; depth < STATS_DEPTH_BINS; depth++)
+		{
+			stats.depthHistogram[depth] += depthHistogram[depth].load(std::memory_order_relaxed);
+		}
+	}
+
+	static size_t GetProgressiveLevelPackets(size_t width, size_t height, const PacketShape& shape, size_t level)
+	{
+		auto cellSize = PROGRESSIVE_BASE_CELL_SIZE >> level;
+		auto cellsX = (width + cellSize - 1) / cellSize;
+		auto cellsY = (height + cellSize - 1) / cellSize;
+		auto packetsX = (cellsX + shape.width - 1) / shape.width;
+		auto packetsY = (cellsY + shape.height - 1) / shape.height;
+		return packetsX * packetsY;
+	}
+
+	bool Sphereflake::GetProgressivePacket(const View& view, Packet& packet)
+	{
+		if (!m_ProgressiveRefinement)
+		{
+			return false;
+		}
+
+		size_t totalPackets = 0;
+		for (auto level = 0u; level < PROGRESSIVE_LEVELS; level++)
+		{
+			totalPackets += GetProgressiveLevelPackets(m_Width, m_Height, view.shape, level);
+		}
+
+		if (m_ProgressiveTicket.load(std::memory_order_relaxed) >= totalPackets)
+		{
+			return false;
+		}
+
+		// tickets run through all levels in order so a restart from SetView is a single store
+		auto ticket = m_ProgressiveTicket.fetch_add(1, std::memory_order_relaxed);
+
+		for (auto level = 0u; level < PROGRESSIVE_LEVELS; level++)
+		{
+			auto levelPackets = GetProgressiveLevelPackets(m_Width, m_Height, view.shape, level);
+			if (ticket >= levelPackets)
+			{
+				ticket -= levelPackets;
+				continue;
+			}
+
+			auto cellSize = PROGRESSIVE_BASE_CELL_SIZE >> level;
+			auto cellsX = (m_Width + cellSize - 1) / cellSize;
+			auto packetsX = (cellsX + view.shape.width - 1) / view.shape.width;
+
+			auto cellX = (ticket % packetsX) * view.shape.width;
+			auto cellY = (ticket / packetsX) * view.shape.height;
+
+			packet.width = view.shape.width;
+			packet.pixels = view.shape.GetPixelCount();
+			packet.footprint = cellSize;
+
+			for (auto q = 0u; q < packet.pixels; q++)
+			{
+				packet.x[q] = (float) ((cellX + q % view.shape.width) * cellSize);
+				packet.y[q] = (float) ((cellY + q / view.shape.width) * cellSize);
+			}
+
+			return true;
+		}
+
+		return false;
+	}
+
+	bool Sphereflake::GetFramePacket(const View& view, FrameCursor& cursor, Packet& packet)
+	{
+		auto shapeWidth = view.shape.width;
+		auto shapeHeight = view.shape.height;
+
+		while (cursor.epoch != view.epoch || cursor.next == cursor.count)
+		{
+			cursor.epoch = view.epoch;
+			cursor.next = 0;
+			cursor.count = 0;
+
+			auto ticket = m_FrameTicket.fetch_add(1, std::memory_order_acquire);
+			if (ticket >= m_TilesX * m_TilesY)
+			{
+				return false;
+			}
+
+			// a tile owns the packets of the image-wide grid that start inside it, packets reaching into the next
+			// tile are traced whole so every pixel is traced once and always in the same packet
+			auto tileX = (ticket % m_TilesX) * GBUFFER_TILE_SIZE;
+			auto tileY = (ticket / m_TilesX) * GBUFFER_TILE_SIZE;
+			auto tileEndX = std::min(tileX + GBUFFER_TILE_SIZE, m_Width);
+			auto tileEndY = std::min(tileY + GBUFFER_TILE_SIZE, m_Height);
+
+			cursor.tile = ticket;
+			cursor.x = (tileX + shapeWidth - 1) / shapeWidth * shapeWidth;
+			cursor.y = (tileY + shapeHeight - 1) / shapeHeight * shapeHeight;
+
+			auto packetsX = cursor.x < tileEndX ? (tileEndX - cursor.x + shapeWidth - 1) / shapeWidth : 0;
+			auto packetsY = cursor.y < tileEndY ? (tileEndY - cursor.y + shapeHeight - 1) / shapeHeight : 0;
+
+			cursor.packetsX = packetsX;
+			cursor.count = packetsX * packetsY;
+
+			cursor.staged = GBUFFER_TILE_SIZE % shapeWidth == 0 && GBUFFER_TILE_SIZE % shapeHeight == 0 &&
+				tileEndX - tileX == GBUFFER_TILE_SIZE && tileEndY - tileY == GBUFFER_TILE_SIZE;
+			if (cursor.staged)
+			{
+				cursor.texels.resize(GBUFFER_TILE_SIZE * GBUFFER_TILE_SIZE);
+			}
+
+			// narrow edge tiles may have all their pixels in packets of the tiles before them
+			if (cursor.count == 0)
+			{
+				CompleteFrameTile(view.epoch);
+			}
+		}
+
+		auto x0 = cursor.x + (cursor.next % cursor.packetsX) * shapeWidth;
+		auto y0 = cursor.y + (cursor.next / cursor.packetsX) * shapeHeight;
+		cursor.next++;
+
+		packet.width = shapeWidth;
+		packet.pixels = view.shape.GetPixelCount();
+		packet.footprint = 1;
+
+		for (auto q = 0u; q < packet.pixels; q++)
+		{
+			packet.x[q] = (float) (x0 + q % shapeWidth);
+			packet.y[q] = (float) (y0 + q / shapeWidth);
+		}
+
+		return true;
+	}
+
+	void Sphereflake::CompleteFrameTile(unsigned epoch)
+	{
+		if (m_FrameTilesDone.fetch_add(1, std::memory_order_acq_rel) + 1 != m_TilesX * m_TilesY)
+		{
+			return;
+		}
+
+		// the frame may have been abandoned by a view change meanwhile
+		std::lock_guard<std::mutex> lock(m_FrameMutex);
+		if (m_FramePending && m_FrameEpoch.load(std::memory_order_relaxed) == epoch)
+		{
+			m_FramePromise.set_value();
+			m_FramePending = false;
+		}
+	}
+
+	bool Sphereflake::GetFramelessPacket(const View& view, FramelessSampler& sampler, Packet& packet)
+	{
+		auto x0 = floorf(Sobol::Sample(sampler.sobolCounter, 0, sampler.rnd(sampler.mt)) * m_Width);
+		auto y0 = floorf(Sobol::Sample(sampler.sobolCounter, 1, sampler.rnd(sampler.mt)) * m_Height);
+		sampler.sobolCounter++;
+
+		packet.footprint = 1;
+
+		if (view.foveation.enabled)
+		{
+			auto density = GetSampleDensity(view.foveation, x0, y0);
+			if (density < 1.0f)
+			{
+				// peripheral packets are kept with probability density and traced on a grid coarse enough
+				// that their pixels are still refreshed about as often as the ones in the fovea
+				if (sampler.rnd(sampler.mt) * (1.0f / 4294967296.0f) >= density)
+				{
+					return false;
+				}
+
+				packet.footprint = (size_t) floorf(1.0f / sqrtf(density) + 0.5f);
+			}
+		}
+
+		// packets are aligned to a grid of their own size so every pixel belongs to exactly one of them
+		auto stepX = (float) (view.shape.width * packet.footprint);
+		auto stepY = (float) (view.shape.height * packet.footprint);
+		x0 = floorf(x0 / stepX) * stepX;
+		y0 = floorf(y0 / stepY) * stepY;
+
+		packet.width = view.shape.width;
+		packet.pixels = view.shape.GetPixelCount();
+
+		for (auto q = 0u; q < packet.pixels; q++)
+		{
+			packet.x[q] = x0 + (float) ((q % view.shape.width) * packet.footprint);
+			packet.y[q] = y0 + (float) ((q / view.shape.width) * packet.footprint);
+		}
+
+		return true;
+	}
+
+	float Sphereflake::GetSampleDensity(const Foveation& foveation, float x, float y) const
+	{
+		auto aspect = (float) m_Width / (float) m_Height;
+		auto offset = vec2((x / (float) m_Width - foveation.gaze.x) * aspect, y / (float) m_Height - foveation.gaze.y);
+
+		auto falloff = (length(offset) - foveation.foveaRadius) / max(foveation.peripheryRadius - foveation.foveaRadius, 0.0001f);
+		falloff = clamp(falloff, 0.0f, 1.0f);
+
+		return mix(1.0f, foveation.peripheryDensity, falloff * falloff * (3.0f - 2.0f * falloff));
+	}
+
+	void Sphereflake::TracePacket(const View& view, Packet& packet, TraversalStats& stats)
+	{
+		// unused lanes of the last register trace the first pixel again and are masked out
+		auto registers = (packet.pixels + SIMD::PacketSize - 1) / SIMD::PacketSize;
+		for (auto q = packet.pixels; q < registers * SIMD::PacketSize; q++)
+		{
+			packet.x[q] = packet.x[0];
+			packet.y[q] = packet.y[0];
+		}
+
+#ifdef SPHEREFLAKE_HEATMAP
+
+		for (auto& hits : stats.laneBoundingHits)
+		{
+			hits = 0;
+		}
+
+		auto before = stats;
+
+#endif
+
+		switch (registers)
+		{
+		case 1:
+			TraceRegisters<1>(view, packet, stats);
+			break;
+		case 2:
+			TraceRegisters<2>(view, packet, stats);
+			break;
+		default:
+			TraceRegisters<MAX_PACKET_REGISTERS>(view, packet, stats);
+			break;
+		}
+
+		packet.closestT = std::numeric_limits<float>::max();
+		for (auto q = 0u; q < packet.pixels; q++)
+		{
+			if (packet.minT[q] < std::numeric_limits<float>::max())
+			{
+				stats.hits++;
+				packet.closestT = min(packet.closestT, packet.minT[q]);
+			}
+		}
+
+		stats.packets++;
+		stats.rays += packet.pixels;
+
+#ifdef SPHEREFLAKE_HEATMAP
+		RecordHeatmap(packet, before, stats);
+#endif
+	}
+
+#ifdef SPHEREFLAKE_HEATMAP
+
+	void Sphereflake::RecordHeatmap(const Packet& packet, const TraversalStats& before, const TraversalStats& after)
+	{
+		auto traced = after - before;
+
+		HeatmapTexel texel;
+		texel.nodesVisited = (float) traced.nodesVisited;
+		texel.boundingTests = (float) traced.laneSlots;
+		texel.activeLanes = (float) traced.activeLanes / (float) std::max(traced.nodesVisited, 1ULL);
+
+		for (auto q = 0u; q < packet.pixels; q++)
+		{
+			auto x = (size_t) packet.x[q];
+			auto y = (size_t) packet.y[q];
+			texel.boundingHits = (float) after.laneBoundingHits[q];
+
+			for (auto j = y; j < std::min(y + packet.footprint, m_Height); j++)
+			{
+				for (auto i = x; i < std::min(x + packet.footprint, m_Width); i++)
+				{
+					m_Heatmap[i + j * m_Width] = texel;
+				}
+			}
+		}
+	}
+
+	bool Sphereflake::WriteHeatmap(const std::string& filename, size_t channel) const
+	{
+		std::ofstream file(filename, std::ios::binary);
+		if (!file)
+		{
+			return false;
+		}
+
+		// a negative scale marks little-endian data, rows are stored bottom to top
+		file << "Pf\n" << m_Width << " " << m_Height << "\n-1.0\n";
+
+		std::vector<float> row(m_Width);
+		for (auto y = m_Height; y-- > 0;)
+		{
+			for (auto x = 0u; x < m_Width; x++)
+			{
+				row[x] = ((const float*) &m_Heatmap[x + y * m_Width])[channel];
+			}
+
+			file.write((const char*) row.data(), row.size() * sizeof(float));
+		}
+
+		return file.good();
+	}
+
+#endif
+
+	template <size_t Registers>
+	void Sphereflake::TraceRegisters(const View& view, Packet& packet, TraversalStats& stats)
+	{
+		SIMD::Vec3Packet rayOrigin;
+		SIMD::Vec3Packet topLeft;
+		SIMD::Vec3Packet topRight;
+		SIMD::Vec3Packet bottomLeft;
+
+		rayOrigin.Set(view.origin);
+		topLeft.Set(view.topLeft);
+		topRight.Set(view.topRight);
+		bottomLeft.Set(view.bottomLeft);
+
+		float floatMax = std::numeric_limits<float>::max();
+		float pixels = (float) packet.pixels;
+
+		SIMD::Vec3Packet rayDirection[Registers];
+		SIMD::VecType laneMask[Registers];
+		SIMD::VecType minT[Registers];
+
+		for (auto r = 0u; r < Registers; r++)
+		{
+			float laneOffset = (float) (r * SIMD::PacketSize);
+
+#ifdef __ARCH_NO_AVX
+
+			auto width = _mm_set1_ps((float) m_Width);
+			auto height = _mm_set1_ps((float) m_Height);
+
+			auto uvx = _mm_div_ps(_mm_loadu_ps(packet.x + r * SIMD::PacketSize), width);
+			auto uvy = _mm_div_ps(_mm_loadu_ps(packet.y + r * SIMD::PacketSize), height);
+
+			laneMask[r] = _mm_cmplt_ps(_mm_add_ps(SIMD::Constants::laneIndices, _mm_set1_ps(laneOffset)), _mm_set1_ps(pixels));
+			minT[r] = _mm_set1_ps(floatMax);
+
+#else
+
+			auto width = _mm256_set1_ps((float) m_Width);
+			auto height = _mm256_set1_ps((float) m_Height);
+
+			auto uvx = _mm256_div_ps(_mm256_loadu_ps(packet.x + r * SIMD::PacketSize), width);
+			auto uvy = _mm256_div_ps(_mm256_loadu_ps(packet.y + r * SIMD::PacketSize), height);
+
+			laneMask[r] = _mm256_cmp_ps(_mm256_add_ps(SIMD::Constants::laneIndices, _mm256_broadcast_ss(&laneOffset)), _mm256_broadcast_ss(&pixels), _CMP_LT_OQ);
+			minT[r] = _mm256_broadcast_ss(&floatMax);
+
+#endif
+
+			auto directionHorizontalPart = topLeft + (topRight - topLeft) * uvx;
+			auto directionVerticalPart = (bottomLeft - topLeft) * uvy;
+
+			auto targetDirection = directionHorizontalPart + directionVerticalPart;
+			rayDirection[r] = targetDirection - rayOrigin;
+			Normalize(rayDirection[r]);
+
+			packet.position[r].Set(vec3(0.0f));
+			packet.normal[r].Set(vec3(0.0f));
+		}
+
+		auto transform = view.rootTransform;
+		IntersectSphereflake<Registers>(rayDirection, laneMask, transform, minT, packet.position, packet.normal, stats, 3.0f, 0);
+
+		for (auto r = 0u; r < Registers; r++)
+		{
+
+#ifdef __ARCH_NO_AVX
+
+			_mm_storeu_ps(packet.minT + r * SIMD::PacketSize, minT[r]);
+
+#else
+
+			_mm256_storeu_ps(packet.minT + r * SIMD::PacketSize, minT[r]);
+
+#endif
+
+		}
+	}
+
+	void Sphereflake::EncodePacket(Packet& packet)
+	{
+		float floatMax = std::numeric_limits<float>::max();
+
+		// transpose the packet into texels, lanes past the last pixel are written but never read
+		auto registers = (packet.pixels + SIMD::PacketSize - 1) / SIMD::PacketSize;
+		for (auto r = 0u; r < registers; r++)
+		{
+
+#ifdef __ARCH_NO_AVX
+
+			auto minT = _mm_loadu_ps(packet.minT + r * SIMD::PacketSize);
+			auto depth = _mm_and_ps(minT, _mm_cmplt_ps(minT, _mm_set1_ps(floatMax)));
+
+#else
+
+			auto minT = _mm256_loadu_ps(packet.minT + r * SIMD::PacketSize);
+			auto depth = _mm256_and_ps(minT, _mm256_cmp_ps(minT, _mm256_broadcast_ss(&floatMax), _CMP_LT_OQ));
+
+#endif
+
+			SIMD::StoreInterleaved(depth, SIMD::EncodeOctahedral(packet.normal[r]), (float*) (packet.texels + r * SIMD::PacketSize));
+		}
+	}
+
+	size_t Sphereflake::WritePacket(WriteBuffer& target, Packet& packet, bool coverFootprint, unsigned epoch)
+	{
+		EncodePacket(packet);
+
+		size_t sampled = 0;
+
+		for (auto q = 0u; q < packet.pixels; q++)
+		{
+			auto x = (size_t) packet.x[q];
+			auto y = (size_t) packet.y[q];
+			if (x >= m_Width || y >= m_Height)
+			{
+				continue;
+			}
+
+			// coarse samples are splatted over the whole cell they stand for
+			auto xEnd = std::min(x + packet.footprint, m_Width);
+			auto yEnd = std::min(y + packet.footprint, m_Height);
+
+			for (auto j = y; j < yEnd; j++)
+			{
+				for (auto i = x; i < xEnd; i++)
+				{
+					target.tiles[GetTiledOffset(i, j)] = packet.texels[q];
+				}
+			}
+
+			for (auto tileY = y / GBUFFER_TILE_SIZE; tileY <= (yEnd - 1) / GBUFFER_TILE_SIZE; tileY++)
+			{
+				for (auto tileX = x / GBUFFER_TILE_SIZE; tileX <= (xEnd - 1) / GBUFFER_TILE_SIZE; tileX++)
+				{
+					// avoid dirtying the cache line when the flag is already set
+					auto& dirty = target.dirtyTiles[tileX + tileY * m_TilesX];
+					if (!dirty.load(std::memory_order_relaxed))
+					{
+						dirty.store(true, std::memory_order_relaxed);
+					}
+				}
+			}
+
+			if (coverFootprint)
+			{
+				sampled += MarkSampled(x, y, xEnd, yEnd, epoch);
+			}
+		}
+
+		return sampled;
+	}
+
+	void Sphereflake::StagePacket(FrameCursor& cursor, const Packet& packet)
+	{
+		for (auto q = 0u; q < packet.pixels; q++)
+		{
+			auto x = (size_t) packet.x[q] % GBUFFER_TILE_SIZE;
+			auto y = (size_t) packet.y[q] % GBUFFER_TILE_SIZE;
+			cursor.texels[MortonEncode(x, y)] = packet.texels[q];
+		}
+	}
+
+	size_t Sphereflake::StreamFrameTile(WriteBuffer& target, const FrameCursor& cursor, unsigned epoch)
+	{
+		// the tile is 8 KB of whole cache lines that are not read again before the publish merges them, streaming
+		// them keeps them from evicting the BVH and the lines of the other workers' tiles
+		auto source = (const float*) cursor.texels.data();
+		auto line = (float*) (target.tiles + cursor.tile * GBUFFER_TILE_SIZE * GBUFFER_TILE_SIZE);
+		auto floats = GBUFFER_TILE_SIZE * GBUFFER_TILE_SIZE * sizeof(GBufferTexel) / sizeof(float);
+
+		for (auto i = 0u; i < floats; i += 16)
+		{
+
+#ifdef __ARCH_NO_AVX
+
+			_mm_stream_ps(line + i, _mm_loadu_ps(source + i));
+			_mm_stream_ps(line + i + 4, _mm_loadu_ps(source + i + 4));
+			_mm_stream_ps(line + i + 8, _mm_loadu_ps(source + i + 8));
+			_mm_stream_ps(line + i + 12, _mm_loadu_ps(source + i + 12));
+
+#else
+
+			_mm256_stream_ps(line + i, _mm256_loadu_ps(source + i));
+			_mm256_stream_ps(line + i + 8, _mm256_loadu_ps(source + i + 8));
+
+#endif
+
+		}
+
+		target.dirtyTiles[cursor.tile].store(true, std::memory_order_relaxed);
+
+		auto x = (cursor.tile % m_TilesX) * GBUFFER_TILE_SIZE;
+		auto y = (cursor.tile / m_TilesX) * GBUFFER_TILE_SIZE;
+		return MarkSampled(x, y, x + GBUFFER_TILE_SIZE, y + GBUFFER_TILE_SIZE, epoch);
+	}
+
+	size_t Sphereflake::MarkSampled(size_t x, size_t y, size_t xEnd, size_t yEnd, unsigned epoch)
+	{
+		size_t sampled = 0;
+
+		for (auto j = y; j < yEnd; j++)
+		{
+			for (auto i = x; i < xEnd; i++)
+			{
+				auto& pixelEpoch = m_PixelEpochs[i + j * m_Width];
+				auto previous = pixelEpoch.load(std::memory_order_relaxed);
+
+				// never move a pixel back to an older epoch
+				if ((int) (epoch - previous) > 0 && pixelEpoch.compare_exchange_strong(previous, epoch, std::memory_order_relaxed))
+				{
+					sampled++;
+				}
+			}
+		}
+
+		return sampled;
+	}
+
+	Sphereflake::WriteBuffer& Sphereflake::BeginGBufferWrite(size_t workerIndex)
+	{
+		auto& writer = m_GBufferWriters[workerIndex];
+		auto generation = m_GBufferGeneration.load();
+
+		// announce the generation before writing and check it again, a publish in between either sees the
+		// announcement and waits for us or we see its new generation and move on to the other buffer
+		for (;;)
+		{
+			writer.generation.store(generation);
+
+			auto current = m_GBufferGeneration.load();
+			if (current == generation)
+			{
+				break;
+			}
+
+			generation = current;
+		}
+
+		return m_WriteBuffers[(generation >> 1) & 1];
+	}
+
+	void Sphereflake::EndGBufferWrite(size_t workerIndex)
+	{
+		// streaming stores are weakly ordered and have to be drained before the publish can see us leave
+		_mm_sfence();
+		m_GBufferWriters[workerIndex].generation.store(GBUFFER_WRITER_IDLE, std::memory_order_release);
+	}
+
+	const GBuffer& Sphereflake::PublishGBuffer(GBufferTexel* staging)
+	{
+		TRACE_ZONE("Publish G-buffer");
+
+		m_MergeStaging = staging;
+
+		auto generation = m_GBufferGeneration.load();
+		auto& source = m_WriteBuffers[(generation >> 1) & 1];
+
+		m_GBufferGeneration.store(generation + 2);
+
+		// workers only announce a generation for the duration of a single packet write
+		{
+			TRACE_ZONE("Wait for writers");
+
+			for (size_t i = 0; i < m_WorkerCapacity; i++)
+			{
+				while (m_GBufferWriters[i].generation.load() == generation)
+				{
+					std::this_thread::yield();
+				}
+			}
+		}
+
+		MergeWriteBuffer(source);
+		return m_GBuffer;
+	}
+
+	void Sphereflake::MergeWriteBuffer(WriteBuffer& source)
+	{
+		m_UpdatedTiles.clear();
+
+		size_t tileCount = 0;
+		for (auto tile = 0u; tile < m_TilesX * m_TilesY; tile++)
+		{
+			auto& dirty = source.dirtyTiles[tile];
+			if (dirty.load(std::memory_order_relaxed))
+			{
+				dirty.store(false, std::memory_order_relaxed);
+				m_MergeTiles[tileCount++] = tile;
+			}
+		}
+
+		if (tileCount == 0)
+		{
+			return;
+		}
+
+		m_MergeSource = &source;
+		m_MergedTiles.store(0, std::memory_order_relaxed);
+		m_MergeTileCount.store(tileCount, std::memory_order_relaxed);
+
+		// opens the job to the workers, they pick it up between packets
+		m_MergeTicket.store(0, std::memory_order_release);
+
+		{
+			TRACE_ZONE("Merge tiles");
+			MergeTiles();
+		}
+
+		{
+			TRACE_ZONE("Wait for merge");
+
+			while (m_MergedTiles.load(std::memory_order_acquire) < tileCount)
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		{
+			TRACE_ZONE("Wait for merge helpers");
+
+			// sequentially consistent with the helpers registering, a helper that is not counted yet will only
+			// draw a closed ticket
+			m_MergeTicket.store(GBUFFER_NO_MERGE);
+			while (m_MergeHelpers.load() != 0)
+			{
+				std::this_thread::yield();
+			}
+		}
+
+		m_UpdatedTiles.assign(m_MergeTiles.begin(), m_MergeTiles.begin() + tileCount);
+	}
+
+	void Sphereflake::MergeTiles()
+	{
+		// registered before the first ticket is drawn, the ticket and the tile count are read separately and must
+		// belong to the same publish
+		m_MergeHelpers.fetch_add(1);
+
+		for (;;)
+		{
+			auto ticket = m_MergeTicket.fetch_add(1);
+			if (ticket >= m_MergeTileCount.load(std::memory_order_relaxed))
+			{
+				break;
+			}
+
+			DetileTile(*m_MergeSource, m_MergeTiles[ticket]);
+
+			// staging stores are streamed and have to be drained before the tile is reported as done
+			_mm_sfence();
+			m_MergedTiles.fetch_add(1, std::memory_order_release);
+		}
+
+		m_MergeHelpers.fetch_sub(1, std::memory_order_release);
+	}
+
+	void Sphereflake::DetileTile(WriteBuffer& source, size_t tile)
+	{
+		auto tileX = (tile % m_TilesX) * GBUFFER_TILE_SIZE;
+		auto tileY = (tile / m_TilesX) * GBUFFER_TILE_SIZE;
+		auto texels = source.tiles + tile * GBUFFER_TILE_SIZE * GBUFFER_TILE_SIZE;
+
+		GBufferTexel emptyTexel;
+		emptyTexel.depth = 0.0f;
+		emptyTexel.normal = GBUFFER_EMPTY_NORMAL;
+
+		if (tileX + GBUFFER_TILE_SIZE > m_Width || tileY + GBUFFER_TILE_SIZE > m_Height)
+		{
+			// tiles on the right and bottom edge are clipped, not worth vectorizing
+			auto xEnd = std::min(tileX + GBUFFER_TILE_SIZE, m_Width);
+			auto yEnd = std::min(tileY + GBUFFER_TILE_SIZE, m_Height);
+
+			for (auto y = tileY; y < yEnd; y++)
+			{
+				for (auto x = tileX; x < xEnd; x++)
+				{
+					// pixels that were not traced since the last publish keep their previous value
+					auto& texel = texels[MortonEncode(x - tileX, y - tileY)];
+					if (texel.normal == GBUFFER_EMPTY_NORMAL)
+					{
+						continue;
+					}
+
+					m_GBuffer.texels[x + y * m_Width] = texel;
+					texel = emptyTexel;
+				}
+
+				if (m_MergeStaging != nullptr)
+				{
+					std::copy(&m_GBuffer.texels[tileX + y * m_Width], &m_GBuffer.texels[xEnd + y * m_Width], m_MergeStaging + tileX + y * m_Width);
+				}
+			}
+
+			return;
+		}
+
+		auto empty = _mm_set_epi32(GBUFFER_EMPTY_NORMAL, 0, GBUFFER_EMPTY_NORMAL, 0);
+
+		// every 2x2 quad is stored as two texel pairs that are also adjacent in the linear layout
+		for (auto quad = 0u; quad < GBUFFER_TILE_SIZE * GBUFFER_TILE_SIZE / 4; quad++)
+		{
+			auto quadX = tileX + MortonDecode(quad) * 2;
+			auto quadY = tileY + MortonDecode(quad >> 1) * 2;
+
+			for (auto row = 0u; row < 2; row++)
+			{
+				auto src = (__m128i*) (texels + quad * 4 + row * 2);
+				auto dst = (__m128i*) (m_GBuffer.texels + quadX + (quadY + row) * m_Width);
+
+				auto texelPair = _mm_loadu_si128(src);
+				auto isEmpty = _mm_cmpeq_epi32(texelPair, empty);
+
+				// spread the comparison of the normals over the whole texel
+				isEmpty = _mm_shuffle_epi32(isEmpty, _MM_SHUFFLE(3, 3, 1, 1));
+
+				auto merged = _mm_or_si128(_mm_and_si128(isEmpty, _mm_loadu_si128(dst)), _mm_andnot_si128(isEmpty, texelPair));
+				_mm_storeu_si128(dst, merged);
+				_mm_storeu_si128(src, empty);
+
+				if (m_MergeStaging != nullptr)
+				{
+					// staging memory is typically write-combined, never read it back
+					auto staging = (__m128i*) (m_MergeStaging + quadX + (quadY + row) * m_Width);
+					if (((size_t) staging & 15) == 0)
+					{
+						_mm_stream_si128(staging, merged);
+					}
+					else
+					{
+						_mm_storeu_si128(staging, merged);
+					}
+				}
+			}
+		}
+	}
+
+	void Sphereflake::AddSampledPixels(unsigned epoch, size_t count)
+	{
+		auto current = m_SampledPixels.load(std::memory_order_relaxed);
+
+		// counts from a packet that started before the last view change are dropped
+		while ((unsigned) (current >> 32) == epoch)
+		{
+			if (m_SampledPixels.compare_exchange_weak(current, current + count, std::memory_order_relaxed))
+			{
+				return;
+			}
+		}
+	}
+
+	bool Sphereflake::IsConverged(unsigned epoch) const
+	{
+		auto sampled = m_SampledPixels.load(std::memory_order_relaxed);
+		return (unsigned) (sampled >> 32) == epoch && (sampled & 0xffffffffULL) >= m_Width * m_Height;
+	}
+
+	void Sphereflake::Park(size_t workerIndex, unsigned epoch)
+	{
+		std::unique_lock<std::mutex> lock(m_ParkMutex);
+
+		// view changes, opening the tiles of a frame, resuming and retiring all happen under the mutex, a view change
+		// resets the sample count so the view the worker parked on no longer counts as converged
+		m_ParkedWorkers++;
+		m_ParkCondition.wait(lock, [this, workerIndex, epoch] { return IsRetired(workerIndex) || (!m_Paused && !IsConverged(epoch) && !IsFrameDrained(epoch)); });
+		m_ParkedWorkers--;
 	}
 
 	void Sphereflake::ComputeChildTransformations()
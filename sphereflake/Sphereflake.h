@@ -1,95 +1,774 @@
 #ifndef __RAYTRACE_SPHEREFLAKE_H
 #define __RAYTRACE_SPHEREFLAKE_H
 
+#define MAX_PACKET_PIXELS 16
+#define MAX_PACKET_REGISTERS (MAX_PACKET_PIXELS / SIMD::PacketSize)
+
+#define GBUFFER_TILE_SIZE 32
+
+// depths counted by the traversal histogram, deeper nodes are counted in the last bin
+#define STATS_DEPTH_BINS 16
+
 namespace SphereflakeRaytracer
 {
 
+	// 8 bytes per pixel, depth is the distance along the normalized primary ray (0 for a miss) and the normal
+	// is octahedral-encoded as two 16-bit snorm values, positions are reconstructed from the camera corners
+	struct GBufferTexel
+	{
+		float depth;
+		unsigned normal;
+
+		// unit normal as decoded by decodeNormal in the shaders, only meaningful for a hit
+		vec3 DecodeNormal() const
+		{
+			auto x = std::max((float) (short) (normal & 0xffff) / 32767.0f, -1.0f);
+			auto y = std::max((float) (short) (normal >> 16) / 32767.0f, -1.0f);
+			vec3 n(x, y, 1.0f - fabsf(x) - fabsf(y));
+
+			if (n.z < 0.0f)
+			{
+				n.x = (1.0f - fabsf(y)) * (x >= 0.0f ? 1.0f : -1.0f);
+				n.y = (1.0f - fabsf(x)) * (y >= 0.0f ? 1.0f : -1.0f);
+			}
+
+			return normalize(n);
+		}
+	};
+
+	// width * height texels in row-major order, owned by the Sphereflake
 	struct GBuffer
 	{
-		std::vector<vec4> positions;
-		std::vector<vec4> normals;
+		GBufferTexel* texels;
+	};
+
+	// density is 1 inside the fovea and falls to peripheryDensity at the periphery radius
+	// gaze is in normalized screen coordinates from the top-left corner, radii are fractions of the screen height
+	struct Foveation
+	{
+		Foveation() :
+			enabled(false),
+			gaze(0.5f, 0.5f),
+			foveaRadius(0.25f),
+			peripheryRadius(0.5f),
+			peripheryDensity(0.25f)
+		{}
+
+		bool enabled;
+		vec2 gaze;
+		float foveaRadius;
+		float peripheryRadius;
+		float peripheryDensity;
+	};
+
+	// pixel footprint of a packet, packets of more pixels than SIMD lanes are traced as several registers
+	// that share one traversal
+	struct PacketShape
+	{
+		PacketShape() :
+#ifdef __ARCH_NO_AVX
+			width(2),
+#else
+			width(4),
+#endif
+			height(2)
+		{}
+
+		PacketShape(size_t w, size_t h) : width(w), height(h) {}
+
+		size_t GetPixelCount() const
+		{
+			return width * height;
+		}
+
+		size_t GetRegisterCount() const
+		{
+			return (GetPixelCount() + SIMD::PacketSize - 1) / SIMD::PacketSize;
+		}
+
+		std::string ToString() const
+		{
+			return std::to_string(width) + "x" + std::to_string(height);
+		}
+
+		// parses "WxH", e.g. "4x4"
+		static bool Parse(const std::string& s, PacketShape& shape)
+		{
+			auto separator = s.find('x');
+			if (separator == std::string::npos)
+			{
+				return false;
+			}
+
+			auto w = (size_t) atoi(s.substr(0, separator).c_str());
+			auto h = (size_t) atoi(s.substr(separator + 1).c_str());
+			if (w == 0 || h == 0 || w * h > MAX_PACKET_PIXELS)
+			{
+				return false;
+			}
+
+			shape = PacketShape(w, h);
+			return true;
+		}
+
+		size_t width;
+		size_t height;
+	};
+
+	struct TraversalStats
+	{
+		TraversalStats() : packets(0), rays(0), nodesVisited(0), activeLanes(0), laneSlots(0), sphereTests(0), hits(0), lodTerminations(0)
+		{
+			for (auto& nodes : depthHistogram)
+			{
+				nodes = 0;
+			}
+
+#ifdef SPHEREFLAKE_HEATMAP
+
+			for (auto& hits : laneBoundingHits)
+			{
+				hits = 0;
+			}
+
+#endif
+		}
+
+		unsigned long long packets;
+		unsigned long long rays;
+		unsigned long long nodesVisited;
+
+		// lanes that hit a node's bounding sphere out of all lanes tested against it
+		unsigned long long activeLanes;
+		unsigned long long laneSlots;
+
+		// lanes tested against bounding and surface spheres
+		unsigned long long sphereTests;
+
+		// rays that hit the fractal
+		unsigned long long hits;
+
+		// lanes that hit a bounding sphere whose children were not visited because they are too far away to matter
+		unsigned long long lodTerminations;
+
+		// nodes visited at every depth, the root is at depth 0
+		unsigned long long depthHistogram[STATS_DEPTH_BINS];
+
+#ifdef SPHEREFLAKE_HEATMAP
+
+		// bounding spheres hit by every lane of the packet being traced, reset for every packet and not accumulated
+		unsigned laneBoundingHits[MAX_PACKET_PIXELS];
+
+#endif
+
+		// deepest level with visited nodes
+		int GetMaxDepth() const
+		{
+			for (auto depth = STATS_DEPTH_BINS - 1; depth > 0; depth--)
+			{
+				if (depthHistogram[depth] != 0)
+				{
+					return depth;
+				}
+			}
+
+			return 0;
+		}
+
+		TraversalStats& operator+=(const TraversalStats& other)
+		{
+			packets += other.packets;
+			rays += other.rays;
+			nodesVisited += other.nodesVisited;
+			activeLanes += other.activeLanes;
+			laneSlots += other.laneSlots;
+			sphereTests += other.sphereTests;
+			hits += other.hits;
+			lodTerminations += other.lodTerminations;
+
+			for (auto depth = 0u; depth < STATS_DEPTH_BINS; depth++)
+			{
+				depthHistogram[depth] += other.depthHistogram[depth];
+			}
+
+			return *this;
+		}
+
+		// counters accumulated since an earlier copy of the same stats
+		TraversalStats operator-(const TraversalStats& earlier) const
+		{
+			TraversalStats result;
+			result.packets = packets - earlier.packets;
+			result.rays = rays - earlier.rays;
+			result.nodesVisited = nodesVisited - earlier.nodesVisited;
+			result.activeLanes = activeLanes - earlier.activeLanes;
+			result.laneSlots = laneSlots - earlier.laneSlots;
+			result.sphereTests = sphereTests - earlier.sphereTests;
+			result.hits = hits - earlier.hits;
+			result.lodTerminations = lodTerminations - earlier.lodTerminations;
+
+			for (auto depth = 0u; depth < STATS_DEPTH_BINS; depth++)
+			{
+				result.depthHistogram[depth] = depthHistogram[depth] - earlier.depthHistogram[depth];
+			}
+
+			return result;
+		}
+	};
+
+#ifdef SPHEREFLAKE_HEATMAP
+
+	// traversal cost of the packet that last traced a pixel, the first three channels are shared by all pixels of the
+	// packet, only recorded in builds with SPHEREFLAKE_HEATMAP defined
+	struct HeatmapTexel
+	{
+		float nodesVisited;
+		// lanes tested against bounding spheres
+		float boundingTests;
+		// lanes hitting the bounding sphere of an average node
+		float activeLanes;
+		// bounding spheres hit by the pixel's own ray
+		float boundingHits;
+	};
+
+#define HEATMAP_CHANNELS 4
+
+#endif
+
+	// consistent camera state for a single packet, epoch identifies the SetView call it came from
+	struct View
+	{
+		vec3 origin;
+		vec3 topLeft;
+		vec3 topRight;
+		vec3 bottomLeft;
+		SIMD::Matrix4 rootTransform;
+		Foveation foveation;
+		PacketShape shape;
+		unsigned epoch;
 	};
 
 	class Sphereflake
 	{
 
 		public:
+		// totals of all workers since Initialize, packets traced by TracePackets are not included
+		struct Stats
+		{
+			Stats() : closestSphereDistance(std::numeric_limits<float>::max()) {}
+
+			TraversalStats traversal;
+
+			// hardware counters of the workers, only with SetPerfCounters(true)
+			PerfCounterValues counters;
+
+			// closest hit of the latest view the workers traced
+			float closestSphereDistance;
+		};
+
 		Sphereflake(size_t width, size_t height);
 
 		~Sphereflake();
 
 		void Initialize();
 
+		// to be called before Initialize, which decides the number of workers and pins them
+		void SetThreadPlacement(const ThreadPlacement& placement)
+		{
+			m_ThreadPlacement = placement;
+		}
+
+		// to be called before Initialize, every worker then opens hardware counters for itself and GetStats reports them
+		void SetPerfCounters(bool enabled)
+		{
+			m_PerfCountersEnabled = enabled;
+		}
+
+		// why the first worker that tried could not open its counters, empty if they all could
+		std::string GetPerfCounterError() const;
+
+		// logical CPUs of the workers and the main thread as pinned by Initialize
+		const WorkerAffinity& GetWorkerAffinity() const
+		{
+			return m_WorkerAffinity;
+		}
+
+		// starts or retires workers, call from the thread that called Initialize
+		// retiring workers finish their packet or claimed frame tile and are joined, count is clamped to [1, GetMaxWorkerCount()]
+		void SetWorkerCount(size_t count);
+
+		// one worker per logical CPU, or the initial count if that was set higher
+		size_t GetMaxWorkerCount() const
+		{
+			return m_WorkerCapacity;
+		}
+
+		// workers park after their packet or claimed frame tile until Resume, the G-buffer is kept
+		void Pause();
+
+		void Resume();
+
+		bool IsPaused() const
+		{
+			return m_Paused;
+		}
+
 		void SetView(const vec3& origin, const vec3& topLeft, const vec3& topRight, const vec3& bottomLeft);
 
+		// copies the latest published view, safe to call from any thread
+		void AcquireView(View& view) const;
+
+		unsigned GetViewEpoch() const
+		{
+			return m_ViewEpoch.load(std::memory_order_acquire);
+		}
+
+		void SetFoveation(const Foveation& foveation);
+
+		const Foveation& GetFoveation() const
+		{
+			return m_Foveation;
+		}
+
+		void SetGazePoint(const vec2& gaze);
+
+		void SetPacketShape(const PacketShape& shape);
+
+		const PacketShape& GetPacketShape() const
+		{
+			return m_PacketShape;
+		}
+
+		// traces every pixel of the current view exactly once, the image does not depend on the worker count
+		// call after SetView and Initialize, the next PublishGBuffer after the future is ready shows the whole frame
+		// a view change before that breaks the promise
+		std::future<void> RenderFrame();
+
+		// traces packets of the given shape with frame-less sampling on the calling thread, used for benchmarking
+		TraversalStats TracePackets(const PacketShape& shape, unsigned long long packetCount);
+
+		// when enabled, a significant view change restarts a coarse-to-fine pass (1/16, 1/4 and full resolution)
+		// that runs ahead of the frameless sampling
+		void SetProgressiveRefinement(bool enabled)
+		{
+			m_ProgressiveRefinement = enabled;
+		}
+
+		bool IsProgressiveRefinementEnabled() const
+		{
+			return m_ProgressiveRefinement;
+		}
+
+		// screen-space motion in pixels above which a view change restarts the progressive pass
+		void SetProgressiveThreshold(float pixels)
+		{
+			m_ProgressiveThreshold = pixels;
+		}
+
+		// swaps the back buffers and merges the pixels written since the last publish into the front buffer
+		// call from a single thread, updated tiles are also copied to staging (width * height texels) when given
+		const GBuffer& PublishGBuffer(GBufferTexel* staging = nullptr);
+
+		// front buffer as of the last PublishGBuffer call
 		const GBuffer& GetGBuffer() const
 		{
 			return m_GBuffer;
 		}
 
-		int GetMaxDepthReached() const
+		// indices of the GBUFFER_TILE_SIZE tiles of the front buffer that changed in the last PublishGBuffer call,
+		// in ascending order, tile x + y * GetTileCountX()
+		const std::vector<size_t>& GetUpdatedTiles() const
+		{
+			return m_UpdatedTiles;
+		}
+
+		size_t GetTileCountX() const
+		{
+			return m_TilesX;
+		}
+
+		size_t GetTileCountY() const
+		{
+			return m_TilesY;
+		}
+
+		// NUMA nodes and huge page backing of the front and back buffers
+		MemoryPlacement GetGBufferPlacement() const
+		{
+			return m_FrameArena.GetPlacement();
+		}
+
+		HugePageMode GetGBufferHugePageMode() const
 		{
-			return m_MaxDepthReached;
+			return m_FrameArena.GetHugePageMode();
 		}
 
-		void ResetMaxDepthReached()
+#ifdef SPHEREFLAKE_HEATMAP
+
+		// width * height texels in row-major order, written by the workers without synchronisation
+		const std::vector<HeatmapTexel>& GetHeatmap() const
 		{
-			m_MaxDepthReached = 0;
+			return m_Heatmap;
 		}
 
-		long long GetRaysPerSecond() const
+		// writes one channel of the heatmap as a greyscale PFM (portable float map) image
+		bool WriteHeatmap(const std::string& filename, size_t channel) const;
+
+#endif
+
+		// aggregates the per-worker counters, safe to call from any thread, rates are the difference of two snapshots
+		Stats GetStats() const;
+
+		// closest hit of the latest view the workers traced, cheaper than a full snapshot
+		float GetClosestSphereDistance() const;
+
+		size_t GetWorkerCount() const
 		{
-			return m_RaysPerSecond;
+			return m_Threads.size();
 		}
 
-		void ResetRaysPerSecond()
+		// workers park once every pixel has been traced for the current view and wake up on the next view change,
+		// they also park while paused
+		size_t GetParkedWorkerCount() const
 		{
-			m_RaysPerSecond = 0;
+			return m_ParkedWorkers;
 		}
 
-		float GetClosestSphereDistance() const
+		bool IsIdle() const
 		{
-			return m_ClosestSphereDistance;
+			return !m_Threads.empty() && m_ParkedWorkers == m_Threads.size();
 		}
 
-		void ResetClosestSphereDistance()
+		// rays traced by a worker slot since Initialize, retired workers keep their count, safe to call from any thread
+		unsigned long long GetWorkerRays(size_t workerIndex) const
 		{
-			m_ClosestSphereDistance = std::numeric_limits<float>::max();
+			return m_WorkerStats[workerIndex].rays.load(std::memory_order_relaxed);
+		}
+
+		// number of pixels traced at least once since the last view change
+		size_t GetSampledPixelCount() const
+		{
+			return (size_t) (m_SampledPixels.load(std::memory_order_relaxed) & 0xffffffffULL);
 		}
 
 		private:
-		SIMD::Vec3Packet m_RayOrigin;
-		SIMD::Vec3Packet m_TopLeft;
-		SIMD::Vec3Packet m_TopRight;
-		SIMD::Vec3Packet m_BottomLeft;
-		SIMD::Matrix4 m_RootTransform;
+		// views are double-buffered, the slot being written is never the published one and its sequence
+		// is cleared while it is written so a reader that is still copying from it two epochs later retries
+		struct ViewSlot
+		{
+			View view;
+			std::atomic<unsigned> sequence;
+		};
+
+		ViewSlot m_Views[2];
+
 		SIMD::Matrix4 m_ChildTransforms[9];
 
-		void DoImagePart();
+		struct FramelessSampler
+		{
+			FramelessSampler() : rnd(0), sobolCounter(0)
+			{
+				mt.seed((unsigned long) time(NULL));
+			}
+
+			std::mt19937 mt;
+			std::uniform_int_distribution<unsigned int> rnd;
+			unsigned long long sobolCounter;
+		};
+
+		// texels that have not been written since the last merge hold an empty marker, dirty tiles are flagged
+		// so the merge only has to visit the parts of the image that were traced
+		struct WriteBuffer
+		{
+			GBufferTexel* tiles;
+			std::vector<std::atomic<bool>> dirtyTiles;
+		};
+
+		// back buffer a worker writes into (GBUFFER_WRITER_IDLE between packets) and view it traces (0 while parked)
+		// padded to a cache line so acknowledging a publish does not bounce lines between workers
+		struct GBufferWriter
+		{
+			std::atomic<unsigned> generation;
+			std::atomic<unsigned> viewEpoch;
+			char padding[64 - 2 * sizeof(std::atomic<unsigned>)];
+		};
+
+		// counters of a worker slot, stored by its worker after every packet and only read by others
+		struct WorkerCounters
+		{
+			std::atomic<unsigned long long> packets;
+			std::atomic<unsigned long long> rays;
+			std::atomic<unsigned long long> nodesVisited;
+			std::atomic<unsigned long long> activeLanes;
+			std::atomic<unsigned long long> laneSlots;
+			std::atomic<unsigned long long> sphereTests;
+			std::atomic<unsigned long long> hits;
+			std::atomic<unsigned long long> lodTerminations;
+			std::atomic<unsigned long long> depthHistogram[STATS_DEPTH_BINS];
+
+			// closest hit of the packets traced for the view epoch
+			std::atomic<unsigned> closestEpoch;
+			std::atomic<float> closestDistance;
+
+			void Store(const TraversalStats& stats);
+
+			void AddTo(TraversalStats& stats) const;
+		};
+
+		// padded to whole cache lines so workers never write to a line another worker writes to
+		struct WorkerStats : WorkerCounters
+		{
+			char padding[64 - sizeof(WorkerCounters) % 64];
+		};
+
+		// hardware counters of the worker running in a slot and the final counts of the ones that ran there before,
+		// the counters belong to the worker's thread so a new worker in the slot opens its own
+		struct WorkerPerfCounters
+		{
+			std::unique_ptr<PerfCounters> counters;
+			PerfCounterValues retired;
+		};
+
+		// tile of a full frame a worker has claimed and the next of its packets, packets are numbered row by row
+		struct FrameCursor
+		{
+			FrameCursor() : epoch(0), tile(0), x(0), y(0), packetsX(0), next(0), count(0), staged(false) {}
+
+			unsigned epoch;
+			size_t tile;
+			size_t x;
+			size_t y;
+			size_t packetsX;
+			size_t next;
+			size_t count;
+
+			// a full tile whose own packets cover it exactly is assembled here and streamed out once complete
+			bool staged;
+			std::vector<GBufferTexel> texels;
+		};
+
+		// lane coordinates, minimum distances and results of a packet of up to MAX_PACKET_PIXELS pixels
+		struct Packet
+		{
+			float x[MAX_PACKET_PIXELS];
+			float y[MAX_PACKET_PIXELS];
+			float minT[MAX_PACKET_PIXELS];
+			SIMD::Vec3Packet position[MAX_PACKET_REGISTERS];
+			SIMD::Vec3Packet normal[MAX_PACKET_REGISTERS];
+			GBufferTexel texels[MAX_PACKET_PIXELS];
+			size_t width;
+			size_t pixels;
+			size_t footprint;
+
+			// closest hit of the packet
+			float closestT;
+		};
+
+		void StartWorker(size_t workerIndex, size_t touchParts);
+
+		void OpenWorkerPerfCounters(size_t workerIndex);
+
+		void CloseWorkerPerfCounters(size_t workerIndex);
+
+		void DoImagePart(size_t workerIndex);
+
+		bool IsRetired(size_t workerIndex) const
+		{
+			return m_Deinitialize.load(std::memory_order_relaxed) || workerIndex >= m_WorkerTarget.load(std::memory_order_relaxed);
+		}
+
+		void TouchGBuffer(size_t part, size_t parts);
+
+		void PublishView(bool restartProgressive);
+
+		bool GetProgressivePacket(const View& view, Packet& packet);
+
+		bool GetFramePacket(const View& view, FrameCursor& cursor, Packet& packet);
+
+		void CompleteFrameTile(unsigned epoch);
+
+		// every tile of the frame traced for the epoch has been claimed, or the tiles are not open yet
+		bool IsFrameDrained(unsigned epoch) const
+		{
+			return m_FrameEpoch.load(std::memory_order_relaxed) == epoch && m_FrameTicket.load(std::memory_order_relaxed) >= m_TilesX * m_TilesY;
+		}
+
+		bool GetFramelessPacket(const View& view, FramelessSampler& sampler, Packet& packet);
+
+		float GetSampleDensity(const Foveation& foveation, float x, float y) const;
+
+		void TracePacket(const View& view, Packet& packet, TraversalStats& stats);
+
+		template <size_t Registers>
+		void TraceRegisters(const View& view, Packet& packet, TraversalStats& stats);
+
+		void EncodePacket(Packet& packet);
+
+		size_t WritePacket(WriteBuffer& target, Packet& packet, bool coverFootprint, unsigned epoch);
+
+		void StagePacket(FrameCursor& cursor, const Packet& packet);
+
+		size_t StreamFrameTile(WriteBuffer& target, const FrameCursor& cursor, unsigned epoch);
+
+		size_t MarkSampled(size_t x, size_t y, size_t xEnd, size_t yEnd, unsigned epoch);
+
+		WriteBuffer& BeginGBufferWrite(size_t workerIndex);
+
+		void EndGBufferWrite(size_t workerIndex);
+
+		void MergeWriteBuffer(WriteBuffer& source);
+
+		void MergeTiles();
+
+		void DetileTile(WriteBuffer& source, size_t tile);
+
+		// back buffers store 32x32 tiles contiguously from a 64-byte boundary with the texels of a tile in Morton order, so the
+		// footprint of a packet usually stays within a cache line and never spans more than two pages
+		size_t GetTiledOffset(size_t x, size_t y) const
+		{
+			auto tile = x / GBUFFER_TILE_SIZE + (y / GBUFFER_TILE_SIZE) * m_TilesX;
+			return tile * GBUFFER_TILE_SIZE * GBUFFER_TILE_SIZE + MortonEncode(x % GBUFFER_TILE_SIZE, y % GBUFFER_TILE_SIZE);
+		}
+
+		static size_t MortonEncode(size_t x, size_t y)
+		{
+			return SpreadBits(x) | (SpreadBits(y) << 1);
+		}
+
+		// gathers the even bits of a Morton code
+		static size_t MortonDecode(size_t code)
+		{
+			code &= 0x55555555;
+			code = (code | (code >> 1)) & 0x33333333;
+			code = (code | (code >> 2)) & 0x0f0f0f0f;
+			code = (code | (code >> 4)) & 0x00ff00ff;
+			code = (code | (code >> 8)) & 0x0000ffff;
+			return code;
+		}
+
+		static size_t SpreadBits(size_t v)
+		{
+			v = (v | (v << 8)) & 0x00ff00ff;
+			v = (v | (v << 4)) & 0x0f0f0f0f;
+			v = (v | (v << 2)) & 0x33333333;
+			v = (v | (v << 1)) & 0x55555555;
+			return v;
+		}
+
+		void AddSampledPixels(unsigned epoch, size_t count);
+
+		bool IsConverged(unsigned epoch) const;
+
+		void Park(size_t workerIndex, unsigned epoch);
+
+		float ComputeViewDelta(const vec3& origin, const vec3& topLeft, const vec3& topRight, const vec3& bottomLeft) const;
 
 		void ComputeChildTransformations();
 
 		size_t m_Width;
 		size_t m_Height;
+
+		// the G-buffers are committed by the workers that own their tiles, a buffer is only touched on the calling
+		// thread if packets are traced before Initialize
+		FrameArena m_FrameArena;
+		bool m_GBufferTouched;
+		std::atomic<size_t> m_TouchedParts;
+
 		GBuffer m_GBuffer;
 
-		std::vector<std::shared_ptr<std::thread>> m_Threads;
+		size_t m_TilesX;
+		size_t m_TilesY;
+		WriteBuffer m_WriteBuffers[2];
+
+		// generations are even so they never match the odd idle marker, bit 1 selects the back buffer
+		std::atomic<unsigned> m_GBufferGeneration;
+		std::unique_ptr<GBufferWriter[]> m_GBufferWriters;
+		std::unique_ptr<WorkerStats[]> m_WorkerStats;
+
+		// opened and closed by the workers, read by GetStats
+		bool m_PerfCountersEnabled;
+		std::unique_ptr<WorkerPerfCounters[]> m_WorkerPerfCounters;
+		std::string m_PerfCounterError;
+		mutable std::mutex m_PerfCountersMutex;
 
-		bool m_Deinitialize;
+		// dirty tiles of the back buffer being merged, claimed by the publishing thread and the workers alike
+		WriteBuffer* m_MergeSource;
+		GBufferTexel* m_MergeStaging;
+		std::vector<size_t> m_MergeTiles;
+		std::atomic<size_t> m_MergeTileCount;
+		std::atomic<size_t> m_MergeTicket;
+		std::atomic<size_t> m_MergedTiles;
 
-		int m_MaxDepthReached;
-		long long m_RaysPerSecond;;
-		float m_ClosestSphereDistance;
+		// threads inside MergeTiles, the publish only returns once they have all left so the next one never rewrites
+		// the tiles and the source under a worker that took its ticket from an older round
+		std::atomic<size_t> m_MergeHelpers;
 
-		vec3 m_RayOriginVec3;
+		std::vector<size_t> m_UpdatedTiles;
 
-		SIMD::VecType IntersectSphereflake
+#ifdef SPHEREFLAKE_HEATMAP
+
+		std::vector<HeatmapTexel> m_Heatmap;
+
+		void RecordHeatmap(const Packet& packet, const TraversalStats& before, const TraversalStats& after);
+
+#endif
+
+		// indexed by worker, only resized by the thread that called Initialize
+		std::vector<std::shared_ptr<std::thread>> m_Threads;
+
+		ThreadPlacement m_ThreadPlacement;
+		CpuTopology m_Topology;
+		WorkerAffinity m_WorkerAffinity;
+
+		// workers at or above the target index exit, writer slots exist for every worker that may ever run
+		size_t m_WorkerCapacity;
+		std::atomic<size_t> m_WorkerTarget;
+		std::atomic<bool> m_Paused;
+		std::atomic<bool> m_Deinitialize;
+
+		// last view passed to SetView, only touched by the thread calling it
+		bool m_HasView;
+		vec3 m_LastOrigin;
+		vec3 m_LastTopLeft;
+		vec3 m_LastTopRight;
+		vec3 m_LastBottomLeft;
+		Foveation m_Foveation;
+		PacketShape m_PacketShape;
+
+		bool m_ProgressiveRefinement;
+		float m_ProgressiveThreshold;
+		std::atomic<size_t> m_ProgressiveTicket;
+
+		// full frame of RenderFrame, the tiles are claimed by ticket once the workers tracing older views are done
+		std::atomic<unsigned> m_FrameEpoch;
+		std::atomic<size_t> m_FrameTicket;
+		std::atomic<size_t> m_FrameTilesDone;
+		std::promise<void> m_FramePromise;
+		bool m_FramePending;
+		std::mutex m_FrameMutex;
+
+		// every view change publishes a new epoch, pixels are stamped with the epoch they were last traced in
+		std::atomic<unsigned> m_ViewEpoch;
+		// width * height in row-major order, in the arena so the workers first-touch it along with the front buffer
+		std::atomic<unsigned>* m_PixelEpochs;
+
+		// epoch in the upper and number of sampled pixels in the lower 32 bits so a view change resets both at once
+		std::atomic<unsigned long long> m_SampledPixels;
+
+		std::mutex m_ParkMutex;
+		std::condition_variable m_ParkCondition;
+		std::atomic<size_t> m_ParkedWorkers;
+
+		template <size_t Registers>
+		void IntersectSphereflake
 		(
-			const SIMD::Vec3Packet& rayDirection,
+			const SIMD::Vec3Packet* rayDirection,
+			const SIMD::VecType* laneMask,
 			const SIMD::Matrix4& parentTransform,
-			SIMD::VecType& minT,
-			SIMD::Vec3Packet& position,
-			SIMD::Vec3Packet& normal,
+			SIMD::VecType* minT,
+			SIMD::Vec3Packet* position,
+			SIMD::Vec3Packet* normal,
+			TraversalStats& stats,
 			float parentRadius,
 			int depth
 		)
@@ -101,74 +780,111 @@ namespace SphereflakeRaytracer
 			__m128 radius = _mm_set1_ps(radiusScalar);
 			__m128 doubleRadiusSq = _mm_mul_ps(radius, SIMD::Constants::two);
 			doubleRadiusSq = _mm_mul_ps(doubleRadiusSq, doubleRadiusSq);
-			__m128 t;
+			__m128 t[Registers];
 
 #else
 
 			__m256 radius = _mm256_broadcast_ss(&radiusScalar);
 			__m256 doubleRadiusSq = _mm256_mul_ps(radius, SIMD::Constants::two);
 			doubleRadiusSq = _mm256_mul_ps(doubleRadiusSq, doubleRadiusSq);
-			__m256 t;
+			__m256 t[Registers];
 
 #endif
 
 			SIMD::Vec3Packet sphereOrigin;
 			sphereOrigin.Set(vec3(parentTransform.Extract(3)));
 
-			// intersect with the bounding volume of the current depth
-			auto result = RaySphereIntersection(rayDirection, sphereOrigin, doubleRadiusSq, t);
+			stats.nodesVisited++;
+			stats.laneSlots += Registers * SIMD::PacketSize;
+			stats.sphereTests += Registers * SIMD::PacketSize;
+			stats.depthHistogram[std::min(depth, STATS_DEPTH_BINS - 1)]++;
 
-#ifdef __ARCH_NO_AVX
+			bool descend = false;
 
-			if (_mm_movemask_ps(result) == 0)
+			for (auto r = 0u; r < Registers; r++)
 			{
-				// all rays miss bounding sphere
-				return result;
-			}
+				// intersect with the bounding volume of the current depth
+				auto result = RaySphereIntersection(rayDirection[r], sphereOrigin, doubleRadiusSq, t[r]);
 
-			auto depthResult = _mm_cmplt_ps(_mm_sqrt_ps(_mm_div_ps(t, radius)), SIMD::Constants::sixty);
-			auto tLessThanZeroResult = _mm_cmplt_ps(t, SIMD::Constants::zero);
+#ifdef __ARCH_NO_AVX
 
-			if (_mm_movemask_ps(_mm_or_ps(depthResult, tLessThanZeroResult)) == 0)
-			{
-				// sphere is behind all rays or depth is too large
-				return result;
-			}
+				auto resultMask = _mm_movemask_ps(_mm_and_ps(result, laneMask[r]));
+				if (resultMask == 0)
+				{
+					// all rays in this register miss bounding sphere
+					continue;
+				}
+
+				stats.activeLanes += SIMD::CountLanes(resultMask);
+
+				auto depthResult = _mm_cmplt_ps(_mm_sqrt_ps(_mm_div_ps(t[r], radius)), SIMD::Constants::sixty);
+				auto tLessThanZeroResult = _mm_cmplt_ps(t[r], SIMD::Constants::zero);
+
+				auto descendMask = _mm_movemask_ps(_mm_or_ps(depthResult, tLessThanZeroResult));
+				if (descendMask != 0)
+				{
+					descend = true;
+				}
+
+				stats.lodTerminations += SIMD::CountLanes(resultMask & ~descendMask);
 
 #else
 
-			if (_mm256_movemask_ps(result) == 0)
-			{
-				// all rays miss bounding sphere
-				return result;
-			}
+				auto resultMask = _mm256_movemask_ps(_mm256_and_ps(result, laneMask[r]));
+				if (resultMask == 0)
+				{
+					// all rays in this register miss bounding sphere
+					continue;
+				}
 
-			auto depthResult = _mm256_cmp_ps(_mm256_sqrt_ps(_mm256_div_ps(t, radius)), SIMD::Constants::seventy, _CMP_LT_OQ);
-			auto tLessThanZeroResult = _mm256_cmp_ps(t, SIMD::Constants::zero, _CMP_LT_OQ);
+				stats.activeLanes += SIMD::CountLanes(resultMask);
 
-			if (_mm256_movemask_ps(_mm256_or_ps(depthResult, tLessThanZeroResult)) == 0)
-			{
-				// sphere is behind all rays or depth is too large
-				return result;
-			}
+				auto depthResult = _mm256_cmp_ps(_mm256_sqrt_ps(_mm256_div_ps(t[r], radius)), SIMD::Constants::seventy, _CMP_LT_OQ);
+				auto tLessThanZeroResult = _mm256_cmp_ps(t[r], SIMD::Constants::zero, _CMP_LT_OQ);
+
+				auto descendMask = _mm256_movemask_ps(_mm256_or_ps(depthResult, tLessThanZeroResult));
+				if (descendMask != 0)
+				{
+					descend = true;
+				}
+
+				stats.lodTerminations += SIMD::CountLanes(resultMask & ~descendMask);
+
+#endif
+
+#ifdef SPHEREFLAKE_HEATMAP
+
+				for (auto lane = 0u; lane < SIMD::PacketSize; lane++)
+				{
+					if (resultMask & (1 << lane))
+					{
+						stats.laneBoundingHits[r * SIMD::PacketSize + lane]++;
+					}
+				}
 
 #endif
 
-			if (depth > m_MaxDepthReached)
+			}
+
+			if (!descend)
 			{
-				m_MaxDepthReached = depth;
+				// all rays miss bounding sphere, or it is behind all rays or depth is too large
+				return;
 			}
 
+			stats.sphereTests += Registers * SIMD::PacketSize;
+
 			float scale = (4.0f / 3.0f) * radiusScalar;
 			__m128 translationScale = _mm_set_ps(1.0f, scale, scale, scale);
 
+			// the child transforms are computed once for all registers of the packet
 			for (auto i = 0; i < 9; i++)
 			{
 				auto transform = m_ChildTransforms[i];
 				transform.rows[3] = _mm_mul_ps(transform.rows[3], translationScale);
 				auto worldTransform = parentTransform * transform;
 
-				IntersectSphereflake(rayDirection, worldTransform, minT, position, normal, radiusScalar, depth + 1);
+				IntersectSphereflake<Registers>(rayDirection, laneMask, worldTransform, minT, position, normal, stats, radiusScalar, depth + 1);
 			}
 
 #ifdef __ARCH_NO_AVX
@@ -181,48 +897,49 @@ namespace SphereflakeRaytracer
 
 #endif
 
-
-			result = RaySphereIntersection(rayDirection, sphereOrigin, radiusSq, t);
+			for (auto r = 0u; r < Registers; r++)
+			{
+				auto result = RaySphereIntersection(rayDirection[r], sphereOrigin, radiusSq, t[r]);
 
 #ifdef __ARCH_NO_AVX
 
-			// depth comparison
-			auto minTResult = _mm_cmplt_ps(t, minT);
-			result = _mm_and_ps(result, minTResult);
+				// depth comparison
+				auto minTResult = _mm_cmplt_ps(t[r], minT[r]);
+				result = _mm_and_ps(result, minTResult);
 
-			if (_mm_movemask_ps(result) == 0)
-			{
-				// all rays don't pass depth test
-				return result;
-			}
+				if (_mm_movemask_ps(result) == 0)
+				{
+					// all rays don't pass depth test
+					continue;
+				}
 
-			minT = _mm_or_ps(_mm_andnot_ps(result, minT), _mm_and_ps(result, t));
+				minT[r] = _mm_or_ps(_mm_andnot_ps(result, minT[r]), _mm_and_ps(result, t[r]));
 
 #else
 
-			// depth comparison
-			auto minTResult = _mm256_cmp_ps(t, minT, _CMP_LT_OQ);
-			result = _mm256_and_ps(result, minTResult);
+				// depth comparison
+				auto minTResult = _mm256_cmp_ps(t[r], minT[r], _CMP_LT_OQ);
+				result = _mm256_and_ps(result, minTResult);
 
-			if (_mm256_movemask_ps(result) == 0)
-			{
-				// all rays don't pass depth test
-				return result;
-			}
+				if (_mm256_movemask_ps(result) == 0)
+				{
+					// all rays don't pass depth test
+					continue;
+				}
 
-			minT = _mm256_or_ps(_mm256_andnot_ps(result, minT), _mm256_and_ps(result, t));
+				minT[r] = _mm256_or_ps(_mm256_andnot_ps(result, minT[r]), _mm256_and_ps(result, t[r]));
 
 #endif
 
-			// calculate resulting view-space position and normal
-			auto selfPosition = rayDirection * t;
-			auto selfNormal = selfPosition - sphereOrigin;
-			SIMD::Normalize(selfNormal);
+				// calculate resulting view-space position and normal
+				auto selfPosition = rayDirection[r] * t[r];
+				auto selfNormal = selfPosition - sphereOrigin;
+				SIMD::Normalize(selfNormal);
 
-			// mask results
-			position = SIMD::Or(SIMD::AndNot(result, position), SIMD::And(result, selfPosition));
-			normal = SIMD::Or(SIMD::AndNot(result, normal), SIMD::And(result, selfNormal));
-			return result;
+				// mask results
+				position[r] = SIMD::Or(SIMD::AndNot(result, position[r]), SIMD::And(result, selfPosition));
+				normal[r] = SIMD::Or(SIMD::AndNot(result, normal[r]), SIMD::And(result, selfNormal));
+			}
 		}
 
 	};
@@ -36,6 +36,19 @@ namespace SphereflakeRaytracer
 		return lines.size();
 	}
 
+	// trace.json, 2 -> trace-2.json
+	inline std::string GetNumberedFilename(const std::string& filename, size_t number)
+	{
+		auto dot = filename.find_last_of('.');
+		auto slash = filename.find_last_of("/\\");
+		if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+		{
+			return filename + "-" + std::to_string(number);
+		}
+
+		return filename.substr(0, dot) + "-" + std::to_string(number) + filename.substr(dot);
+	}
+
 }
 
 #endif
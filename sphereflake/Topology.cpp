@@ -0,0 +1,454 @@
+#pragma warning (push, 0)
+#pragma warning (disable: 4530) // disable warnings from code not under our control
+
+#include <string>
+#include <vector>
+#include <set>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <tuple>
+#include <thread>
+#include <cmath>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sched.h>
+#include <pthread.h>
+#endif
+
+#pragma warning (pop)
+
+#include "StringUtil.h"
+#include "Topology.h"
+
+namespace SphereflakeRaytracer
+{
+
+#ifndef _WIN32
+
+	static bool ReadUnsigned(const std::string& path, unsigned& value)
+	{
+		std::ifstream f(path);
+		return (bool) (f >> value);
+	}
+
+	// parses the kernel's CPU list format, e.g. "0-3,8-11"
+	static std::vector<unsigned> ReadCpuList(const std::string& path)
+	{
+		std::vector<unsigned> result;
+
+		std::ifstream f(path);
+		std::string list;
+		if (!(f >> list))
+		{
+			return result;
+		}
+
+		for (auto& range : split(list, ','))
+		{
+			auto dash = range.find('-');
+			auto first = (unsigned) std::stoul(range.substr(0, dash));
+			auto last = dash == std::string::npos ? first : (unsigned) std::stoul(range.substr(dash + 1));
+
+			for (auto i = first; i <= last; i++)
+			{
+				result.push_back(i);
+			}
+		}
+
+		return result;
+	}
+
+#endif
+
+	CpuTopology CpuTopology::Detect()
+	{
+		CpuTopology topology;
+
+#ifdef _WIN32
+
+		// processor groups are not handled, only the first 64 logical CPUs are visible here
+		DWORD length = 0;
+		GetLogicalProcessorInformation(nullptr, &length);
+
+		std::vector<SYSTEM_LOGICAL_PROCESSOR_INFORMATION> info(length / sizeof(SYSTEM_LOGICAL_PROCESSOR_INFORMATION));
+		if (info.empty() || !GetLogicalProcessorInformation(info.data(), &length))
+		{
+			return topology;
+		}
+
+		DWORD_PTR processMask, systemMask;
+		GetProcessAffinityMask(GetCurrentProcess(), &processMask, &systemMask);
+
+		std::map<unsigned, LogicalCpu> cpus;
+		unsigned core = 0, package = 0;
+
+		for (auto&& entry : info)
+		{
+			for (auto i = 0u; i < sizeof(ULONG_PTR) * 8; i++)
+			{
+				if ((entry.ProcessorMask & ((ULONG_PTR) 1 << i)) == 0 || (processMask & ((DWORD_PTR) 1 << i)) == 0)
+				{
+					continue;
+				}
+
+				auto& cpu = cpus[i];
+				cpu.id = i;
+
+				if (entry.Relationship == RelationProcessorCore)
+				{
+					cpu.core = core;
+				}
+				else if (entry.Relationship == RelationProcessorPackage)
+				{
+					cpu.package = package;
+				}
+				else if (entry.Relationship == RelationNumaNode)
+				{
+					cpu.node = entry.NumaNode.NodeNumber;
+				}
+			}
+
+			if (entry.Relationship == RelationProcessorCore)
+			{
+				core++;
+			}
+			else if (entry.Relationship == RelationProcessorPackage)
+			{
+				package++;
+			}
+		}
+
+		for (auto&& cpu : cpus)
+		{
+			topology.m_Cpus.push_back(cpu.second);
+		}
+
+#else
+
+		cpu_set_t allowed;
+		CPU_ZERO(&allowed);
+		if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+		{
+			return topology;
+		}
+
+		std::map<unsigned, unsigned> cpuNodes;
+		for (auto node : ReadCpuList("/sys/devices/system/node/possible"))
+		{
+			for (auto cpu : ReadCpuList("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"))
+			{
+				cpuNodes[cpu] = node;
+			}
+		}
+
+		for (auto i = 0u; i < CPU_SETSIZE; i++)
+		{
+			if (!CPU_ISSET(i, &allowed))
+			{
+				continue;
+			}
+
+			auto path = "/sys/devices/system/cpu/cpu" + std::to_string(i) + "/topology/";
+
+			LogicalCpu cpu;
+			cpu.id = i;
+			cpu.node = cpuNodes.count(i) ? cpuNodes[i] : 0;
+
+			if (!ReadUnsigned(path + "core_id", cpu.core) || !ReadUnsigned(path + "physical_package_id", cpu.package))
+			{
+				// no topology information, treat every logical CPU as a core of its own
+				cpu.core = i;
+				cpu.package = 0;
+			}
+
+			topology.m_Cpus.push_back(cpu);
+		}
+
+#endif
+
+		std::sort(topology.m_Cpus.begin(), topology.m_Cpus.end(), [](const LogicalCpu& a, const LogicalCpu& b)
+		{
+			return std::tie(a.node, a.package, a.core, a.id) < std::tie(b.node, b.package, b.core, b.id);
+		});
+
+		return topology;
+	}
+
+	size_t CpuTopology::GetCoreCount() const
+	{
+		std::set<std::pair<unsigned, unsigned>> cores;
+		for (auto&& cpu : m_Cpus)
+		{
+			cores.insert(std::make_pair(cpu.package, cpu.core));
+		}
+
+		return cores.size();
+	}
+
+	size_t CpuTopology::GetNodeCount() const
+	{
+		std::set<unsigned> nodes;
+		for (auto&& cpu : m_Cpus)
+		{
+			nodes.insert(cpu.node);
+		}
+
+		return nodes.size();
+	}
+
+	size_t CpuTopology::GetAvailableWorkerCount() const
+	{
+		auto count = m_Cpus.empty() ? (size_t) std::thread::hardware_concurrency() : m_Cpus.size();
+
+		// a fractional quota still gets a worker for its remainder, the scheduler throttles it in proportion
+		auto quota = GetCpuQuota();
+		if (quota > 0.0)
+		{
+			count = std::min(count, (size_t) std::ceil(quota));
+		}
+
+		return std::max(count, (size_t) 1);
+	}
+
+	double CpuTopology::GetCpuQuota()
+	{
+
+#ifdef _WIN32
+
+		JOBOBJECT_CPU_RATE_CONTROL_INFORMATION rate;
+		if (!QueryInformationJobObject(nullptr, JobObjectCpuRateControlInformation, &rate, sizeof(rate), nullptr))
+		{
+			return 0.0;
+		}
+
+		if ((rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_ENABLE) == 0 || (rate.ControlFlags & JOB_OBJECT_CPU_RATE_CONTROL_HARD_CAP) == 0)
+		{
+			return 0.0;
+		}
+
+		// the rate is in hundredths of a percent of all processors in the system
+		SYSTEM_INFO info;
+		GetSystemInfo(&info);
+		return rate.CpuRate / 10000.0 * info.dwNumberOfProcessors;
+
+#else
+
+		double quota = 0.0;
+
+		auto limit = [&quota](double cpus)
+		{
+			if (cpus > 0.0 && (quota == 0.0 || cpus < quota))
+			{
+				quota = cpus;
+			}
+		};
+
+		// mountinfo: id parent major:minor root mount-point options [optional fields] - fstype source super-options
+		std::string v1Root, v1Mount, v2Root, v2Mount;
+
+		std::ifstream mountInfo("/proc/self/mountinfo");
+		std::string line;
+		while (std::getline(mountInfo, line))
+		{
+			auto fields = split(line, ' ');
+			auto separator = std::find(fields.begin(), fields.end(), "-");
+			if (fields.size() < 5 || fields.end() - separator < 4)
+			{
+				continue;
+			}
+
+			auto& type = *(separator + 1);
+			auto options = split(*(separator + 3), ',');
+
+			if (type == "cgroup2" && v2Mount.empty())
+			{
+				v2Root = fields[3];
+				v2Mount = fields[4];
+			}
+			else if (type == "cgroup" && v1Mount.empty() && std::find(options.begin(), options.end(), "cpu") != options.end())
+			{
+				v1Root = fields[3];
+				v1Mount = fields[4];
+			}
+		}
+
+		// /proc/self/cgroup: hierarchy-id:controllers:path, the v2 hierarchy has id 0 and no controllers
+		std::string v1Path, v2Path;
+
+		std::ifstream cgroups("/proc/self/cgroup");
+		while (std::getline(cgroups, line))
+		{
+			auto first = line.find(':');
+			auto second = line.find(':', first + 1);
+			if (first == std::string::npos || second == std::string::npos)
+			{
+				continue;
+			}
+
+			auto controllers = split(line.substr(first + 1, second - first - 1), ',');
+			auto path = line.substr(second + 1);
+
+			if (line.compare(0, first, "0") == 0 && controllers.empty())
+			{
+				v2Path = path;
+			}
+			else if (std::find(controllers.begin(), controllers.end(), "cpu") != controllers.end())
+			{
+				v1Path = path;
+			}
+		}
+
+		// the cgroup path is relative to the hierarchy root, which is not the mount's root inside some containers
+		auto resolve = [](const std::string& root, const std::string& mount, std::string path)
+		{
+			if (root != "/" && path.compare(0, root.size(), root) == 0)
+			{
+				path = path.substr(root.size());
+			}
+
+			return mount + (path == "/" ? "" : path);
+		};
+
+		// limits of every ancestor apply as well, walk up to the mount point
+		if (!v2Mount.empty() && !v2Path.empty())
+		{
+			for (auto directory = resolve(v2Root, v2Mount, v2Path); directory.size() >= v2Mount.size(); directory = directory.substr(0, directory.rfind('/')))
+			{
+				std::ifstream f(directory + "/cpu.max");
+				std::string max;
+				double period;
+				if (f >> max >> period && max != "max" && period > 0.0)
+				{
+					limit(std::stod(max) / period);
+				}
+			}
+		}
+
+		if (!v1Mount.empty() && !v1Path.empty())
+		{
+			for (auto directory = resolve(v1Root, v1Mount, v1Path); directory.size() >= v1Mount.size(); directory = directory.substr(0, directory.rfind('/')))
+			{
+				std::ifstream quotaFile(directory + "/cpu.cfs_quota_us");
+				std::ifstream periodFile(directory + "/cpu.cfs_period_us");
+				double cfsQuota, cfsPeriod;
+				if (quotaFile >> cfsQuota && periodFile >> cfsPeriod && cfsQuota > 0.0 && cfsPeriod > 0.0)
+				{
+					limit(cfsQuota / cfsPeriod);
+				}
+			}
+		}
+
+		return quota;
+
+#endif
+
+	}
+
+	bool CpuTopology::SetCurrentThreadAffinity(const std::vector<unsigned>& cpus)
+	{
+
+#ifdef _WIN32
+
+		DWORD_PTR mask = 0;
+		for (auto cpu : cpus)
+		{
+			if (cpu < sizeof(DWORD_PTR) * 8)
+			{
+				mask |= (DWORD_PTR) 1 << cpu;
+			}
+		}
+
+		return mask != 0 && SetThreadAffinityMask(GetCurrentThread(), mask) != 0;
+
+#else
+
+		cpu_set_t set;
+		CPU_ZERO(&set);
+		for (auto cpu : cpus)
+		{
+			CPU_SET(cpu, &set);
+		}
+
+		return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+
+#endif
+
+	}
+
+	WorkerAffinity WorkerAffinity::Plan(const CpuTopology& topology, const ThreadPlacement& placement)
+	{
+		WorkerAffinity affinity;
+
+		auto cpus = topology.GetCpus();
+		auto available = topology.GetAvailableWorkerCount();
+
+		if (placement.reserveMainCore && topology.GetCoreCount() > 1)
+		{
+			auto first = cpus.front();
+			auto sibling = [&first](const LogicalCpu& cpu) { return cpu.package == first.package && cpu.core == first.core; };
+
+			for (auto&& cpu : cpus)
+			{
+				if (sibling(cpu))
+				{
+					affinity.mainThread.push_back(cpu.id);
+				}
+			}
+
+			cpus.erase(std::remove_if(cpus.begin(), cpus.end(), sibling), cpus.end());
+
+			// the main thread's share counts against a quota too
+			available = std::max(available - 1, (size_t) 1);
+		}
+
+		// CPU sets workers are assigned to in order
+		std::vector<std::vector<unsigned>> slots;
+
+		switch (cpus.empty() ? AffinityPolicy::None : placement.policy)
+		{
+		case AffinityPolicy::None:
+			// without a reserved core nothing is pinned, otherwise every worker may use all remaining CPUs
+			slots.resize(1);
+			for (auto&& cpu : affinity.mainThread.empty() ? std::vector<LogicalCpu>() : cpus)
+			{
+				slots[0].push_back(cpu.id);
+			}
+			break;
+		case AffinityPolicy::Compact:
+			for (auto&& cpu : cpus)
+			{
+				slots.push_back(std::vector<unsigned>(1, cpu.id));
+			}
+			break;
+		case AffinityPolicy::Cores:
+			for (auto i = 0u; i < cpus.size(); i++)
+			{
+				if (i == 0 || cpus[i].package != cpus[i - 1].package || cpus[i].core != cpus[i - 1].core)
+				{
+					slots.push_back(std::vector<unsigned>(1, cpus[i].id));
+				}
+			}
+			break;
+		}
+
+		auto workerCount = placement.workerCount;
+		if (workerCount == 0)
+		{
+			workerCount = slots.size() == 1 ? available : std::min(slots.size(), available);
+		}
+
+		for (size_t i = 0; i < workerCount; i++)
+		{
+			affinity.workers.push_back(slots[i % slots.size()]);
+		}
+
+		return affinity;
+	}
+
+}
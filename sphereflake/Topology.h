@@ -0,0 +1,106 @@
+#ifndef __SPHEREFLAKERAYTRACER_TOPOLOGY_H
+#define __SPHEREFLAKERAYTRACER_TOPOLOGY_H
+
+namespace SphereflakeRaytracer
+{
+
+	struct LogicalCpu
+	{
+		unsigned id;
+		unsigned core;
+		unsigned package;
+		unsigned node;
+	};
+
+	// logical CPUs the process may run on, ordered by node, package and core so SMT siblings are adjacent
+	class CpuTopology
+	{
+
+		public:
+		static CpuTopology Detect();
+
+		const std::vector<LogicalCpu>& GetCpus() const
+		{
+			return m_Cpus;
+		}
+
+		size_t GetCoreCount() const;
+
+		size_t GetNodeCount() const;
+
+		// CPUs worth of time per period the process may use under its cgroup (v1 cfs_quota_us or v2 cpu.max, the
+		// tightest limit along the hierarchy) or job object, 0 if unlimited
+		static double GetCpuQuota();
+
+		// workers that can run without oversubscribing the affinity mask or the CPU quota
+		size_t GetAvailableWorkerCount() const;
+
+		// pins the calling thread to the given logical CPUs, false if the platform refused
+		static bool SetCurrentThreadAffinity(const std::vector<unsigned>& cpus);
+
+		private:
+		std::vector<LogicalCpu> m_Cpus;
+
+	};
+
+	enum class AffinityPolicy
+	{
+		// workers are scheduled freely by the OS
+		None,
+		// one worker per logical CPU, SMT siblings are filled before moving on to the next core
+		Compact,
+		// one worker per physical core, SMT siblings stay idle
+		Cores
+	};
+
+	// how workers are spread over the machine, workers are numbered in node order so the contiguous G-buffer share each
+	// of them first-touches lands on its own node
+	struct ThreadPlacement
+	{
+		ThreadPlacement() : policy(AffinityPolicy::None), reserveMainCore(false), workerCount(0) {}
+
+		AffinityPolicy policy;
+
+		// keeps the first core and its SMT siblings for the thread calling Initialize, e.g. the GL thread
+		bool reserveMainCore;
+
+		// explicit number of workers, 0 sizes the pool by CpuTopology::GetAvailableWorkerCount, workers are assigned
+		// to the policy's CPUs round-robin if there are more of them than CPUs
+		size_t workerCount;
+
+		// parses "none", "compact" or "cores"
+		static bool Parse(const std::string& s, AffinityPolicy& policy)
+		{
+			if (s == "none")
+			{
+				policy = AffinityPolicy::None;
+			}
+			else if (s == "compact")
+			{
+				policy = AffinityPolicy::Compact;
+			}
+			else if (s == "cores")
+			{
+				policy = AffinityPolicy::Cores;
+			}
+			else
+			{
+				return false;
+			}
+
+			return true;
+		}
+	};
+
+	// logical CPUs of every worker and of the main thread, an empty set leaves a thread unpinned
+	struct WorkerAffinity
+	{
+		std::vector<std::vector<unsigned>> workers;
+		std::vector<unsigned> mainThread;
+
+		static WorkerAffinity Plan(const CpuTopology& topology, const ThreadPlacement& placement);
+	};
+
+}
+
+#endif
@@ -0,0 +1,240 @@
+#pragma warning (push, 0)
+#pragma warning (disable: 4530) // disable warnings from code not under our control
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+#include <fstream>
+#include <algorithm>
+
+#pragma warning (pop)
+
+#include "Trace.h"
+
+namespace SphereflakeRaytracer
+{
+
+	// single-writer ring, the slots are relaxed atomics so a dump can read them while the owner keeps writing
+	// and tell torn slots apart by re-reading the head afterwards
+	struct Trace::Ring
+	{
+		struct Slot
+		{
+			std::atomic<const char*> name;
+			std::atomic<long long> start;
+			std::atomic<long long> duration;
+			std::atomic<const char*> argName;
+			std::atomic<long long> arg;
+		};
+
+		Ring(const std::string& name, size_t track) :
+			name(name),
+			track(track),
+			slots(nullptr),
+			head(0)
+		{}
+
+		~Ring()
+		{
+			delete[] slots.load();
+		}
+
+		std::string name;
+		size_t track;
+
+		// allocated by the first event, naming a thread costs no memory while tracing is off
+		std::atomic<Slot*> slots;
+		std::atomic<unsigned long long> head;
+	};
+
+	std::atomic<bool> Trace::s_Enabled(false);
+
+	static std::chrono::steady_clock::time_point g_TraceOrigin;
+
+	// rings are never freed, a finished thread's events stay available to the dump
+	static std::mutex g_TraceRingsMutex;
+	static std::vector<std::unique_ptr<Trace::Ring>> g_TraceRings;
+
+	static TRACE_THREAD_LOCAL Trace::Ring* t_TraceRing = nullptr;
+
+	void Trace::Enable()
+	{
+		// called before the recording threads start, they see the origin through the thread creation
+		g_TraceOrigin = std::chrono::steady_clock::now();
+		s_Enabled.store(true, std::memory_order_release);
+	}
+
+	long long Trace::Now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - g_TraceOrigin).count();
+	}
+
+	Trace::Ring* Trace::GetRing(const std::string& name)
+	{
+		std::lock_guard<std::mutex> lock(g_TraceRingsMutex);
+
+		for (auto& ring : g_TraceRings)
+		{
+			if (ring->name == name)
+			{
+				return ring.get();
+			}
+		}
+
+		g_TraceRings.push_back(std::unique_ptr<Ring>(new Ring(name, g_TraceRings.size() + 1)));
+		return g_TraceRings.back().get();
+	}
+
+	Trace::Ring* Trace::GetCurrentRing()
+	{
+		if (t_TraceRing == nullptr)
+		{
+			std::lock_guard<std::mutex> lock(g_TraceRingsMutex);
+			auto name = "thread " + std::to_string(g_TraceRings.size() + 1);
+			g_TraceRings.push_back(std::unique_ptr<Ring>(new Ring(name, g_TraceRings.size() + 1)));
+			t_TraceRing = g_TraceRings.back().get();
+		}
+
+		return t_TraceRing;
+	}
+
+	void Trace::SetThreadName(const std::string& name)
+	{
+		t_TraceRing = GetRing(name);
+	}
+
+	static void WriteSlot(Trace::Ring& ring, const char* name, long long start, long long end, const char* argName, long long arg)
+	{
+		auto slots = ring.slots.load(std::memory_order_relaxed);
+		if (slots == nullptr)
+		{
+			// published to the dump by the release store of the head below
+			slots = new Trace::Ring::Slot[TRACE_RING_SIZE];
+			ring.slots.store(slots, std::memory_order_relaxed);
+		}
+
+		auto head = ring.head.load(std::memory_order_relaxed);
+		auto& slot = slots[head % TRACE_RING_SIZE];
+
+		slot.name.store(name, std::memory_order_relaxed);
+		slot.start.store(start, std::memory_order_relaxed);
+		slot.duration.store(end - start, std::memory_order_relaxed);
+		slot.argName.store(argName, std::memory_order_relaxed);
+		slot.arg.store(arg, std::memory_order_relaxed);
+
+		ring.head.store(head + 1, std::memory_order_release);
+	}
+
+	void Trace::Record(const char* name, long long start, long long end, const char* argName, long long arg)
+	{
+		if (!IsEnabled())
+		{
+			return;
+		}
+
+		WriteSlot(*GetCurrentRing(), name, start, end, argName, arg);
+	}
+
+	void Trace::RecordOnTrack(const std::string& track, const char* name, long long start, long long end)
+	{
+		if (!IsEnabled())
+		{
+			return;
+		}
+
+		WriteSlot(*GetRing(track), name, start, end, nullptr, 0);
+	}
+
+	static std::vector<TraceEvent> ReadRing(Trace::Ring& ring)
+	{
+		auto head = ring.head.load(std::memory_order_acquire);
+		auto first = head > TRACE_RING_SIZE ? head - TRACE_RING_SIZE : 0;
+
+		std::vector<TraceEvent> events;
+		if (head == 0)
+		{
+			return events;
+		}
+
+		auto slots = ring.slots.load(std::memory_order_relaxed);
+		events.reserve((size_t) (head - first));
+
+		for (auto i = first; i < head; i++)
+		{
+			auto& slot = slots[i % TRACE_RING_SIZE];
+
+			TraceEvent event;
+			event.name = slot.name.load(std::memory_order_relaxed);
+			event.start = slot.start.load(std::memory_order_relaxed);
+			event.duration = slot.duration.load(std::memory_order_relaxed);
+			event.argName = slot.argName.load(std::memory_order_relaxed);
+			event.arg = slot.arg.load(std::memory_order_relaxed);
+			events.push_back(event);
+		}
+
+		// the owner may have lapped us meanwhile, the slot it is writing now is the one after the new head's oldest
+		std::atomic_thread_fence(std::memory_order_acquire);
+		auto newHead = ring.head.load(std::memory_order_relaxed);
+		auto valid = newHead + 1 > TRACE_RING_SIZE ? newHead + 1 - TRACE_RING_SIZE : 0;
+
+		if (valid > first)
+		{
+			events.erase(events.begin(), events.begin() + (size_t) std::min(valid - first, head - first));
+		}
+
+		return events;
+	}
+
+	bool Trace::Write(const std::string& filename)
+	{
+		std::ofstream file(filename);
+		if (!file)
+		{
+			return false;
+		}
+
+		std::vector<Ring*> rings;
+		{
+			std::lock_guard<std::mutex> lock(g_TraceRingsMutex);
+			for (auto& ring : g_TraceRings)
+			{
+				rings.push_back(ring.get());
+			}
+		}
+
+		file.setf(std::ios::fixed);
+		file.precision(3);
+
+		file << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[" << std::endl;
+
+		bool first = true;
+		for (auto ring : rings)
+		{
+			file << (first ? "" : ",\n");
+			file << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->track << ",\"args\":{\"name\":\"" << ring->name << "\"}},\n";
+			file << "{\"name\":\"thread_sort_index\",\"ph\":\"M\",\"pid\":1,\"tid\":" << ring->track << ",\"args\":{\"sort_index\":" << ring->track << "}}";
+			first = false;
+
+			// timestamps are in microseconds
+			for (auto& event : ReadRing(*ring))
+			{
+				file << ",\n{\"name\":\"" << event.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << ring->track;
+				file << ",\"ts\":" << event.start / 1000.0 << ",\"dur\":" << event.duration / 1000.0;
+
+				if (event.argName != nullptr)
+				{
+					file << ",\"args\":{\"" << event.argName << "\":" << event.arg << "}";
+				}
+
+				file << "}";
+			}
+		}
+
+		file << "\n]}" << std::endl;
+		return file.good();
+	}
+
+}
@@ -0,0 +1,105 @@
+#ifndef __SPHEREFLAKERAYTRACER_TRACE_H
+#define __SPHEREFLAKERAYTRACER_TRACE_H
+
+// events kept per thread, older ones are overwritten
+#define TRACE_RING_SIZE 65536
+
+// VS2013 has no thread_local, its __declspec(thread) is enough for a pointer
+#ifdef _MSC_VER
+#define TRACE_THREAD_LOCAL __declspec(thread)
+#else
+#define TRACE_THREAD_LOCAL thread_local
+#endif
+
+#define TRACE_CONCAT_INNER(a, b) a##b
+#define TRACE_CONCAT(a, b) TRACE_CONCAT_INNER(a, b)
+
+// times the rest of the enclosing scope on the calling thread, name has to be a string literal
+#define TRACE_ZONE(name) SphereflakeRaytracer::TraceZone TRACE_CONCAT(traceZone, __LINE__)(name)
+
+namespace SphereflakeRaytracer
+{
+
+	// a complete event of the timeline, times are in nanoseconds since tracing was enabled
+	struct TraceEvent
+	{
+		TraceEvent() : name(nullptr), start(0), duration(0), argName(nullptr), arg(0) {}
+
+		const char* name;
+		long long start;
+		long long duration;
+
+		// optional argument shown with the event, e.g. the number of packets in a batch
+		const char* argName;
+		long long arg;
+	};
+
+	// timeline of what the threads are doing, written as Chrome trace JSON for chrome://tracing and Perfetto
+	// every thread records into a ring of its own that keeps its last TRACE_RING_SIZE events
+	class Trace
+	{
+
+		public:
+		// per-thread event ring, defined in Trace.cpp
+		struct Ring;
+
+		// recording is off until enabled, zones then cost a clock read and a few stores
+		static void Enable();
+
+		static bool IsEnabled()
+		{
+			return s_Enabled.load(std::memory_order_relaxed);
+		}
+
+		static long long Now();
+
+		// names the timeline track of the calling thread, a thread taking the name of a thread that has
+		// finished continues its track, so workers of a pool slot share one row
+		static void SetThreadName(const std::string& name);
+
+		static void Record(const char* name, long long start, long long end, const char* argName = nullptr, long long arg = 0);
+
+		// events measured on another clock domain (GPU timestamps converted to Now()) go to a track of their own,
+		// a track is written by one thread at a time
+		static void RecordOnTrack(const std::string& track, const char* name, long long start, long long end);
+
+		// may be called while other threads keep recording, events overwritten during the dump are left out
+		static bool Write(const std::string& filename);
+
+		private:
+		static Ring* GetRing(const std::string& name);
+		static Ring* GetCurrentRing();
+
+		static std::atomic<bool> s_Enabled;
+
+	};
+
+	class TraceZone
+	{
+
+		public:
+		explicit TraceZone(const char* name) :
+			m_Name(name),
+			m_Start(Trace::IsEnabled() ? Trace::Now() : -1)
+		{}
+
+		~TraceZone()
+		{
+			if (m_Start >= 0)
+			{
+				Trace::Record(m_Name, m_Start, Trace::Now());
+			}
+		}
+
+		private:
+		TraceZone(const TraceZone&);
+		TraceZone& operator=(const TraceZone&);
+
+		const char* m_Name;
+		long long m_Start;
+
+	};
+
+}
+
+#endif
@@ -22,10 +22,14 @@
 #include <fstream>
 #include <vector>
 #include <mutex>
+#include <condition_variable>
 #include <atomic>
 #include <thread>
+#include <future>
 #include <random>
 #include <memory>
+#include <chrono>
+#include <cstring>
  
 #define GL_GLEXT_PROTOTYPES
 #include "glcorearb.h"
@@ -49,6 +53,9 @@ using namespace glm;
 #define WND_WIDTH 1280
 #define WND_HEIGHT 720
 
+// persistently mapped upload buffers in flight, the one being filled is never read by the GPU
+#define GBUFFER_UPLOAD_BUFFERS 3
+
 #include "Util.h"
 #include "StringUtil.h"
 #include "Filesystem.h"
@@ -58,6 +65,8 @@ using namespace glm;
 #include "GLPixelBufferObject.h"
 #include "GLTexture2D.h"
 #include "GLFramebufferObject.h"
+#include "Trace.h"
+#include "GLTimestampQueries.h"
 
 #ifdef __ARCH_NO_AVX
 #include <tmmintrin.h>
@@ -68,11 +77,39 @@ using namespace glm;
 #endif
 
 #include "camera.h"
+#include "FrameArena.h"
+#include "Topology.h"
+#include "PerfCounters.h"
 #include "Sphereflake.h"
 #include "SSAO.h"
+#include "LatencyController.h"
+#include "Metrics.h"
 
 using namespace SphereflakeRaytracer;
 
+void ConfigureCamera(Camera& camera)
+{
+	camera.SetPosition(vec3(-5.4098f, -7.2139f, 1.19006f));
+	camera.SetPitch(-1.371f);
+	camera.SetYaw(0.921999f);
+	camera.SetRoll(0.0f);
+
+	// --camera=x,y,z,pitch,yaw
+	if (COMMANDLINE_HAS_KEY("camera"))
+	{
+		auto values = split(CommandLine::Instance().GetValue("camera"), ',');
+		if (values.size() != 5)
+		{
+			std::cout << "Invalid camera, expected x,y,z,pitch,yaw" << std::endl;
+			exit(1);
+		}
+
+		camera.SetPosition(vec3(stof(values[0]), stof(values[1]), stof(values[2])));
+		camera.SetPitch(stof(values[3]));
+		camera.SetYaw(stof(values[4]));
+	}
+}
+
 class SphereflakeRaytracerMain
 {
 
@@ -83,17 +120,28 @@ class SphereflakeRaytracerMain
 		m_Fullscreen(fullscreen),
 		m_MouseLastXPos(0.0f),
 		m_MouseLastYPos(0.0f),
-		m_Sphereflake(width, height)
+		m_PauseKeyDown(false),
+		m_AddWorkerKeyDown(false),
+		m_RemoveWorkerKeyDown(false),
+		m_TraceKeyDown(false),
+		m_TraceDumps(0),
+		m_Sphereflake(width, height),
+		m_FrameTimes(std::vector<double> { 0.004, 0.008, 0.012, 0.0167, 0.025, 0.0333, 0.05, 0.1, 0.25, 0.5, 1.0 }),
+		m_UploadCpuTimes(std::vector<double> { 0.0001, 0.00025, 0.0005, 0.001, 0.002, 0.004, 0.008, 0.016, 0.033 }),
+		m_UploadGpuTimes(m_UploadCpuTimes.GetBounds()),
+		m_SSAOGpuTimes(m_UploadCpuTimes.GetBounds()),
+		m_MetricsFrames(0),
+		m_StaleRatioSum(0.0),
+		m_BusyWorkersSum(0.0),
+		m_MetricsFileFailed(false),
+		m_GBufferUploadIndex(0)
 	{
 		InitializeOpenGL(width, height, fullscreen);
 
 		InitializeGBufferTextures();
 
 		m_Camera = std::make_shared<Camera>(m_Width, m_Height);
-		m_Camera->SetPosition(vec3(-5.4098f, -7.2139f, 1.19006f));
-		m_Camera->SetPitch(-1.371f);
-		m_Camera->SetYaw(0.921999f);
-		m_Camera->SetRoll(0.0f);
+		ConfigureCamera(*m_Camera);
 
 		std::string finalVertexSource;
 		if(!Filesystem::ReadAllText("Shaders/post_vertex.glsl", finalVertexSource))
@@ -103,9 +151,8 @@ class SphereflakeRaytracerMain
 		}
 
 		std::string finalFragmentSource;
-		if(!Filesystem::ReadAllText("Shaders/post_final.glsl", finalFragmentSource))
+		if(!GL::ReadPostShaderSource("Shaders/post_final.glsl", finalFragmentSource))
 		{
-			std::cout << "Couldn't open shader file: " << "Shaders/post_final.glsl" << std::endl;
 			exit(1);
 		}
 
@@ -117,8 +164,60 @@ class SphereflakeRaytracerMain
 
 		m_SSAO = std::make_shared<SSAO>(width, height, 1);
 
+		ConfigureMetrics();
+
+		// the metrics take the GPU times from the same queries as the trace
+		if (Trace::IsEnabled() || m_Metrics != nullptr)
+		{
+			m_TimestampQueries = std::make_shared<GL::TimestampQueries>();
+			m_SSAO->SetTimestampQueries(m_TimestampQueries);
+		}
+
+		ConfigureSphereflake();
+
 		m_Sphereflake.SetView(m_Camera->GetPosition(), m_Camera->GetTopLeft(), m_Camera->GetTopRight(), m_Camera->GetBottomLeft());
 		m_Sphereflake.Initialize();
+
+		auto& affinity = m_Sphereflake.GetWorkerAffinity();
+		std::cout << "Workers: " << affinity.workers.size();
+		auto quota = CpuTopology::GetCpuQuota();
+		if (quota > 0.0)
+		{
+			std::cout << ", CPU quota " << quota;
+		}
+		if (!affinity.mainThread.empty())
+		{
+			std::cout << ", main thread pinned to CPU " << affinity.mainThread.front();
+		}
+		std::cout << std::endl;
+
+		if (COMMANDLINE_HAS_KEY("target-frame-time"))
+		{
+			auto target = COMMANDLINE_GET_FLOAT_VALUE("target-frame-time") / 1000.0;
+			m_LatencyController = std::make_shared<LatencyController>(target, 1, m_Sphereflake.GetMaxWorkerCount());
+		}
+
+		// the workers have opened their counters once Initialize returns
+		if (COMMANDLINE_HAS_KEY("perf-counters"))
+		{
+			auto counters = m_Sphereflake.GetStats().counters;
+			if (counters.available != 0)
+			{
+				std::cout << "Hardware counters: " << counters.Describe() << std::endl;
+			}
+			else
+			{
+				std::cout << "Hardware counters unavailable: " << m_Sphereflake.GetPerfCounterError() << std::endl;
+			}
+		}
+
+		if (COMMANDLINE_HAS_KEY("memory-placement"))
+		{
+			// the workers have committed their shares of the G-buffers once Initialize returns
+			const char* hugePageModes[] = { "none", "transparent", "explicit" };
+			std::cout << "G-buffer huge pages: " << hugePageModes[(int) m_Sphereflake.GetGBufferHugePageMode()] << std::endl;
+			std::cout << "G-buffer placement: " << m_Sphereflake.GetGBufferPlacement().ToString() << std::endl;
+		}
 	}
 
 	~SphereflakeRaytracerMain()
@@ -126,6 +225,8 @@ class SphereflakeRaytracerMain
 		m_Camera = nullptr;
 		m_FinalPassProgram = nullptr;
 		m_SSAO = nullptr;
+		m_TimestampQueries = nullptr;
+		m_Metrics = nullptr;
 
 		glfwDestroyWindow(m_Window);
 		glfwTerminate();
@@ -134,6 +235,29 @@ class SphereflakeRaytracerMain
 	void Run()
 	{
 		DoMainLoop();
+
+		if (Trace::IsEnabled())
+		{
+			WriteTrace(CommandLine::Instance().GetValue("trace"));
+		}
+
+#ifdef SPHEREFLAKE_HEATMAP
+
+		// --heatmap-output=PREFIX writes PREFIX-<channel>.pfm for every channel
+		if (COMMANDLINE_HAS_KEY("heatmap-output"))
+		{
+			const char* channels[HEATMAP_CHANNELS] = { "nodes", "bounding-tests", "active-lanes", "bounding-hits" };
+			for (auto i = 0u; i < HEATMAP_CHANNELS; i++)
+			{
+				auto filename = CommandLine::Instance().GetValue("heatmap-output") + "-" + channels[i] + ".pfm";
+				if (!m_Sphereflake.WriteHeatmap(filename, i))
+				{
+					std::cout << "Couldn't write heatmap: " << filename << std::endl;
+				}
+			}
+		}
+
+#endif
 	}
 
 	private:
@@ -178,20 +302,141 @@ class SphereflakeRaytracerMain
 		glfwSwapInterval(1); // sync @ 60hz
 	}
 
+	void ConfigureSphereflake()
+	{
+		ThreadPlacement placement;
+
+		if (COMMANDLINE_HAS_KEY("affinity") && !ThreadPlacement::Parse(CommandLine::Instance().GetValue("affinity"), placement.policy))
+		{
+			std::cout << "Invalid affinity policy, expected none, compact or cores" << std::endl;
+			exit(1);
+		}
+
+		placement.reserveMainCore = COMMANDLINE_HAS_KEY("reserve-main-core");
+
+		m_Sphereflake.SetPerfCounters(COMMANDLINE_HAS_KEY("perf-counters"));
+
+		if (COMMANDLINE_HAS_KEY("workers"))
+		{
+			auto workers = COMMANDLINE_GET_INT_VALUE("workers");
+			if (workers <= 0)
+			{
+				std::cout << "Invalid worker count, expected a positive number" << std::endl;
+				exit(1);
+			}
+
+			placement.workerCount = (size_t) workers;
+		}
+
+		m_Sphereflake.SetThreadPlacement(placement);
+
+		if (COMMANDLINE_HAS_KEY("packet-shape"))
+		{
+			PacketShape shape;
+			if (!PacketShape::Parse(CommandLine::Instance().GetValue("packet-shape"), shape))
+			{
+				std::cout << "Invalid packet shape, expected WxH with at most " << MAX_PACKET_PIXELS << " pixels" << std::endl;
+				exit(1);
+			}
+
+			m_Sphereflake.SetPacketShape(shape);
+		}
+
+		if (COMMANDLINE_HAS_KEY("progressive"))
+		{
+			m_Sphereflake.SetProgressiveRefinement(true);
+		}
+
+		if (COMMANDLINE_HAS_KEY("progressive-threshold"))
+		{
+			m_Sphereflake.SetProgressiveThreshold(COMMANDLINE_GET_FLOAT_VALUE("progressive-threshold"));
+		}
+
+		if (COMMANDLINE_HAS_KEY("foveation"))
+		{
+			Foveation foveation;
+			foveation.enabled = true;
+
+			if (COMMANDLINE_HAS_KEY("gaze-x"))
+			{
+				foveation.gaze.x = COMMANDLINE_GET_FLOAT_VALUE("gaze-x");
+			}
+
+			if (COMMANDLINE_HAS_KEY("gaze-y"))
+			{
+				foveation.gaze.y = COMMANDLINE_GET_FLOAT_VALUE("gaze-y");
+			}
+
+			if (COMMANDLINE_HAS_KEY("fovea-radius"))
+			{
+				foveation.foveaRadius = COMMANDLINE_GET_FLOAT_VALUE("fovea-radius");
+			}
+
+			if (COMMANDLINE_HAS_KEY("periphery-radius"))
+			{
+				foveation.peripheryRadius = COMMANDLINE_GET_FLOAT_VALUE("periphery-radius");
+			}
+
+			if (COMMANDLINE_HAS_KEY("periphery-density"))
+			{
+				foveation.peripheryDensity = COMMANDLINE_GET_FLOAT_VALUE("periphery-density");
+			}
+
+			m_Sphereflake.SetFoveation(foveation);
+		}
+	}
+
+	// --metrics-file and --metrics-port, the page is updated once a second along with the window title
+	void ConfigureMetrics()
+	{
+		if (!COMMANDLINE_HAS_KEY("metrics-file") && !COMMANDLINE_HAS_KEY("metrics-port"))
+		{
+			return;
+		}
+
+		m_Metrics = std::make_shared<MetricsExporter>();
+
+		if (COMMANDLINE_HAS_KEY("metrics-file"))
+		{
+			m_Metrics->SetFile(CommandLine::Instance().GetValue("metrics-file"));
+		}
+
+		if (COMMANDLINE_HAS_KEY("metrics-port"))
+		{
+			auto port = COMMANDLINE_GET_INT_VALUE("metrics-port");
+			if (port <= 0 || port > 65535)
+			{
+				std::cout << "Invalid metrics port, expected 1 to 65535" << std::endl;
+				exit(1);
+			}
+
+			if (!m_Metrics->Listen((unsigned short) port))
+			{
+				std::cout << "Couldn't serve metrics: " << m_Metrics->GetError() << std::endl;
+				exit(1);
+			}
+
+			std::cout << "Metrics at http://127.0.0.1:" << port << "/metrics" << std::endl;
+		}
+	}
+
 	void InitializeGBufferTextures()
 	{
-		m_PositionsTexture = std::make_shared<GL::Texture2D>
+		m_GBufferTexture = std::make_shared<GL::Texture2D>
 		(
 			m_Width,
 			m_Height,
-			GL::Texture2DFormat::RGBA_FLOAT, 
+			GL::Texture2DFormat::RG_UNSIGNED_INT, 
 			GL::Texture2DFilter::NEAREST,
 			GL::Texture2DWrapMode::CLAMP_TO_EDGE
 		);
 
-		m_PositionsPbo = std::make_shared<GL::PixelBufferObject>();
+		std::vector<GBufferTexel> clear(m_Width * m_Height, GBufferTexel());
+		m_GBufferTexture->UploadRegion(clear.data(), 0, 0, m_Width, m_Height, m_Width);
+
+#ifdef SPHEREFLAKE_HEATMAP
 
-		m_NormalsTexture = std::make_shared<GL::Texture2D>
+		m_HeatmapTexture = std::make_shared<GL::Texture2D>
 		(
 			m_Width,
 			m_Height,
@@ -200,7 +445,35 @@ class SphereflakeRaytracerMain
 			GL::Texture2DWrapMode::CLAMP_TO_EDGE
 		);
 
-		m_NormalsPbo = std::make_shared<GL::PixelBufferObject>();
+		m_HeatmapChannel = 0;
+		m_HeatmapKeyDown = false;
+
+#endif
+
+		GLint versionMinor, versionMajor;
+		glGetIntegerv(GL_MINOR_VERSION, &versionMinor);
+		glGetIntegerv(GL_MAJOR_VERSION, &versionMajor);
+
+		bool bufferStorage = versionMajor > 4 || (versionMajor == 4 && versionMinor >= 4) || glfwExtensionSupported("GL_ARB_buffer_storage");
+		if (!bufferStorage || COMMANDLINE_HAS_KEY("no-persistent-mapping"))
+		{
+			std::cout << "Persistent mapping disabled, uploading from client memory" << std::endl;
+			return;
+		}
+
+		// the publish writes updated tiles straight into the mapped memory, which saves a copy on this thread
+		for (auto i = 0u; i < GBUFFER_UPLOAD_BUFFERS; i++)
+		{
+			auto buffer = std::make_shared<GL::PixelBufferObject>();
+			if (buffer->MapPersistent(m_Width * m_Height * sizeof(GBufferTexel)) == nullptr)
+			{
+				std::cout << "Failed to map upload buffer, uploading from client memory" << std::endl;
+				m_GBufferUploadBuffers.clear();
+				return;
+			}
+
+			m_GBufferUploadBuffers.push_back(buffer);
+		}
 	}
 
 	void ProcessInput(double dt)
@@ -210,6 +483,44 @@ class SphereflakeRaytracerMain
 			glfwSetWindowShouldClose(m_Window, 1);
 		}
 
+		if (WasKeyPressed(GLFW_KEY_P, m_PauseKeyDown))
+		{
+			if (m_Sphereflake.IsPaused())
+			{
+				m_Sphereflake.Resume();
+			}
+			else
+			{
+				m_Sphereflake.Pause();
+			}
+		}
+
+#ifdef SPHEREFLAKE_HEATMAP
+
+		// cycles through no overlay and the heatmap channels
+		if (WasKeyPressed(GLFW_KEY_H, m_HeatmapKeyDown))
+		{
+			m_HeatmapChannel = (m_HeatmapChannel + 1) % (HEATMAP_CHANNELS + 1);
+		}
+
+#endif
+
+		// the trace keeps running, every dump gets a file of its own
+		if (Trace::IsEnabled() && WasKeyPressed(GLFW_KEY_T, m_TraceKeyDown))
+		{
+			WriteTrace(GetNumberedFilename(CommandLine::Instance().GetValue("trace"), ++m_TraceDumps));
+		}
+
+		if (WasKeyPressed(GLFW_KEY_EQUAL, m_AddWorkerKeyDown))
+		{
+			m_Sphereflake.SetWorkerCount(m_Sphereflake.GetWorkerCount() + 1);
+		}
+
+		if (WasKeyPressed(GLFW_KEY_MINUS, m_RemoveWorkerKeyDown))
+		{
+			m_Sphereflake.SetWorkerCount(m_Sphereflake.GetWorkerCount() - 1);
+		}
+
 		float cameraSpeed = 0.2f * (float)dt * min(m_Sphereflake.GetClosestSphereDistance(), 6.0f);
 		if (glfwGetKey(m_Window, GLFW_KEY_D))
 		{
@@ -261,77 +572,406 @@ class SphereflakeRaytracerMain
 		double lastTime = glfwGetTime();
 		double fpsTimeAccum = 0.0;
 		size_t fpsCounter = 0;
+		auto lastStats = m_Sphereflake.GetStats();
 
 		while (!glfwWindowShouldClose(m_Window))
 		{
+			TRACE_ZONE("Frame");
+
 			double time = glfwGetTime();
 			double dt = time - lastTime;
 			lastTime = time;
 
 			fpsCounter++;
 			fpsTimeAccum += dt;
+
+			if (m_Metrics != nullptr)
+			{
+				m_FrameTimes.Observe(dt);
+			}
+
 			if (fpsTimeAccum > 1.0)
 			{
+				// the counters only grow, the title shows what was traced since the last update
+				auto stats = m_Sphereflake.GetStats();
+				auto traced = stats.traversal - lastStats.traversal;
+				auto seconds = fpsTimeAccum;
+
 				std::stringstream ss;
 				ss << "Sphereflake FPS: ";
 				ss << fpsCounter;
-				fpsTimeAccum = 0.0;
-				fpsCounter = 0;
 
 				ss << " Depth: ";
-				ss << m_Sphereflake.GetMaxDepthReached();
-				m_Sphereflake.ResetMaxDepthReached();;
+				ss << traced.GetMaxDepth();
 
 				ss << " Rays per second: ";
-				ss << m_Sphereflake.GetRaysPerSecond() / 1000;
+				ss << (long long) (traced.rays / fpsTimeAccum) / 1000;
 				ss << "k";
 				ss << " Closest sphere: ";
-				ss << m_Sphereflake.GetClosestSphereDistance();
-				m_Sphereflake.ResetClosestSphereDistance();
-				m_Sphereflake.ResetRaysPerSecond();
+				ss << stats.closestSphereDistance;
+
+				fpsTimeAccum = 0.0;
+				fpsCounter = 0;
+
+				ss << " Workers: ";
+				if (m_Sphereflake.IsPaused())
+				{
+					ss << "paused";
+				}
+				else if (m_Sphereflake.IsIdle())
+				{
+					ss << "idle";
+				}
+				else
+				{
+					ss << m_Sphereflake.GetWorkerCount() - m_Sphereflake.GetParkedWorkerCount();
+					ss << "/";
+					ss << m_Sphereflake.GetWorkerCount();
+				}
 
 				glfwSetWindowTitle(m_Window, ss.str().c_str());
+
+				if (COMMANDLINE_HAS_KEY("perf-counters"))
+				{
+					PrintPerfCounters(stats.counters - lastStats.counters, traced, seconds);
+				}
+
+				if (m_Metrics != nullptr)
+				{
+					PublishMetrics(stats, traced, seconds);
+				}
+
+				lastStats = stats;
 			}
 
 			ProcessInput(dt);
 			Render();
+
+			// parked workers do not compete with this thread, so idle frames say nothing about the worker count
+			if (m_LatencyController != nullptr && !m_Sphereflake.IsIdle())
+			{
+				auto workers = m_LatencyController->Update(dt, m_Sphereflake.GetWorkerCount());
+				if (workers != m_Sphereflake.GetWorkerCount())
+				{
+					m_Sphereflake.SetWorkerCount(workers);
+				}
+			}
+		}
+	}
+
+	// the histograms and totals are cumulative since startup, the averages and rates cover the last update interval
+	void PublishMetrics(const Sphereflake::Stats& stats, const TraversalStats& traced, double seconds)
+	{
+		MetricsPage page;
+
+		page.AddHistogram("sphereflake_frame_time_seconds", "Time between two frames of the render thread", m_FrameTimes);
+		page.AddHistogram("sphereflake_upload_cpu_seconds", "Render thread time to publish the G-buffer and issue the uploads of the changed tiles", m_UploadCpuTimes);
+		page.AddHistogram("sphereflake_upload_gpu_seconds", "GPU time of the G-buffer uploads, frames whose queries were late are left out", m_UploadGpuTimes);
+		page.AddHistogram("sphereflake_ssao_gpu_seconds", "GPU time of the SSAO passes, frames whose queries were late are left out", m_SSAOGpuTimes);
+
+		page.AddCounter("sphereflake_rays_total", "Rays traced by the workers", (double) stats.traversal.rays);
+		page.AddGauge("sphereflake_rays_per_second", "Rays traced per second over the last update interval", (double) traced.rays / seconds);
+
+		std::vector<double> workerRays;
+		for (size_t i = 0; i < m_Sphereflake.GetMaxWorkerCount(); i++)
+		{
+			workerRays.push_back((double) m_Sphereflake.GetWorkerRays(i));
+		}
+
+		page.AddCounters("sphereflake_worker_rays_total", "Rays traced by every worker slot, a slot that falls behind the others points at a throttled or busy core", "worker", workerRays);
+		page.AddGauge("sphereflake_workers", "Running workers, parked ones included", (double) m_Sphereflake.GetWorkerCount());
+		page.AddGauge("sphereflake_worker_utilisation_ratio", "Share of the running workers that were tracing rather than parked, averaged over the frames of the last update interval", m_MetricsFrames > 0 ? m_BusyWorkersSum / (double) m_MetricsFrames : 0.0);
+		page.AddGauge("sphereflake_paused", "1 while the workers are paused", m_Sphereflake.IsPaused() ? 1.0 : 0.0);
+
+		page.AddGauge("sphereflake_gbuffer_stale_ratio", "Share of the pixels not yet traced for the current view when the G-buffer was published, averaged over the frames of the last update interval", m_MetricsFrames > 0 ? m_StaleRatioSum / (double) m_MetricsFrames : 0.0);
+		page.AddGauge("sphereflake_traversal_depth", "Deepest level of the fractal visited over the last update interval", (double) traced.GetMaxDepth());
+		page.AddGauge("sphereflake_closest_sphere_distance", "Closest hit of the latest view", stats.closestSphereDistance);
+
+		// cycles per second of a busy worker are its clock frequency, which drops when the CPU throttles
+		if (stats.counters.available & PERF_COUNTER_CYCLES)
+		{
+			page.AddCounter("sphereflake_worker_cycles_total", "Core cycles of all workers in user mode", (double) stats.counters.cycles);
+		}
+
+		if (stats.counters.available & PERF_COUNTER_INSTRUCTIONS)
+		{
+			page.AddCounter("sphereflake_worker_instructions_total", "Instructions retired by all workers in user mode", (double) stats.counters.instructions);
+		}
+
+		m_MetricsFrames = 0;
+		m_StaleRatioSum = 0.0;
+		m_BusyWorkersSum = 0.0;
+
+		// reported once, a display that cannot write its metrics should not flood its log
+		if (!m_Metrics->Publish(page.GetText()) && !m_MetricsFileFailed)
+		{
+			std::cout << "Couldn't write metrics: " << m_Metrics->GetError() << std::endl;
+			m_MetricsFileFailed = true;
+		}
+	}
+
+	// averages of the worker state and the G-buffer staleness as seen by the frames since the last update
+	void SampleMetrics()
+	{
+		auto pixels = (double) (m_Width * m_Height);
+		m_StaleRatioSum += 1.0 - min((double) m_Sphereflake.GetSampledPixelCount() / pixels, 1.0);
+
+		auto workers = m_Sphereflake.GetWorkerCount();
+		m_BusyWorkersSum += workers > 0 ? (double) (workers - m_Sphereflake.GetParkedWorkerCount()) / (double) workers : 0.0;
+
+		m_MetricsFrames++;
+
+		// the timestamp queries hand back an earlier frame's zones once they are available
+		if (m_TimestampQueries != nullptr)
+		{
+			for (auto& zone : m_TimestampQueries->GetCollectedZones())
+			{
+				if (strcmp(zone.name, "Upload G-buffer") == 0)
+				{
+					m_UploadGpuTimes.Observe(zone.seconds);
+				}
+				else if (strcmp(zone.name, "SSAO") == 0)
+				{
+					m_SSAOGpuTimes.Observe(zone.seconds);
+				}
+			}
+		}
+	}
+
+	// hardware counters of the workers over the last report window, per ray so kernel variants compare directly
+	void PrintPerfCounters(const PerfCounterValues& counters, const TraversalStats& traced, double seconds)
+	{
+		if (counters.available == 0 || traced.rays == 0)
+		{
+			return;
+		}
+
+		auto rays = (double) traced.rays;
+
+		std::cout << "Rays per second: " << (long long) (rays / seconds) / 1000 << "k";
+		std::cout << " IPC: " << counters.GetIpc();
+		std::cout << " Cycles per ray: " << (double) counters.cycles / rays;
+
+		if (counters.available & PERF_COUNTER_L1D_MISSES)
+		{
+			std::cout << " L1D misses per ray: " << (double) counters.l1dMisses / rays;
+		}
+
+		if (counters.available & PERF_COUNTER_LLC_MISSES)
+		{
+			std::cout << " LLC misses per ray: " << (double) counters.llcMisses / rays;
+		}
+
+		if (counters.available & PERF_COUNTER_BRANCH_MISSES)
+		{
+			std::cout << " Branch misses per ray: " << (double) counters.branchMisses / rays;
+		}
+
+		if (counters.available & PERF_COUNTER_LICENCE)
+		{
+			auto licenceCycles = (double) (counters.licenceCycles[0] + counters.licenceCycles[1] + counters.licenceCycles[2]);
+			std::cout << " Licence levels:";
+			for (auto level = 0u; level < PERF_LICENCE_LEVELS; level++)
+			{
+				std::cout << " " << (licenceCycles > 0.0 ? (int) (100.0 * (double) counters.licenceCycles[level] / licenceCycles) : 0) << "%";
+			}
+		}
+
+		std::cout << std::endl;
+	}
+
+	void WriteTrace(const std::string& filename)
+	{
+		if (Trace::Write(filename))
+		{
+			std::cout << "Trace written to " << filename << std::endl;
+		}
+		else
+		{
+			std::cout << "Couldn't write trace: " << filename << std::endl;
+		}
+	}
+
+	// true on the frame a key goes down
+	bool WasKeyPressed(int key, bool& wasDown)
+	{
+		bool down = glfwGetKey(m_Window, key) != 0;
+		bool pressed = down && !wasDown;
+		wasDown = down;
+		return pressed;
+	}
+
+	void PublishGBuffer()
+	{
+		if (m_GBufferUploadBuffers.empty())
+		{
+			UploadGBuffer(m_Sphereflake.PublishGBuffer(), nullptr);
+			return;
+		}
+
+		// wait until the GPU is done with the uploads that last used this buffer
+		auto& buffer = m_GBufferUploadBuffers[m_GBufferUploadIndex];
+		{
+			TRACE_ZONE("Wait for upload buffer");
+			buffer->WaitFence();
+		}
+
+		UploadGBuffer(m_Sphereflake.PublishGBuffer((GBufferTexel*) buffer->GetMappedPointer()), buffer);
+
+		buffer->Fence();
+		m_GBufferUploadIndex = (m_GBufferUploadIndex + 1) % m_GBufferUploadBuffers.size();
+	}
+
+	// uploads the tiles that changed in the last publish, runs of dirty tiles in a tile row go up in one call
+	// and consecutive rows that changed completely are merged
+	void UploadGBuffer(const GBuffer& gbuffer, const std::shared_ptr<GL::PixelBufferObject>& buffer)
+	{
+		TRACE_ZONE("Upload G-buffer");
+		GL::TimestampZone gpuZone(m_TimestampQueries.get(), "Upload G-buffer");
+
+		auto& tiles = m_Sphereflake.GetUpdatedTiles();
+		auto tilesX = m_Sphereflake.GetTileCountX();
+
+		size_t pendingY = 0;
+		size_t pendingRows = 0;
+
+		for (size_t i = 0; i < tiles.size();)
+		{
+			auto tileY = tiles[i] / tilesX;
+			auto firstX = tiles[i] % tilesX;
+
+			size_t run = 1;
+			while (i + run < tiles.size() && tiles[i + run] == tiles[i] + run && (tiles[i + run] / tilesX) == tileY)
+			{
+				run++;
+			}
+
+			i += run;
+
+			auto x = firstX * GBUFFER_TILE_SIZE;
+			auto y = tileY * GBUFFER_TILE_SIZE;
+			auto width = min(run * GBUFFER_TILE_SIZE, m_Width - x);
+			auto height = min((size_t) GBUFFER_TILE_SIZE, m_Height - y);
+
+			if (run == tilesX)
+			{
+				if (pendingRows > 0 && pendingY + pendingRows == y)
+				{
+					pendingRows += height;
+					continue;
+				}
+
+				UploadGBufferRegion(gbuffer, buffer, 0, pendingY, m_Width, pendingRows);
+				pendingY = y;
+				pendingRows = height;
+				continue;
+			}
+
+			UploadGBufferRegion(gbuffer, buffer, x, y, width, height);
+		}
+
+		UploadGBufferRegion(gbuffer, buffer, 0, pendingY, m_Width, pendingRows);
+	}
+
+	// uploads from the mapped buffer if there is one, it holds the same texels as the front buffer for updated tiles
+	void UploadGBufferRegion(const GBuffer& gbuffer, const std::shared_ptr<GL::PixelBufferObject>& buffer, size_t x, size_t y, size_t width, size_t height)
+	{
+		if (width == 0 || height == 0)
+		{
+			return;
+		}
+
+		if (buffer != nullptr)
+		{
+			m_GBufferTexture->UploadRegion(buffer, (x + y * m_Width) * sizeof(GBufferTexel), x, y, width, height, m_Width);
+		}
+		else
+		{
+			m_GBufferTexture->UploadRegion(gbuffer.texels + x + y * m_Width, x, y, width, height, m_Width);
 		}
 	}
 
 	void Render()
 	{
+		if (m_TimestampQueries != nullptr)
+		{
+			m_TimestampQueries->BeginFrame();
+		}
+
 		// render sphereflake
-		m_Sphereflake.SetView(m_Camera->GetPosition(), m_Camera->GetTopLeft(), m_Camera->GetTopRight(), m_Camera->GetBottomLeft());
+		auto cameraPosition = m_Camera->GetPosition();
+		auto cameraTopLeft = m_Camera->GetTopLeft();
+		auto cameraTopRight = m_Camera->GetTopRight();
+		auto cameraBottomLeft = m_Camera->GetBottomLeft();
 
-		m_PositionsPbo->BufferData(m_Sphereflake.GetGBuffer().positions);
-		m_PositionsTexture->Upload(m_PositionsPbo);
+		m_Sphereflake.SetView(cameraPosition, cameraTopLeft, cameraTopRight, cameraBottomLeft);
 
-		m_NormalsPbo->BufferData(m_Sphereflake.GetGBuffer().normals);
-		m_NormalsTexture->Upload(m_NormalsPbo);
+		auto publishStart = glfwGetTime();
+		PublishGBuffer();
+
+		if (m_Metrics != nullptr)
+		{
+			m_UploadCpuTimes.Observe(glfwGetTime() - publishStart);
+			SampleMetrics();
+		}
 
-		m_PositionsTexture->Bind(0);
-		m_NormalsTexture->Bind(1);
+		m_GBufferTexture->Bind(0);
 
 		// render SSAO
 		m_SSAO->SetSampleRadiusMultiplier(m_Sphereflake.GetClosestSphereDistance());
+		m_SSAO->SetCameraCorners(cameraTopLeft - cameraPosition, cameraTopRight - cameraPosition, cameraBottomLeft - cameraPosition);
 		m_SSAO->Render();
 
 		glActiveTexture(GL_TEXTURE2);
 		glBindTexture(GL_TEXTURE_2D, m_SSAO->GetSSAOTexture());
 
-		// finalize
+		RenderFinalPass(cameraPosition, cameraTopLeft, cameraTopRight, cameraBottomLeft);
+
+		{
+			TRACE_ZONE("Swap buffers");
+			glfwSwapBuffers(m_Window);
+		}
+
+		glfwPollEvents();
+	}
+
+	void RenderFinalPass(const vec3& cameraPosition, const vec3& cameraTopLeft, const vec3& cameraTopRight, const vec3& cameraBottomLeft)
+	{
+		TRACE_ZONE("Final pass");
+		GL::TimestampZone gpuZone(m_TimestampQueries.get(), "Final pass");
+
 		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
 
 		m_FinalPassProgram->Use();
-		m_FinalPassProgram->SetUniform("cameraPosition", m_Camera->GetPosition());
+		m_FinalPassProgram->SetUniform("cameraPosition", cameraPosition);
+		m_FinalPassProgram->SetUniform("cameraTopLeft", cameraTopLeft - cameraPosition);
+		m_FinalPassProgram->SetUniform("cameraTopRight", cameraTopRight - cameraPosition);
+		m_FinalPassProgram->SetUniform("cameraBottomLeft", cameraBottomLeft - cameraPosition);
 		m_FinalPassProgram->SetUniform("framebufferSize", vec2(m_Width, m_Height));
 
+#ifdef SPHEREFLAKE_HEATMAP
+
+		m_FinalPassProgram->SetUniform("heatmapChannel", (int) m_HeatmapChannel);
+		if (m_HeatmapChannel > 0)
+		{
+			// the overlay is normalized to the hottest pixel of the channel
+			auto& heatmap = m_Sphereflake.GetHeatmap();
+			float hottest = 0.0f;
+			for (auto& texel : heatmap)
+			{
+				hottest = max(hottest, ((const float*) &texel)[m_HeatmapChannel - 1]);
+			}
+
+			m_HeatmapTexture->UploadRegion(heatmap.data(), 0, 0, m_Width, m_Height, m_Width);
+			m_HeatmapTexture->Bind(3);
+			m_FinalPassProgram->SetUniform("heatmapScale", hottest > 0.0f ? 1.0f / hottest : 0.0f);
+		}
+
+#endif
+
 		glViewport(0, 0, m_ViewportWidth, m_ViewportHeight);
 
 		DRAW_FULLSCREEN_QUAD();
-
-		glfwSwapBuffers(m_Window);
-		glfwPollEvents();
 	}
 
 	size_t m_Width;
@@ -344,26 +984,94 @@ class SphereflakeRaytracerMain
 	float m_MouseLastXPos;
 	float m_MouseLastYPos;
 
+	bool m_PauseKeyDown;
+	bool m_AddWorkerKeyDown;
+	bool m_RemoveWorkerKeyDown;
+	bool m_TraceKeyDown;
+	size_t m_TraceDumps;
+
 	std::shared_ptr<GL::Program> m_FinalPassProgram;
 
 	std::shared_ptr<Camera> m_Camera;
 	Sphereflake m_Sphereflake;
 	std::shared_ptr<SSAO> m_SSAO;
-
-	std::shared_ptr<GL::Texture2D> m_PositionsTexture;
-	std::shared_ptr<GL::PixelBufferObject> m_PositionsPbo;
-
-	std::shared_ptr<GL::Texture2D> m_NormalsTexture;
-	std::shared_ptr<GL::PixelBufferObject> m_NormalsPbo;
+	std::shared_ptr<LatencyController> m_LatencyController;
+	std::shared_ptr<GL::TimestampQueries> m_TimestampQueries;
+
+	// only with --metrics-file or --metrics-port
+	std::shared_ptr<MetricsExporter> m_Metrics;
+	MetricsHistogram m_FrameTimes;
+	MetricsHistogram m_UploadCpuTimes;
+	MetricsHistogram m_UploadGpuTimes;
+	MetricsHistogram m_SSAOGpuTimes;
+	size_t m_MetricsFrames;
+	double m_StaleRatioSum;
+	double m_BusyWorkersSum;
+	bool m_MetricsFileFailed;
+
+	std::shared_ptr<GL::Texture2D> m_GBufferTexture;
+
+#ifdef SPHEREFLAKE_HEATMAP
+	std::shared_ptr<GL::Texture2D> m_HeatmapTexture;
+	size_t m_HeatmapChannel;
+	bool m_HeatmapKeyDown;
+#endif
+	std::vector<std::shared_ptr<GL::PixelBufferObject>> m_GBufferUploadBuffers;
+	size_t m_GBufferUploadIndex;
 
 	GLFWwindow* m_Window;
 
 };
 
+// traces the same camera with every packet shape on the calling thread, no window is opened
+void RunShapeBenchmark(size_t width, size_t height)
+{
+	Camera camera(width, height);
+	ConfigureCamera(camera);
+
+	unsigned long long packetCount = 200000;
+	if (COMMANDLINE_HAS_KEY("benchmark-packets"))
+	{
+		packetCount = COMMANDLINE_GET_INT_VALUE("benchmark-packets");
+	}
+
+	Sphereflake sphereflake(width, height);
+	sphereflake.SetView(camera.GetPosition(), camera.GetTopLeft(), camera.GetTopRight(), camera.GetBottomLeft());
+
+	const char* shapes[] = { "2x2", "4x2", "4x4", "8x1" };
+
+	for (auto name : shapes)
+	{
+		PacketShape shape;
+		PacketShape::Parse(name, shape);
+
+		// warm up caches and clocks before measuring
+		sphereflake.TracePackets(shape, packetCount / 10);
+
+		auto start = std::chrono::high_resolution_clock::now();
+		auto stats = sphereflake.TracePackets(shape, packetCount);
+		auto seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+
+		std::cout << "shape " << shape.ToString();
+		std::cout << " registers: " << shape.GetRegisterCount();
+		std::cout << " rays per second: " << (size_t) (stats.rays / seconds / 1000) << "k";
+		std::cout << " nodes per packet: " << (double) stats.nodesVisited / (double) stats.packets;
+		std::cout << " lane utilisation: " << 100.0 * (double) stats.activeLanes / (double) stats.laneSlots << "%" << std::endl;
+	}
+}
+
 int main(int argc, char* argv[])
 {
 	CommandLine::Instance().ParseCommandLine(argc, argv);
 
+	Trace::SetThreadName("main");
+
+	// before any worker starts so they all record from the same origin
+	if (COMMANDLINE_HAS_KEY("trace"))
+	{
+		Trace::Enable();
+	}
+
 	auto wndWidth = WND_WIDTH;
 	auto wndHeight = WND_HEIGHT;
 
@@ -373,6 +1081,12 @@ int main(int argc, char* argv[])
 		wndHeight = COMMANDLINE_GET_INT_VALUE("height");
 	}
 
+	if (COMMANDLINE_HAS_KEY("benchmark-shapes"))
+	{
+		RunShapeBenchmark(wndWidth, wndHeight);
+		return 0;
+	}
+
 	bool fullscreen = false;
 	if (COMMANDLINE_HAS_KEY("fullscreen"))
 	{
@@ -0,0 +1,218 @@
+/*
+ * Sphereflake Raytracer v1.0
+ *
+ * Copyright (c) 2014, Alexander Dzhoganov (alexander.dzhoganov@gmail.com)
+ * Permission to use, copy, modify, and/or distribute this software for any purpose with or without fee is hereby granted,
+ * provided that the above copyright notice and this permission notice appear in all copies.
+
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH REGARD TO THIS SOFTWARE
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE
+ * FOR ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION,
+ * ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+// Sphereflake::RenderFrame while the pool is resized and paused, every frame has to complete and come out identical
+// to an undisturbed render of the same view, and a view set afterwards has to be sampled, exits non-zero otherwise
+
+#pragma warning (push, 0)
+#pragma warning (disable: 4530) // disable warnings from code not under our control
+
+#include <iostream>
+#include <unordered_map>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <thread>
+#include <future>
+#include <functional>
+#include <random>
+#include <memory>
+#include <chrono>
+#include <limits>
+#include <cmath>
+
+#define GLM_FORCE_RADIANS
+#include <glm.hpp>
+#include <gtc/matrix_transform.hpp>
+#include <gtc/quaternion.hpp>
+#include <gtc/type_ptr.hpp>
+#include <gtx/quaternion.hpp>
+#include <gtx/simd_mat4.hpp>
+#include <gtx/simd_vec4.hpp>
+#include <gtx/transform.hpp>
+
+using namespace glm;
+
+#pragma warning (pop)
+
+#ifdef __ARCH_NO_AVX
+#include <tmmintrin.h>
+#include "SIMD_SSE.h"
+#else
+#include <immintrin.h>
+#include "SIMD_AVX.h"
+#endif
+
+#include "camera.h"
+#include "Sobol.h"
+#include "FrameArena.h"
+#include "Topology.h"
+#include "PerfCounters.h"
+#include "Sphereflake.h"
+
+// odd sizes leave partial tiles and packets at the right and bottom edges
+#define TEST_WIDTH 333
+#define TEST_HEIGHT 187
+
+#define TEST_WORKERS 4
+#define TEST_ROUNDS 64
+
+// a frame of this size takes milliseconds, anything near the timeout is a lost tile
+#define TEST_FRAME_TIMEOUT_SECONDS 30
+
+using namespace SphereflakeRaytracer;
+
+// far, medium and close-up views as x, y, z, pitch, yaw
+static const float testCameras[][5] =
+{
+	{ 0.0f, -12.0f, 4.0f, -1.25f, 0.0f },
+	{ -5.4098f, -7.2139f, 1.19006f, -1.371f, 0.921999f },
+	{ 1.638f, -0.254f, 0.305f, -1.5f, 0.3f },
+};
+
+void SetTestView(Sphereflake& sphereflake, size_t index)
+{
+	auto values = testCameras[index % (sizeof(testCameras) / sizeof(testCameras[0]))];
+
+	Camera camera(TEST_WIDTH, TEST_HEIGHT);
+	camera.SetPosition(vec3(values[0], values[1], values[2]));
+	camera.SetPitch(values[3]);
+	camera.SetYaw(values[4]);
+	sphereflake.SetView(camera.GetPosition(), camera.GetTopLeft(), camera.GetTopRight(), camera.GetBottomLeft());
+}
+
+// FNV-1a over the published front buffer
+unsigned long long HashGBuffer(const GBuffer& gbuffer)
+{
+	auto bytes = (const unsigned char*) gbuffer.texels;
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i = 0; i < TEST_WIDTH * TEST_HEIGHT * sizeof(GBufferTexel); i++)
+	{
+		hash = (hash ^ bytes[i]) * 1099511628211ULL;
+	}
+
+	return hash;
+}
+
+// disturb is called with the frame in flight, false if the frame did not complete in time
+bool RenderTestFrame(Sphereflake& sphereflake, size_t camera, const std::function<void()>& disturb, unsigned long long& hash)
+{
+	sphereflake.Pause();
+	SetTestView(sphereflake, camera);
+	auto frame = sphereflake.RenderFrame();
+	sphereflake.Resume();
+
+	disturb();
+
+	if (frame.wait_for(std::chrono::seconds(TEST_FRAME_TIMEOUT_SECONDS)) != std::future_status::ready)
+	{
+		return false;
+	}
+
+	frame.get();
+	hash = HashGBuffer(sphereflake.PublishGBuffer());
+	return true;
+}
+
+int main()
+{
+	Sphereflake sphereflake(TEST_WIDTH, TEST_HEIGHT);
+
+	ThreadPlacement placement;
+	placement.workerCount = TEST_WORKERS;
+	sphereflake.SetThreadPlacement(placement);
+
+	sphereflake.Pause();
+	SetTestView(sphereflake, 0);
+	sphereflake.Initialize();
+
+	auto cameraCount = sizeof(testCameras) / sizeof(testCameras[0]);
+
+	std::vector<unsigned long long> reference(cameraCount);
+	for (size_t camera = 0; camera < cameraCount; camera++)
+	{
+		if (!RenderTestFrame(sphereflake, camera, [] {}, reference[camera]))
+		{
+			std::cout << "reference frame " << camera << " did not complete" << std::endl;
+			return 1;
+		}
+	}
+
+	auto failures = 0;
+	for (size_t round = 0; round < TEST_ROUNDS; round++)
+	{
+		// shrinking retires workers that may hold claimed tiles, growing brings them back for the next round, and
+		// every fourth round the pool is also paused for a moment with tiles claimed
+		auto disturb = [&sphereflake, round]
+		{
+			sphereflake.SetWorkerCount(round % 2 == 0 ? 1 : TEST_WORKERS);
+
+			if (round % 4 == 1)
+			{
+				sphereflake.Pause();
+				std::this_thread::sleep_for(std::chrono::milliseconds(1));
+				sphereflake.Resume();
+			}
+		};
+
+		auto camera = round % cameraCount;
+		unsigned long long hash = 0;
+		if (!RenderTestFrame(sphereflake, camera, disturb, hash))
+		{
+			std::cout << "round " << round << ": frame did not complete" << std::endl;
+			return 1;
+		}
+
+		if (hash != reference[camera])
+		{
+			std::cout << "round " << round << ": frame differs from the undisturbed render" << std::endl;
+			failures++;
+		}
+	}
+
+	std::cout << TEST_ROUNDS << " frames, " << failures << " different" << std::endl;
+
+	// the workers park once a frame is done, a later view has to wake them up for frameless sampling again
+	sphereflake.SetWorkerCount(TEST_WORKERS);
+	unsigned long long hash = 0;
+	if (!RenderTestFrame(sphereflake, 0, [] {}, hash))
+	{
+		std::cout << "frame before the view change did not complete" << std::endl;
+		return 1;
+	}
+
+	auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(TEST_FRAME_TIMEOUT_SECONDS);
+	while (sphereflake.GetParkedWorkerCount() < TEST_WORKERS && std::chrono::steady_clock::now() < deadline)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	SetTestView(sphereflake, 1);
+	while (sphereflake.GetSampledPixelCount() == 0)
+	{
+		if (std::chrono::steady_clock::now() > deadline)
+		{
+			std::cout << "view after a frame: " << sphereflake.GetSampledPixelCount() << " pixels sampled, " <<
+				sphereflake.GetParkedWorkerCount() << " workers parked" << std::endl;
+			return 1;
+		}
+
+		std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	}
+
+	return failures == 0 ? 0 : 1;
+}